@@ -1,52 +1,383 @@
+#include <atomic>
 #include <condition_variable>
-#include <queue>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
-#include <functional>
 
+// Move-only задача с встроенным буфером: небольшие лямбды не требуют выделения памяти,
+// в отличие от std::function, которая копируема и уходит в кучу уже на паре захватов.
+class Task {
+    static constexpr size_t INLINE_SIZE = 48;
+
+    struct Ops {
+        void (*invoke)(void *);
+        void (*move)(void *dst, void *src);
+        void (*destroy)(void *);
+    };
+
+    template<class F>
+    static constexpr bool fitsInline = sizeof(F) <= INLINE_SIZE &&
+                                       alignof(F) <= alignof(std::max_align_t) &&
+                                       std::is_nothrow_move_constructible_v<F>;
+
+    template<class F>
+    static const Ops *inlineOps() {
+        static const Ops ops{
+            [](void *p) { (*static_cast<F *>(p))(); },
+            [](void *dst, void *src) {
+                new (dst) F(std::move(*static_cast<F *>(src)));
+                static_cast<F *>(src)->~F();
+            },
+            [](void *p) { static_cast<F *>(p)->~F(); }};
+        return &ops;
+    }
+
+    template<class F>
+    static const Ops *heapOps() {
+        static const Ops ops{
+            [](void *p) { (**static_cast<F **>(p))(); },
+            [](void *dst, void *src) { *static_cast<F **>(dst) = *static_cast<F **>(src); },
+            [](void *p) { delete *static_cast<F **>(p); }};
+        return &ops;
+    }
+
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+    const Ops *ops = nullptr;
+
+public:
+    Task() = default;
+
+    template<class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F &&f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (fitsInline<Fn>) {
+            new (storage) Fn(std::forward<F>(f));
+            ops = inlineOps<Fn>();
+        } else {
+            *reinterpret_cast<Fn **>(storage) = new Fn(std::forward<F>(f));
+            ops = heapOps<Fn>();
+        }
+    }
+
+    Task(Task &&other) noexcept {
+        if (other.ops) {
+            other.ops->move(storage, other.storage);
+            ops = other.ops;
+            other.ops = nullptr;
+        }
+    }
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other.ops) {
+                other.ops->move(storage, other.storage);
+                ops = other.ops;
+                other.ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() { reset(); }
+
+    explicit operator bool() const { return ops != nullptr; }
+
+    void operator()() { ops->invoke(storage); }
+
+    void reset() {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+};
+
+// Дек Chase-Lev фиксированной ёмкости: владелец кладёт и забирает с нижнего конца,
+// остальные воркеры крадут с верхнего. Индекс забирает тот, кто выиграл CAS по top,
+// а флаг full не даёт владельцу перезаписать слот, пока вор ещё выносит из него задачу.
+class WorkStealingDeque {
+    struct alignas(64) Slot {
+        std::atomic<bool> full{false};
+        Task task;
+    };
+
+    static constexpr int64_t CAPACITY = 1024;
+    static constexpr int64_t MASK = CAPACITY - 1;
+
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::unique_ptr<Slot[]> slots{new Slot[CAPACITY]};
+
+    static void takeFrom(Slot &slot, Task &out) {
+        out = std::move(slot.task);
+        slot.full.store(false, std::memory_order_release);
+    }
+
+public:
+    // Только поток-владелец. false - дек заполнен, задачу надо положить в общую очередь
+    bool push(Task &task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Slot &slot = slots[b & MASK];
+        if (b - t >= CAPACITY || slot.full.load(std::memory_order_acquire)) return false;
+        slot.task = std::move(task);
+        slot.full.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Только поток-владелец, LIFO
+    bool pop(Task &out) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        if (t == b) {
+            // Последний элемент: соревнуемся с ворами
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                   std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            if (!won) return false;
+        }
+        takeFrom(slots[b & MASK], out);
+        return true;
+    }
+
+    // Любой поток, FIFO
+    bool steal(Task &out) {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return false;
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            return false;
+        }
+        takeFrom(slots[t & MASK], out);
+        return true;
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+
+    size_t size() const {
+        int64_t n = bottom.load(std::memory_order_acquire) - top.load(std::memory_order_acquire);
+        return n > 0 ? static_cast<size_t>(n) : 0;
+    }
+};
+
+// Пул с кражей работы. Задачи, поставленные из воркера, идут в его собственный дек без
+// блокировок; задачи извне - в одну из шардированных очередей (своя на каждого воркера).
+// Простаивающие воркеры спят каждый на своей condition_variable; при новой задаче будится
+// ровно один и только если сейчас никто не ищет работу, поэтому нет "стада".
 class ThreadPool {
-    std::queue<std::function<void()>> tasks;
-    std::vector<std::thread> workers;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    bool stop = false;
+    struct Injector {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::atomic<size_t> size{0};
+    };
+
+    struct Worker {
+        WorkStealingDeque deque;
+        Injector injector;
+        std::mutex parkMutex;
+        std::condition_variable parkCondition;
+        bool notified = false;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<bool> stop{false};
+    std::atomic<int> searching{0};
+    std::atomic<int> idleCount{0};
+    std::mutex idleMutex;
+    std::vector<size_t> idle;
+    std::atomic<size_t> nextInjector{0};
+
+    // Пул и номер воркера текущего потока: enqueue из воркера идёт в его дек
+    static inline thread_local ThreadPool *currentPool = nullptr;
+    static inline thread_local size_t currentIndex = 0;
 
 public:
     ThreadPool(size_t threads) {
-        for(size_t i = 0; i < threads; ++i) {
-            workers.emplace_back([this] {
-                while(true) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(queue_mutex);
-                        condition.wait(lock,
-                                       [this]{ return stop || !tasks.empty(); });
-                        if(stop && tasks.empty()) return;
-                        task = std::move(tasks.front());
-                        tasks.pop();
-                    }
-                    task();
-                }
-            });
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back(new Worker);
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers[i]->thread = std::thread([this, i] { workerLoop(i); });
         }
     }
 
     template<class F>
     void enqueue(F&& f) {
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            tasks.emplace(std::forward<F>(f));
+        Task task(std::forward<F>(f));
+        if (currentPool == this && workers[currentIndex]->deque.push(task)) {
+            // уже в деке своего воркера
+        } else {
+            Injector &injector = workers[nextInjector.fetch_add(1, std::memory_order_relaxed) % workers.size()]->injector;
+            std::lock_guard<std::mutex> lock(injector.mutex);
+            injector.tasks.push_back(std::move(task));
+            injector.size.fetch_add(1, std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        notifyOne();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Приблизительное число задач, ожидающих выполнения
+    size_t pending() const {
+        size_t total = 0;
+        for (auto &worker : workers) {
+            total += worker->deque.size() + worker->injector.size.load(std::memory_order_relaxed);
         }
-        condition.notify_one();
+        return total;
     }
 
     ~ThreadPool() {
+        stop.store(true, std::memory_order_seq_cst);
+        for (auto &worker : workers) {
+            std::lock_guard<std::mutex> lock(worker->parkMutex);
+            worker->notified = true;
+            worker->parkCondition.notify_one();
+        }
+        for (auto &worker : workers)
+            worker->thread.join();
+    }
+
+private:
+    void notifyOne() {
+        if (searching.load(std::memory_order_seq_cst) != 0) return; // ищущий воркер сам найдёт задачу
+        if (idleCount.load(std::memory_order_seq_cst) == 0) return;
+
+        size_t index;
         {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            stop = true;
+            std::lock_guard<std::mutex> lock(idleMutex);
+            if (idle.empty()) return;
+            index = idle.back();
+            idle.pop_back();
+            idleCount.fetch_sub(1, std::memory_order_seq_cst);
+        }
+        // Разбуженный сразу считается ищущим, чтобы следующие enqueue не будили ещё кого-то
+        searching.fetch_add(1, std::memory_order_seq_cst);
+        Worker &worker = *workers[index];
+        std::lock_guard<std::mutex> lock(worker.parkMutex);
+        worker.notified = true;
+        worker.parkCondition.notify_one();
+    }
+
+    bool popInjector(Injector &injector, Task &out) {
+        if (injector.size.load(std::memory_order_relaxed) == 0) return false;
+        std::lock_guard<std::mutex> lock(injector.mutex);
+        if (injector.tasks.empty()) return false;
+        out = std::move(injector.tasks.front());
+        injector.tasks.pop_front();
+        injector.size.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool steal(size_t self, Task &out) {
+        size_t n = workers.size();
+        for (size_t k = 1; k <= n; ++k) {
+            Worker &victim = *workers[(self + k) % n];
+            if (victim.deque.steal(out) || popInjector(victim.injector, out)) return true;
+        }
+        return false;
+    }
+
+    bool hasWork() const {
+        for (auto &worker : workers) {
+            if (!worker->deque.empty() || worker->injector.size.load(std::memory_order_seq_cst) != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // true - разбудил notifyOne (воркер уже посчитан в searching)
+    bool park(size_t self) {
+        Worker &worker = *workers[self];
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            idle.push_back(self);
+            idleCount.fetch_add(1, std::memory_order_seq_cst);
+        }
+        // Повторная проверка после публикации себя в idle: задача, поставленная до этого
+        // момента, видна здесь, а поставленная после - увидит нас в idleCount
+        if (hasWork() || stop.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            for (size_t i = 0; i < idle.size(); ++i) {
+                if (idle[i] == self) {
+                    idle.erase(idle.begin() + i);
+                    idleCount.fetch_sub(1, std::memory_order_seq_cst);
+                    return false;
+                }
+            }
+            // Нас уже выбрал notifyOne - дожидаемся его уведомления ниже
+        }
+        std::unique_lock<std::mutex> lock(worker.parkMutex);
+        worker.parkCondition.wait(lock, [&worker] { return worker.notified; });
+        worker.notified = false;
+        return !stop.load(std::memory_order_relaxed);
+    }
+
+    void leaveSearching(bool found) {
+        // Последний ищущий нашёл задачу - возможно, есть ещё; будим следующего
+        if (searching.fetch_sub(1, std::memory_order_seq_cst) == 1 && found) notifyOne();
+    }
+
+    void workerLoop(size_t self) {
+        currentPool = this;
+        currentIndex = self;
+        Worker &worker = *workers[self];
+        bool isSearching = false;
+        Task task;
+
+        while (true) {
+            if (worker.deque.pop(task) || popInjector(worker.injector, task)) {
+                if (isSearching) {
+                    isSearching = false;
+                    leaveSearching(true);
+                }
+                task();
+                task.reset();
+                continue;
+            }
+
+            if (!isSearching) {
+                searching.fetch_add(1, std::memory_order_seq_cst);
+                isSearching = true;
+            }
+            if (steal(self, task)) {
+                isSearching = false;
+                leaveSearching(true);
+                task();
+                task.reset();
+                continue;
+            }
+            isSearching = false;
+            leaveSearching(false);
+
+            if (hasWork()) continue;
+            if (stop.load(std::memory_order_seq_cst)) return;
+            isSearching = park(self);
         }
-        condition.notify_all();
-        for(std::thread &worker: workers)
-            worker.join();
     }
 };
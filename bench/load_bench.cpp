@@ -0,0 +1,537 @@
+// Нагрузочный прогон сервера: TCP- и UDP-серверы запускаются в этом же процессе на
+// loopback (порты 8080 и 8081, каталог uploads/ - во временной папке), клиенты - потоки.
+// Нагрузки:
+//   echo, time           - clients соединений, в каждом до depth команд в полёте
+//   upload, download     - transfer-clients соединений гоняют файлы каждого размера из sizes
+//   udp_upload,          - UDP-передачи теми же UdpSender/UdpReceiver, что у сервера;
+//   udp_download           без потерь и с --udp-loss % потерь (имитация на обеих сторонах)
+// Задержка - от отправки команды до последнего байта ответа (для передач - всей передачи).
+// Вывод - CSV: workload,clients,depth,size,loss_pct,ops,errors,seconds,ops_per_sec,mb_per_sec,p50_us,p99_us,p999_us
+//
+//   load_bench [--duration S] [--clients N] [--depth N] [--transfer-clients N] [--sizes B,B,...]
+//              [--udp-loss P] [--udp-payload B] [--reactors N] [--io-uring] [--only w,w,...]
+#include "../libs.h"
+#include "../server/logger.h"
+#include "../server/storage.h"
+#include "../server/udp_transfer.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sstream>
+
+ServerConfig g_config;
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+    double duration = 2;
+    int clients = 16;
+    int depth = 16;
+    int transferClients = 4;
+    std::vector<size_t> sizes = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+    double udpLoss = 1;
+    uint32_t udpPayload = 8192;
+    std::vector<std::string> only;
+};
+
+static BenchOptions g_options;
+
+// Итог одного клиента; сводятся в строку CSV
+struct ClientResult {
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    std::vector<uint32_t> latencies;   // мкс
+
+    void record(Clock::time_point start, uint64_t transferred) {
+        ++ops;
+        bytes += transferred;
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+        latencies.push_back(static_cast<uint32_t>(std::min<long long>(micros, UINT32_MAX)));
+    }
+};
+
+static sockaddr_in loopback(uint16_t port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+static int connectTcp() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr = loopback(g_config.tcpPort);
+    if (fd == -1 || connect(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static bool sendAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// Буферизованное чтение ответов: строки и тела файлов
+class Reader {
+public:
+    explicit Reader(int fd) : fd(fd), buffer(256 * 1024) {}
+
+    bool readLine(std::string &line) {
+        while (true) {
+            auto *end = static_cast<char *>(memchr(buffer.data() + begin, '\n', filled - begin));
+            if (end) {
+                line.assign(buffer.data() + begin, end);
+                begin = end - buffer.data() + 1;
+                return true;
+            }
+            if (!fill()) return false;
+        }
+    }
+
+    // Пропускает size байт тела
+    bool skip(size_t size) {
+        while (size > 0) {
+            if (begin == filled && !fill()) return false;
+            size_t take = std::min(size, filled - begin);
+            begin += take;
+            size -= take;
+        }
+        return true;
+    }
+
+private:
+    bool fill() {
+        if (begin == filled) begin = filled = 0;
+        if (filled == buffer.size()) {
+            memmove(buffer.data(), buffer.data() + begin, filled - begin);
+            filled -= begin;
+            begin = 0;
+        }
+        ssize_t rc = recv(fd, buffer.data() + filled, buffer.size() - filled, 0);
+        if (rc <= 0) return false;
+        filled += rc;
+        return true;
+    }
+
+    int fd;
+    std::vector<char> buffer;
+    size_t begin = 0;
+    size_t filled = 0;
+};
+
+// Конвейер коротких команд: как только в полёте осталось не больше половины depth,
+// доливаем до depth одним send
+static void commandClient(const std::string &command, Clock::time_point deadline, ClientResult &result) {
+    int fd = connectTcp();
+    if (fd == -1) {
+        ++result.errors;
+        return;
+    }
+    Reader reader(fd);
+    std::vector<Clock::time_point> inflight(g_options.depth);
+    size_t head = 0, tail = 0;   // кольцо моментов отправки
+    std::string batch, line;
+    while (true) {
+        if (tail - head <= static_cast<size_t>(g_options.depth) / 2 && Clock::now() < deadline) {
+            batch.clear();
+            auto now = Clock::now();
+            while (tail - head < static_cast<size_t>(g_options.depth)) {
+                batch.append(command);
+                inflight[tail++ % inflight.size()] = now;
+            }
+            if (!sendAll(fd, batch.data(), batch.size())) {
+                ++result.errors;
+                break;
+            }
+        }
+        if (head == tail) break;
+        if (!reader.readLine(line)) {
+            ++result.errors;
+            break;
+        }
+        result.record(inflight[head++ % inflight.size()], 0);
+    }
+    close(fd);
+}
+
+static bool startsWith(const std::string &text, const char *prefix) {
+    return text.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Загрузка диапазоном на весь файл: без докачки, каждый раз пишется заново и проходит fsync
+static void uploadClient(int client, size_t size, Clock::time_point deadline, ClientResult &result) {
+    int fd = connectTcp();
+    if (fd == -1) {
+        ++result.errors;
+        return;
+    }
+    Reader reader(fd);
+    std::vector<char> body(size, 'u');
+    std::string command = "UPLOAD load_up_" + std::to_string(client) + ".bin " + std::to_string(size) + " 0 " +
+                          std::to_string(size) + "\n";
+    std::string line;
+    while (Clock::now() < deadline) {
+        auto start = Clock::now();
+        bool ok = sendAll(fd, command.data(), command.size()) && reader.readLine(line) && line == "READY 0" &&
+                  sendAll(fd, body.data(), body.size()) && reader.readLine(line) &&
+                  startsWith(line, "File upload complete.");
+        if (!ok) {
+            ++result.errors;
+            break;
+        }
+        result.record(start, size);
+    }
+    close(fd);
+}
+
+static void downloadClient(const std::string &name, size_t size, Clock::time_point deadline, ClientResult &result) {
+    int fd = connectTcp();
+    if (fd == -1) {
+        ++result.errors;
+        return;
+    }
+    Reader reader(fd);
+    std::string command = "DOWNLOAD " + name + "\n";
+    std::string expected = "READY " + std::to_string(size);
+    std::string line;
+    while (Clock::now() < deadline) {
+        auto start = Clock::now();
+        bool ok = sendAll(fd, command.data(), command.size()) && reader.readLine(line) && line == expected &&
+                  reader.skip(size);
+        if (!ok) {
+            ++result.errors;
+            break;
+        }
+        result.record(start, size);
+    }
+    close(fd);
+}
+
+// Клиентская сторона UDP-передачи на своём сокете: команда, READY, затем пакеты и ACK
+// тем же протоколом, что и у сервера
+class UdpClient {
+public:
+    UdpClient() : sock(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)), tx(sock, false),
+                  peer{&tx, loopback(g_config.udpPort)} {
+        int bufferSize = 4 * 1024 * 1024;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    }
+
+    ~UdpClient() { close(sock); }
+
+    // Ответ на команду; пакеты передачи, пришедшие раньше него, не ожидаются (loopback)
+    bool command(const std::string &text, std::string &reply) {
+        sendto(sock, text.data(), text.size(), 0, (const sockaddr *) &peer.addr, sizeof(peer.addr));
+        pollfd pfd{sock, POLLIN, 0};
+        if (poll(&pfd, 1, 2000) <= 0) return false;
+        char buffer[512];
+        ssize_t rc = recv(sock, buffer, sizeof(buffer), 0);
+        if (rc <= 0) return false;
+        reply.assign(buffer, rc);
+        return startsWith(reply, "READY");
+    }
+
+    bool download(uint64_t size, uint32_t payload, int sink) {
+        UdpReceiver receiver(sink, size, payload);
+        return run([&](const char *data, size_t length, UdpClock::time_point now) {
+            receiver.onPacket(peer, data, length, now);
+        }, [&](UdpClock::time_point now) {
+            receiver.flushAck(peer);
+            receiver.onTimer(now);
+            if (receiver.finished() || receiver.failed()) return 0;
+            return 1 + static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    receiver.nextDeadline() - now).count());
+        }) && receiver.finished();
+    }
+
+    bool upload(int source, uint64_t size, uint32_t payload) {
+        UdpSender sender(source, size, payload, static_cast<uint32_t>(g_config.udpWindow));
+        sender.pump(peer, UdpClock::now());
+        return run([&](const char *data, size_t length, UdpClock::time_point now) {
+            UdpAck ack;
+            if (parseAck(data, length, ack)) sender.onAck(peer, ack, now);
+        }, [&](UdpClock::time_point now) {
+            sender.pump(peer, now);
+            if (sender.finished() || sender.failed()) return 0;
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(sender.nextDeadline() - now).count();
+            return 1 + static_cast<int>(std::clamp<long long>(wait, 0, 1000));
+        }) && sender.finished();
+    }
+
+private:
+    // onDatagram - на каждый принятый пакет; onIdle - после пачки, возвращает сколько ждать (мс), 0 - конец
+    template<class OnDatagram, class OnIdle>
+    bool run(OnDatagram onDatagram, OnIdle onIdle) {
+        char buffer[UDP_MAX_PAYLOAD + UDP_HEADER_SIZE];
+        while (true) {
+            tx.flush();
+            int timeout = onIdle(UdpClock::now());
+            tx.flush();
+            if (timeout == 0) return true;
+            pollfd pfd{sock, POLLIN, 0};
+            if (poll(&pfd, 1, timeout) < 0) return false;
+            ssize_t rc;
+            while ((rc = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                onDatagram(buffer, static_cast<size_t>(rc), UdpClock::now());
+            }
+        }
+    }
+
+    int sock;
+    UdpTxBatch tx;
+    UdpPeer peer;
+};
+
+static void udpDownloadClient(const std::string &name, size_t size, Clock::time_point deadline,
+                              ClientResult &result) {
+    int sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    std::string command = "UDP_DOWNLOAD " + name + " PAYLOAD=" + std::to_string(g_options.udpPayload);
+    std::string reply;
+    while (Clock::now() < deadline) {
+        UdpClient client;
+        auto start = Clock::now();
+        uint64_t fileSize = 0;
+        uint32_t payload = 0;
+        bool ok = client.command(command, reply);
+        if (ok) {
+            std::string ready;
+            std::istringstream(reply) >> ready >> fileSize >> payload;
+            ok = fileSize == size && payload != 0 && client.download(fileSize, payload, sink);
+        }
+        if (!ok) {
+            ++result.errors;
+            break;
+        }
+        result.record(start, size);
+    }
+    close(sink);
+}
+
+static void udpUploadClient(int client, const std::string &source, size_t size, Clock::time_point deadline,
+                            ClientResult &result) {
+    int fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    std::string command = "UDP_UPLOAD load_udp_" + std::to_string(client) + ".bin " + std::to_string(size) +
+                          " PAYLOAD=" + std::to_string(g_options.udpPayload);
+    std::string reply;
+    while (fd != -1 && Clock::now() < deadline) {
+        UdpClient udp;
+        auto start = Clock::now();
+        uint32_t payload = 0;
+        bool ok = udp.command(command, reply);
+        if (ok) {
+            std::string ready;
+            std::istringstream(reply) >> ready >> payload;
+            ok = payload != 0 && udp.upload(fd, size, payload);
+        }
+        if (!ok) {
+            ++result.errors;
+            break;
+        }
+        result.record(start, size);
+    }
+    if (fd == -1) ++result.errors;
+    else close(fd);
+}
+
+static bool selected(const char *workload) {
+    if (g_options.only.empty()) return true;
+    return std::find(g_options.only.begin(), g_options.only.end(), workload) != g_options.only.end();
+}
+
+static double percentile(const std::vector<uint32_t> &sorted, double q) {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()))];
+}
+
+// Запускает clients потоков body(i, deadline, result) и печатает строку CSV
+template<class Body>
+static void runWorkload(const char *workload, int clients, int depth, size_t size, double lossPercent, Body body) {
+    g_config.udpLossPercent = lossPercent;
+    std::vector<ClientResult> results(clients);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(g_options.duration));
+    for (int i = 0; i < clients; ++i) {
+        threads.emplace_back([&, i] { body(i, deadline, results[i]); });
+    }
+    for (std::thread &thread : threads) thread.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    g_config.udpLossPercent = 0;
+
+    ClientResult total;
+    for (ClientResult &result : results) {
+        total.ops += result.ops;
+        total.errors += result.errors;
+        total.bytes += result.bytes;
+        total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    std::printf("%s,%d,%d,%zu,%.1f,%llu,%llu,%.3f,%.0f,%.1f,%.0f,%.0f,%.0f\n", workload, clients, depth, size,
+                lossPercent, static_cast<unsigned long long>(total.ops),
+                static_cast<unsigned long long>(total.errors), seconds, total.ops / seconds,
+                total.bytes / seconds / 1e6, percentile(total.latencies, 0.5), percentile(total.latencies, 0.99),
+                percentile(total.latencies, 0.999));
+    std::fflush(stdout);
+}
+
+static bool writeFile(const std::string &path, size_t size) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    std::vector<char> block(1024 * 1024);
+    for (size_t i = 0; i < block.size(); ++i) block[i] = static_cast<char>(i * 7 + i / 251);
+    for (size_t written = 0; written < size; written += block.size()) {
+        out.write(block.data(), static_cast<std::streamsize>(std::min(block.size(), size - written)));
+    }
+    return static_cast<bool>(out);
+}
+
+static std::vector<std::string> splitList(const std::string &text) {
+    std::vector<std::string> items;
+    std::istringstream stream(text);
+    for (std::string item; std::getline(stream, item, ',');) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+static bool parseArguments(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--duration" && hasValue) {
+            g_options.duration = std::atof(argv[++i]);
+        } else if (arg == "--clients" && hasValue) {
+            g_options.clients = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--depth" && hasValue) {
+            g_options.depth = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--transfer-clients" && hasValue) {
+            g_options.transferClients = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--sizes" && hasValue) {
+            g_options.sizes.clear();
+            for (const std::string &size : splitList(argv[++i])) g_options.sizes.push_back(std::stoull(size));
+        } else if (arg == "--udp-loss" && hasValue) {
+            g_options.udpLoss = std::atof(argv[++i]);
+        } else if (arg == "--udp-payload" && hasValue) {
+            g_options.udpPayload = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (arg == "--reactors" && hasValue) {
+            g_config.reactors = std::atoi(argv[++i]);
+        } else if (arg == "--io-uring") {
+            g_config.ioUring = true;
+        } else if (arg == "--only" && hasValue) {
+            g_options.only = splitList(argv[++i]);
+        } else {
+            std::fprintf(stderr, "usage: %s [--duration S] [--clients N] [--depth N] [--transfer-clients N] "
+                                 "[--sizes B,B,...] [--udp-loss P] [--udp-payload B] [--reactors N] [--io-uring] "
+                                 "[--only echo,time,upload,download,udp_upload,udp_download]\n", argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    g_config.metricsPort = 0;
+    g_config.tcpBind = g_config.udpBind = "127.0.0.1";
+    if (!parseArguments(argc, argv)) return EXIT_FAILURE;
+    // Журнал сервера - только предупреждения, чтобы не мерить вывод в терминал
+    setLogLevel(LogLevel::Warn);
+
+    int probe = connectTcp();
+    if (probe != -1) {
+        close(probe);
+        std::fprintf(stderr, "port %d is already in use, stop the running server first\n", g_config.tcpPort);
+        return EXIT_FAILURE;
+    }
+    char workdir[] = "/tmp/load_bench.XXXXXX";
+    if (!mkdtemp(workdir) || chdir(workdir) != 0) {
+        std::fprintf(stderr, "cannot create a working directory\n");
+        return EXIT_FAILURE;
+    }
+    std::filesystem::create_directories(g_config.storageRoot);
+    for (size_t size : g_options.sizes) {
+        // Файл в корне хранилища storage().open перенесёт в его шард
+        writeFile(g_config.storageRoot + "/load_" + std::to_string(size) + ".bin", size);
+        writeFile("source_" + std::to_string(size) + ".bin", size);
+    }
+    if (!storage().open(g_config.storageRoot)) return EXIT_FAILURE;
+
+    initializeSockets();
+    int serverSocket = createTcpSocket();
+    std::thread tcpThread([serverSocket] { handleTCPServer(serverSocket); });
+    std::thread udpThread(handleUDPServer);
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = connectTcp();
+        if (fd != -1) {
+            close(fd);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    std::printf("workload,clients,depth,size,loss_pct,ops,errors,seconds,ops_per_sec,mb_per_sec,"
+                "p50_us,p99_us,p999_us\n");
+    int clients = g_options.clients, transferClients = g_options.transferClients, depth = g_options.depth;
+    if (selected("echo")) {
+        runWorkload("echo", clients, depth, 0, 0, [](int, Clock::time_point deadline, ClientResult &result) {
+            commandClient("ECHO load\n", deadline, result);
+        });
+    }
+    if (selected("time")) {
+        runWorkload("time", clients, depth, 0, 0, [](int, Clock::time_point deadline, ClientResult &result) {
+            commandClient("TIME\n", deadline, result);
+        });
+    }
+    for (size_t size : g_options.sizes) {
+        std::string name = "load_" + std::to_string(size) + ".bin";
+        std::string source = "source_" + std::to_string(size) + ".bin";
+        if (selected("upload")) {
+            runWorkload("upload", transferClients, 1, size, 0,
+                        [size](int i, Clock::time_point deadline, ClientResult &result) {
+                            uploadClient(i, size, deadline, result);
+                        });
+        }
+        if (selected("download")) {
+            runWorkload("download", transferClients, 1, size, 0,
+                        [&name, size](int, Clock::time_point deadline, ClientResult &result) {
+                            downloadClient(name, size, deadline, result);
+                        });
+        }
+        std::vector<double> losses = {0};
+        if (g_options.udpLoss > 0) losses.push_back(g_options.udpLoss);
+        for (double loss : losses) {
+            if (selected("udp_upload")) {
+                runWorkload("udp_upload", transferClients, 1, size, loss,
+                            [&source, size](int i, Clock::time_point deadline, ClientResult &result) {
+                                udpUploadClient(i, source, size, deadline, result);
+                            });
+            }
+            if (selected("udp_download")) {
+                runWorkload("udp_download", transferClients, 1, size, loss,
+                            [&name, size](int, Clock::time_point deadline, ClientResult &result) {
+                                udpDownloadClient(name, size, deadline, result);
+                            });
+            }
+        }
+    }
+
+    g_shutdown = 1;
+    tcpThread.join();
+    udpThread.join();
+    closeSockets(serverSocket, EXIT_SUCCESS);
+    std::filesystem::remove_all(workdir);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+// Цена журнала на горячем пути: ECHO-петли в нескольких потоках (как реакторы сервера),
+// каждая команда пишет строку журнала. Клиент шлёт команды пачками и ждёт ответов.
+//   off           - server/logger с уровнем off: остаётся только проверка уровня
+//   sync          - как прежний log_message: общий мьютекс и std::endl (write на строку)
+//   async         - server/logger без ограничения частоты
+//   async_limited - server/logger с ограничением по умолчанию (1000 строк/с на место в потоке)
+// Журнал пишется в /dev/null, так что меряется сам механизм, а не диск или терминал.
+// Вывод - CSV: mode,threads,commands,seconds,commands_per_sec,log_lines,log_dropped,log_suppressed
+//
+//   log_bench [threads] [commands_per_thread]
+#include "../server/logger.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int BATCH = 32;   // команд в полёте на соединение
+
+enum class Mode { Off, Sync, Async, AsyncLimited };
+
+static std::mutex g_syncMutex;
+static std::ofstream g_syncOut("/dev/null");
+
+static void logCommand(Mode mode, int worker, std::string_view line) {
+    if (mode == Mode::Sync) {
+        std::lock_guard<std::mutex> lock(g_syncMutex);
+        g_syncOut << "[LOG] worker " << worker << " command: " << line << std::endl;
+        return;
+    }
+    LOG_INFO("bench", "command", "worker=%d line=\"%.*s\"", worker, static_cast<int>(line.size()), line.data());
+}
+
+static bool sendAll(int fd, const std::string &data) {
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t rc = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (rc <= 0) return false;
+        sent += rc;
+    }
+    return true;
+}
+
+// Сторона сервера: разбор строк, журнал, ответ на всё прочитанное одним send
+static void serveEcho(int fd, Mode mode, int worker) {
+    std::string input, output;
+    char buffer[64 * 1024];
+    while (true) {
+        ssize_t rc = recv(fd, buffer, sizeof(buffer), 0);
+        if (rc <= 0) break;
+        input.append(buffer, rc);
+        size_t pos = 0, end;
+        while ((end = input.find('\n', pos)) != std::string::npos) {
+            std::string_view line(input.data() + pos, end - pos);
+            logCommand(mode, worker, line);
+            if (line.rfind("ECHO ", 0) == 0) output.append(line.substr(5));
+            output.push_back('\n');
+            pos = end + 1;
+        }
+        input.erase(0, pos);
+        if (!sendAll(fd, output)) break;
+        output.clear();
+    }
+}
+
+// Сторона клиента: пачка из BATCH команд, затем ровно BATCH строк ответа
+static void driveClient(int fd, size_t commands) {
+    std::string batch;
+    char buffer[64 * 1024];
+    for (size_t done = 0; done < commands; done += BATCH) {
+        batch.clear();
+        for (int i = 0; i < BATCH; ++i) batch.append("ECHO hello " + std::to_string(done + i) + "\n");
+        if (!sendAll(fd, batch)) return;
+        int replies = 0;
+        while (replies < BATCH) {
+            ssize_t rc = recv(fd, buffer, sizeof(buffer), 0);
+            if (rc <= 0) return;
+            for (ssize_t i = 0; i < rc; ++i) replies += buffer[i] == '\n';
+        }
+    }
+    shutdown(fd, SHUT_WR);
+}
+
+static void run(const char *name, Mode mode, int threads, size_t commands) {
+    setLogLevel(mode == Mode::Off ? LogLevel::Off : LogLevel::Info);
+    setLogRate(mode == Mode::AsyncLimited ? 1000 : 0);
+    LogStats before = logStats();
+
+    std::vector<std::thread> workers;
+    std::vector<int> clientFds;
+    auto start = Clock::now();
+    for (int i = 0; i < threads; ++i) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) std::exit(1);
+        clientFds.push_back(fds[0]);
+        workers.emplace_back([fd = fds[1], mode, i] {
+            serveEcho(fd, mode, i);
+            close(fd);
+        });
+        workers.emplace_back([fd = fds[0], commands] { driveClient(fd, commands); });
+    }
+    for (std::thread &worker : workers) worker.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    for (int fd : clientFds) close(fd);
+
+    // Строки, ещё лежащие в кольцах, попадут в следующий прогон: даём фоновому потоку их дописать
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    LogStats after = logStats();
+    size_t total = commands * threads;
+    std::printf("%s,%d,%zu,%.3f,%.0f,%llu,%llu,%llu\n", name, threads, total, seconds, total / seconds,
+                static_cast<unsigned long long>(after.written - before.written),
+                static_cast<unsigned long long>(after.dropped - before.dropped),
+                static_cast<unsigned long long>(after.suppressed - before.suppressed));
+    std::fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? std::atoi(argv[1]) : 4;
+    size_t commands = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    commands = (commands + BATCH - 1) / BATCH * BATCH;
+
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    setLogOutput(devNull, devNull);
+
+    std::printf("mode,threads,commands,seconds,commands_per_sec,log_lines,log_dropped,log_suppressed\n");
+    run("off", Mode::Off, threads, commands);
+    run("sync", Mode::Sync, threads, commands);
+    run("async", Mode::Async, threads, commands);
+    run("async_limited", Mode::AsyncLimited, threads, commands);
+    return 0;
+}
@@ -0,0 +1,200 @@
+// Цена и выигрыш сжатия передач (server/lz4): кадры по LZ4_FRAME_BLOCK, как в
+// DOWNLOAD/UPLOAD ... LZ4. Для каждого вида данных - степень сжатия, скорость сжатия
+// и распаковки на одно ядро, реальная передача через loopback-сокет (сжатие в потоке
+// отправителя, распаковка в потоке получателя) и оценка полезной скорости на канале
+// 1 и 10 Гбит/с: min(скорость сжатия, канал / доля сжатых байт).
+// Вывод - CSV: payload,bytes,ratio,compress_gb_per_sec,decompress_gb_per_sec,
+//              loopback_raw_gb_per_sec,loopback_lz4_gb_per_sec,effective_gbit_1g,effective_gbit_10g
+//
+//   lz4_bench [megabytes]
+#include "../server/lz4.h"
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Журнал веб-сервера: повторяющиеся поля и немного меняющихся чисел
+static std::vector<char> makeLog(size_t size) {
+    static const char *paths[] = {"/index.html", "/api/v1/files", "/static/app.js", "/upload", "/health"};
+    static const char *agents[] = {"curl/8.5.0", "Mozilla/5.0 (X11; Linux x86_64)", "python-requests/2.31"};
+    std::mt19937 rng(42);
+    std::string text;
+    char line[256];
+    while (text.size() < size) {
+        int n = std::snprintf(line, sizeof(line),
+                              "10.0.%u.%u - - [17/Oct/2026:12:%02u:%02u +0000] \"GET %s HTTP/1.1\" %u %u \"-\" \"%s\"\n",
+                              static_cast<unsigned>(rng() % 256), static_cast<unsigned>(rng() % 256),
+                              static_cast<unsigned>(rng() % 60), static_cast<unsigned>(rng() % 60), paths[rng() % 5],
+                              rng() % 4 ? 200u : 404u, static_cast<unsigned>(rng() % 100000), agents[rng() % 3]);
+        text.append(line, n);
+    }
+    return std::vector<char>(text.begin(), text.begin() + size);
+}
+
+static std::vector<char> makeRandom(size_t size) {
+    std::vector<char> data(size);
+    std::mt19937_64 rng(7);
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t value = rng();
+        std::memcpy(&data[i], &value, sizeof(value));
+    }
+    return data;
+}
+
+// Таблица значений: числа, похожие на соседние, и много нулей
+static std::vector<char> makeBinary(size_t size) {
+    std::vector<char> data(size);
+    std::mt19937 rng(3);
+    for (size_t i = 0; i + 16 <= size; i += 16) {
+        uint32_t record[4] = {static_cast<uint32_t>(i / 16), static_cast<uint32_t>(rng() % 1000), 0,
+                              static_cast<uint32_t>(rng() % 4 ? 0 : rng())};
+        std::memcpy(&data[i], record, sizeof(record));
+    }
+    return data;
+}
+
+static std::string compressAll(const std::vector<char> &data) {
+    std::string out;
+    out.reserve(data.size() + data.size() / 64);
+    for (size_t offset = 0; offset < data.size(); offset += LZ4_FRAME_BLOCK) {
+        lz4AppendFrame(out, data.data() + offset, std::min(LZ4_FRAME_BLOCK, data.size() - offset));
+    }
+    return out;
+}
+
+// Разбирает кадры как сервер при UPLOAD ... LZ4, прямо в out; false - поток повреждён
+static bool decompressAll(const char *frames, size_t size, std::vector<char> &out) {
+    size_t pos = 0, written = 0;
+    while (pos + LZ4_FRAME_HEADER <= size) {
+        uint32_t header[2];
+        std::memcpy(header, frames + pos, sizeof(header));
+        size_t stored = ntohl(header[0]), raw = ntohl(header[1]);
+        pos += LZ4_FRAME_HEADER;
+        if (raw > LZ4_FRAME_BLOCK || stored > raw || pos + stored > size || raw > out.size() - written) return false;
+        if (stored == raw) {
+            std::memcpy(out.data() + written, frames + pos, raw);
+        } else if (!lz4Decompress(frames + pos, stored, out.data() + written, raw)) {
+            return false;
+        }
+        pos += stored;
+        written += raw;
+    }
+    return pos == size && written == out.size();
+}
+
+static bool sendAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// Передача через пару сокетов: без сжатия - как есть, со сжатием - кадр за кадром,
+// получатель распаковывает каждый кадр. Возвращает исходных ГБ/с.
+static double loopback(const std::vector<char> &data, bool compress) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 0;
+    int buffer = 4 * 1024 * 1024;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+    auto start = Clock::now();
+    std::thread sender([&] {
+        std::string frame;
+        for (size_t offset = 0; offset < data.size(); offset += LZ4_FRAME_BLOCK) {
+            size_t size = std::min(LZ4_FRAME_BLOCK, data.size() - offset);
+            if (!compress) {
+                if (!sendAll(fds[0], data.data() + offset, size)) break;
+                continue;
+            }
+            frame.clear();
+            lz4AppendFrame(frame, data.data() + offset, size);
+            if (!sendAll(fds[0], frame.data(), frame.size())) break;
+        }
+        shutdown(fds[0], SHUT_WR);
+    });
+
+    std::vector<char> input(256 * 1024);
+    std::vector<char> block(LZ4_FRAME_BLOCK);
+    size_t have = 0, received = 0;
+    while (true) {
+        ssize_t rc = recv(fds[1], input.data() + have, input.size() - have, 0);
+        if (rc <= 0) break;
+        if (!compress) {
+            received += rc;
+            continue;
+        }
+        have += rc;
+        size_t pos = 0;
+        while (have - pos >= LZ4_FRAME_HEADER) {
+            uint32_t header[2];
+            std::memcpy(header, input.data() + pos, sizeof(header));
+            size_t stored = ntohl(header[0]), raw = ntohl(header[1]);
+            if (have - pos < LZ4_FRAME_HEADER + stored) break;
+            if (stored < raw) lz4Decompress(input.data() + pos + LZ4_FRAME_HEADER, stored, block.data(), raw);
+            received += raw;
+            pos += LZ4_FRAME_HEADER + stored;
+        }
+        std::memmove(input.data(), input.data() + pos, have - pos);
+        have -= pos;
+    }
+    double seconds = secondsSince(start);
+    sender.join();
+    close(fds[0]);
+    close(fds[1]);
+    return received == data.size() ? data.size() / seconds / 1e9 : 0;
+}
+
+static void measure(const char *name, const std::vector<char> &data) {
+    compressAll(data);   // прогрев: страницы выходного буфера и кэш
+    auto start = Clock::now();
+    std::string frames = compressAll(data);
+    double compressSeconds = secondsSince(start);
+
+    std::vector<char> restored(data.size());
+    start = Clock::now();
+    bool ok = decompressAll(frames.data(), frames.size(), restored);
+    double decompressSeconds = secondsSince(start);
+    if (!ok || restored != data) {
+        std::fprintf(stderr, "%s: round trip mismatch\n", name);
+        std::exit(1);
+    }
+
+    double ratio = static_cast<double>(data.size()) / frames.size();
+    double compressRate = data.size() / compressSeconds / 1e9;
+    double decompressRate = data.size() / decompressSeconds / 1e9;
+    // Полезные Гбит/с на канале link: упираемся либо в канал, либо в сжатие одним ядром
+    auto effective = [&](double linkGbit) { return std::min(compressRate * 8, linkGbit * ratio); };
+    std::printf("%s,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", name, data.size(), ratio, compressRate,
+                decompressRate, loopback(data, false), loopback(data, true), effective(1), effective(10));
+    std::fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 256;
+    size_t size = megabytes * 1024 * 1024;
+
+    std::printf("payload,bytes,ratio,compress_gb_per_sec,decompress_gb_per_sec,"
+                "loopback_raw_gb_per_sec,loopback_lz4_gb_per_sec,effective_gbit_1g,effective_gbit_10g\n");
+    measure("text_log", makeLog(size));
+    measure("binary_table", makeBinary(size));
+    measure("random", makeRandom(size));
+    return 0;
+}
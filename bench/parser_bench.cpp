@@ -0,0 +1,131 @@
+// Разбор конвейера команд ECHO/TIME: прежний разбор на std::string (substr, erase,
+// цепочка rfind) против string_view-разбора из server/protocol.h поверх InputBuffer.
+// Данные подаются кусками, как их отдаёт recv; ответы копятся в outBuf и «отправляются»
+// очисткой. Вывод - CSV: parser,commands,cmds_per_sec,allocs_per_cmd
+//
+//   parser_bench [commands]
+#include "../server/protocol.h"
+#include "../server/session.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+// Счётчик выделений памяти: за время замера нового разбора он не должен расти
+static size_t g_allocations = 0;
+
+void *operator new(size_t size) {
+    ++g_allocations;
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+constexpr size_t RECV_CHUNK = 64 * 1024;
+constexpr size_t OUTPUT_FLUSH = 64 * 1024;
+
+static std::string makeInput(size_t commands) {
+    std::string input;
+    for (size_t i = 0; i < commands; ++i) {
+        input += (i % 4 == 3) ? "TIME\r\n" : "ECHO pipelined request " + std::to_string(i % 1000) + "\n";
+    }
+    return input;
+}
+
+// Прежний разбор из handleClient/dispatchCommand, оставлен как базовая линия
+static size_t runLegacy(const std::string &input) {
+    std::string inBuf, outBuf;
+    size_t handled = 0;
+    for (size_t offset = 0; offset < input.size(); offset += RECV_CHUNK) {
+        inBuf.append(input, offset, RECV_CHUNK);
+        size_t pos;
+        while ((pos = inBuf.find('\n')) != std::string::npos) {
+            std::string command = inBuf.substr(0, pos);
+            inBuf.erase(0, pos + 1);
+            if (!command.empty() && command.back() == '\r') command.pop_back();
+
+            if (command.rfind("ECHO ", 0) == 0) {
+                outBuf += command.substr(5) + '\n';
+            } else if (command == "TIME") {
+                auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+                std::string timeStr = ctime(&now);
+                timeStr.pop_back();
+                timeStr += '\n';
+                outBuf += timeStr;
+            } else {
+                outBuf += "Unknown command\n";
+            }
+            ++handled;
+            if (outBuf.size() > OUTPUT_FLUSH) outBuf.clear();
+        }
+    }
+    return handled;
+}
+
+static size_t runStringView(const std::string &input, InputBuffer &inBuf, std::string &outBuf) {
+    size_t handled = 0;
+    size_t offset = 0;
+    while (offset < input.size()) {
+        char *space;
+        size_t room = inBuf.prepare(SESSION_INPUT_LIMIT, space);
+        size_t take = std::min({room, RECV_CHUNK, input.size() - offset});
+        memcpy(space, input.data() + offset, take);
+        inBuf.commit(take);
+        offset += take;
+
+        std::string_view view = inBuf.view();
+        size_t pos = 0, end;
+        while ((end = view.find('\n', pos)) != std::string_view::npos) {
+            ParsedCommand command = parseCommand(view.substr(pos, end - pos));
+            pos = end + 1;
+            switch (command.id) {
+                case CommandId::Echo:
+                    outBuf.append(command.args);
+                    outBuf.push_back('\n');
+                    break;
+                case CommandId::Time: {
+                    char buffer[32];
+                    outBuf.append(formatTime(buffer));
+                    outBuf.push_back('\n');
+                    break;
+                }
+                default:
+                    outBuf.append("Unknown command\n");
+            }
+            ++handled;
+            if (outBuf.size() > OUTPUT_FLUSH) outBuf.clear();
+        }
+        inBuf.consume(pos);
+    }
+    return handled;
+}
+
+template<class F>
+static void measure(const char *name, size_t commands, F &&run) {
+    size_t allocationsBefore = g_allocations;
+    auto start = std::chrono::steady_clock::now();
+    size_t handled = run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t allocations = g_allocations - allocationsBefore;
+    std::printf("%s,%zu,%.0f,%.3f\n", name, handled, handled / seconds, double(allocations) / commands);
+    std::fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    size_t commands = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000000;
+    std::string input = makeInput(commands);
+
+    std::printf("parser,commands,cmds_per_sec,allocs_per_cmd\n");
+    measure("legacy_string", commands, [&] { return runLegacy(input); });
+
+    // Буферы сессии прогреты, как у переиспользованной сессии из пула
+    InputBuffer inBuf;
+    std::string outBuf;
+    outBuf.reserve(OUTPUT_FLUSH + SESSION_RETAINED_CAPACITY);
+    runStringView(input.substr(0, RECV_CHUNK * 2), inBuf, outBuf);
+    measure("string_view", commands, [&] { return runStringView(input, inBuf, outBuf); });
+    return 0;
+}
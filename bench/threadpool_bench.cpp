@@ -0,0 +1,167 @@
+// Сравнение ThreadPool (кража работы) с прежним пулом на mutex + condition_variable.
+// Вывод - CSV: pool,scenario,threads,tasks,ops_per_sec,p50_us,p99_us,p999_us
+//
+//   threadpool_bench [tasks_per_run]
+#include "../ThreadPool.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include <string>
+
+// Прежняя реализация пула, оставлена как базовая линия для сравнения
+class MutexThreadPool {
+    std::queue<std::function<void()>> tasks;
+    std::vector<std::thread> workers;
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    bool stop = false;
+
+public:
+    MutexThreadPool(size_t threads) {
+        for(size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this] {
+                while(true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(queue_mutex);
+                        condition.wait(lock,
+                                       [this]{ return stop || !tasks.empty(); });
+                        if(stop && tasks.empty()) return;
+                        task = std::move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    template<class F>
+    void enqueue(F&& f) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            tasks.emplace(std::forward<F>(f));
+        }
+        condition.notify_one();
+    }
+
+    ~MutexThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for(std::thread &worker: workers)
+            worker.join();
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+
+static uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static void waitFor(const std::atomic<size_t> &counter, size_t target) {
+    while (counter.load(std::memory_order_acquire) < target) {
+        std::this_thread::yield();
+    }
+}
+
+static double percentileUs(std::vector<uint64_t> &samples, double p) {
+    if (samples.empty()) return 0;
+    size_t index = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index] / 1000.0;
+}
+
+static void report(const char *pool, const char *scenario, size_t threads, size_t tasks,
+                   double seconds, std::vector<uint64_t> *latencies) {
+    double p50 = 0, p99 = 0, p999 = 0;
+    if (latencies) {
+        p50 = percentileUs(*latencies, 0.50);
+        p99 = percentileUs(*latencies, 0.99);
+        p999 = percentileUs(*latencies, 0.999);
+    }
+    std::printf("%s,%s,%zu,%zu,%.0f,%.2f,%.2f,%.2f\n", pool, scenario, threads, tasks,
+                tasks / seconds, p50, p99, p999);
+    std::fflush(stdout);
+}
+
+// Один внешний поток ставит задачи так быстро, как может
+template<class Pool>
+static void runThroughput(const char *name, size_t threads, size_t tasks) {
+    std::atomic<size_t> done{0};
+    Pool pool(threads);
+    auto start = Clock::now();
+    for (size_t i = 0; i < tasks; ++i) {
+        pool.enqueue([&done] { done.fetch_add(1, std::memory_order_release); });
+    }
+    waitFor(done, tasks);
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    report(name, "throughput", threads, tasks, seconds, nullptr);
+}
+
+// Задачи ставятся пачками по 16, меряется задержка от enqueue до начала выполнения
+template<class Pool>
+static void runLatency(const char *name, size_t threads, size_t tasks) {
+    std::atomic<size_t> done{0};
+    std::vector<uint64_t> latencies(tasks);
+    Pool pool(threads);
+    auto start = Clock::now();
+    for (size_t i = 0; i < tasks; ++i) {
+        uint64_t submitted = nowNs();
+        pool.enqueue([&done, &latencies, i, submitted] {
+            latencies[i] = nowNs() - submitted;
+            done.fetch_add(1, std::memory_order_release);
+        });
+        if (i % 16 == 15) waitFor(done, i - 15);
+    }
+    waitFor(done, tasks);
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    report(name, "latency", threads, tasks, seconds, &latencies);
+}
+
+// Fork-join: каждая задача порождает две дочерние из воркера, пока не наберётся tasks
+template<class Pool>
+static void spawnTree(Pool &pool, std::atomic<size_t> &done, size_t depth) {
+    if (depth > 0) {
+        pool.enqueue([&pool, &done, depth] { spawnTree(pool, done, depth - 1); });
+        pool.enqueue([&pool, &done, depth] { spawnTree(pool, done, depth - 1); });
+    }
+    done.fetch_add(1, std::memory_order_release);
+}
+
+template<class Pool>
+static void runSpawn(const char *name, size_t threads, size_t tasks) {
+    size_t depth = 0;
+    while ((size_t(2) << (depth + 1)) - 1 <= tasks) ++depth;
+    size_t total = (size_t(2) << depth) - 1;
+
+    std::atomic<size_t> done{0};
+    Pool pool(threads);
+    auto start = Clock::now();
+    pool.enqueue([&pool, &done, depth] { spawnTree(pool, done, depth); });
+    waitFor(done, total);
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    report(name, "spawn", threads, total, seconds, nullptr);
+}
+
+int main(int argc, char *argv[]) {
+    size_t tasks = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+
+    std::printf("pool,scenario,threads,tasks,ops_per_sec,p50_us,p99_us,p999_us\n");
+    for (size_t threads : {1, 2, 4, 8, 16, 32, 64}) {
+        runThroughput<MutexThreadPool>("mutex", threads, tasks);
+        runThroughput<ThreadPool>("stealing", threads, tasks);
+        runLatency<MutexThreadPool>("mutex", threads, tasks / 4);
+        runLatency<ThreadPool>("stealing", threads, tasks / 4);
+        runSpawn<MutexThreadPool>("mutex", threads, tasks);
+        runSpawn<ThreadPool>("stealing", threads, tasks);
+    }
+    return 0;
+}
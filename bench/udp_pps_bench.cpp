@@ -0,0 +1,122 @@
+// Пакетов в секунду на loopback: по системному вызову на пакет (sendto/recvfrom)
+// против пачек sendmmsg/recvmmsg из server/udp_io и пачек с UDP_SEGMENT/UDP_GRO.
+// Вывод - CSV: mode,packets,payload,send_pps,recv_pps,delivered_pct,send_syscalls,recv_syscalls
+//
+//   udp_pps_bench [packets] [payload]
+#include "../server/udp_io.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <poll.h>
+
+enum class Mode { Single, Batch, Offload };
+
+struct Result {
+    double sendPps;
+    double recvPps;
+    double deliveredPct;
+    uint64_t sendCalls;
+    uint64_t recvCalls;
+};
+
+static SOCKET openSocket(sockaddr_in &addr) {
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int bufferSize = 8 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    addr = sockaddr_in{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sock, (sockaddr *) &addr, sizeof(addr));
+    socklen_t length = sizeof(addr);
+    getsockname(sock, (sockaddr *) &addr, &length);
+    return sock;
+}
+
+static Result run(Mode mode, size_t packets, size_t payload) {
+    sockaddr_in receiverAddr{}, senderAddr{};
+    SOCKET receiver = openSocket(receiverAddr);
+    SOCKET sender = openSocket(senderAddr);
+
+    std::atomic<bool> sending{true};
+    uint64_t received = 0;
+    uint64_t recvCalls = 0;
+    std::chrono::steady_clock::time_point firstPacket, lastPacket;
+
+    std::thread consumer([&] {
+        UdpRxBatch rx(receiver, mode == Mode::Offload);
+        std::vector<char> buffer(UDP_RX_BUFFER);
+        auto idleSince = std::chrono::steady_clock::now();
+        while (received < packets) {
+            pollfd pfd{receiver, POLLIN, 0};
+            if (poll(&pfd, 1, 10) <= 0) {
+                // Отправитель закончил, а пакеты больше не приходят - остальное потеряно
+                if (!sending && std::chrono::steady_clock::now() - idleSince > std::chrono::milliseconds(200)) break;
+                continue;
+            }
+            size_t got = 0;
+            if (mode == Mode::Single) {
+                while (recv(receiver, buffer.data(), buffer.size(), MSG_DONTWAIT) > 0) {
+                    ++got;
+                    ++recvCalls;
+                }
+                ++recvCalls;
+            } else {
+                while (rx.receive() > 0) {
+                    rx.forEach([&got](const NetAddress &, const char *, size_t) { ++got; });
+                }
+            }
+            if (got == 0) continue;
+            auto now = std::chrono::steady_clock::now();
+            if (received == 0) firstPacket = now;
+            lastPacket = idleSince = now;
+            received += got;
+        }
+        if (mode != Mode::Single) recvCalls = rx.syscalls();
+    });
+
+    std::vector<char> packet(payload, 'x');
+    uint64_t sendCalls = 0;
+    auto start = std::chrono::steady_clock::now();
+    if (mode == Mode::Single) {
+        for (size_t i = 0; i < packets; ++i) {
+            sendto(sender, packet.data(), payload, 0, (sockaddr *) &receiverAddr, sizeof(receiverAddr));
+        }
+        sendCalls = packets;
+    } else {
+        UdpTxBatch tx(sender, mode == Mode::Offload);
+        for (size_t i = 0; i < packets; ++i) {
+            char *slot = tx.reserve(payload);
+            memcpy(slot, packet.data(), payload);
+            tx.commit(receiverAddr, payload);
+        }
+        tx.flush();
+        sendCalls = tx.syscalls();
+    }
+    double sendSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    sending = false;
+    consumer.join();
+    close(sender);
+    close(receiver);
+
+    double recvSeconds = std::chrono::duration<double>(lastPacket - firstPacket).count();
+    return Result{packets / sendSeconds, recvSeconds > 0 ? received / recvSeconds : 0,
+                  100.0 * received / packets, sendCalls, recvCalls};
+}
+
+int main(int argc, char *argv[]) {
+    size_t packets = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    size_t payload = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1030;
+
+    std::printf("mode,packets,payload,send_pps,recv_pps,delivered_pct,send_syscalls,recv_syscalls\n");
+    const std::pair<Mode, const char *> modes[] = {
+            {Mode::Single, "sendto_recvfrom"}, {Mode::Batch, "mmsg"}, {Mode::Offload, "mmsg_gso_gro"}};
+    for (auto [mode, name] : modes) {
+        Result r = run(mode, packets, payload);
+        std::printf("%s,%zu,%zu,%.0f,%.0f,%.1f,%llu,%llu\n", name, packets, payload, r.sendPps, r.recvPps,
+                    r.deliveredPct, (unsigned long long) r.sendCalls, (unsigned long long) r.recvCalls);
+        std::fflush(stdout);
+    }
+    return 0;
+}
@@ -8,6 +8,19 @@ from rich.console import Console
 from rich.progress import Progress, BarColumn, TimeRemainingColumn
 from rich.table import Table
 
+# Optional: verify the CRC32C the server reports for uploaded bytes
+try:
+    from crc32c import crc32c as crc32c_update
+except ImportError:
+    crc32c_update = None
+
+# Optional: fast LZ4 for compressed transfers; without it downloads are decoded in
+# pure Python and uploads are sent uncompressed
+try:
+    import lz4.block as lz4_block
+except ImportError:
+    lz4_block = None
+
 # Инициализация консоли rich
 console = Console()
 
@@ -15,6 +28,115 @@ BUFFER_SIZE = 1030
 UDP_TIMEOUT = 2
 TCP_TIMEOUT = 5
 MAX_RETRIES = 5
+# Large TCP transfers are split into ranges, one connection per range
+TCP_STREAMS = 4
+TCP_PARALLEL_MIN = 8 * 1024 * 1024
+TCP_CHUNK = 256 * 1024
+
+# UDP transfer: [seq u32][length u16][payload], sliding window with selective ACKs
+UDP_HEADER = 6
+# Payload size is negotiated: we offer the UDP maximum, the server answers with
+# what fits its path MTU. Servers without negotiation use 1024.
+UDP_LEGACY_PAYLOAD = 1024
+UDP_MAX_PAYLOAD = 65507 - UDP_HEADER
+UDP_WINDOW = 64
+UDP_MAX_INFLIGHT = 1024 * 1024
+UDP_SOCKET_BUFFER = 4 * 1024 * 1024
+UDP_IDLE_TIMEOUT = 10
+END_SEQ = 0xFFFFFFFF
+# ACK: same header with seq == ACK_SEQ, then [cumulative u32] and [first u32][last u32] per range
+ACK_SEQ = 0xFFFFFFFE
+MAX_SACK_RANGES = 8
+DUP_THRESHOLD = 3
+# Compressed TCP stream: frames [stored u32][raw u32][data], stored == raw means an uncompressed block
+LZ4_FRAME_HEADER = 8
+LZ4_FRAME_BLOCK = 32 * 1024
+# Ask the server to compress transfers; it answers READY ... LZ4 if the file compresses
+COMPRESS = True
+
+
+def lz4_decompress(data, raw_size):
+    """Decode one LZ4 block of raw_size bytes."""
+    if lz4_block:
+        return lz4_block.decompress(data, uncompressed_size=raw_size)
+    out = bytearray()
+    pos, end = 0, len(data)
+    while pos < end:
+        token = data[pos]
+        pos += 1
+        literals = token >> 4
+        if literals == 15:
+            while True:
+                byte = data[pos]
+                pos += 1
+                literals += byte
+                if byte != 255:
+                    break
+        out += data[pos:pos + literals]
+        pos += literals
+        if pos >= end:
+            break
+        offset = data[pos] | (data[pos + 1] << 8)
+        pos += 2
+        length = token & 15
+        if length == 15:
+            while True:
+                byte = data[pos]
+                pos += 1
+                length += byte
+                if byte != 255:
+                    break
+        length += 4
+        start = len(out) - offset
+        if offset <= 0 or start < 0:
+            raise ValueError("corrupt LZ4 block")
+        if offset >= length:
+            out += out[start:start + length]
+        else:
+            # Overlapping match repeats the last `offset` bytes
+            pattern = bytes(out[start:])
+            out += (pattern * (length // offset + 1))[:length]
+    if len(out) != raw_size:
+        raise ValueError("corrupt LZ4 block")
+    return bytes(out)
+
+
+def lz4_frame(block):
+    """One frame of a compressed upload; blocks that do not shrink are sent as is."""
+    packed = lz4_block.compress(block, store_size=False) if lz4_block else block
+    if len(packed) >= len(block):
+        packed = block
+    return struct.pack("!II", len(packed), len(block)) + packed
+
+
+def upload_compressible(path, offset):
+    """Compress only when the LZ4 module is present and the start of the file shrinks."""
+    if not (COMPRESS and lz4_block):
+        return False
+    with open(path, "rb") as file:
+        sample = os.pread(file.fileno(), LZ4_FRAME_BLOCK, offset)
+    return bool(sample) and len(lz4_block.compress(sample, store_size=False)) < len(sample) * 7 // 8
+
+
+def read_tcp_body(reader, length, compressed, write):
+    """Read `length` file bytes from the stream, raw or as LZ4 frames; write(data) gets them in order."""
+    while length > 0:
+        if compressed:
+            header = reader.read(LZ4_FRAME_HEADER)
+            if len(header) < LZ4_FRAME_HEADER:
+                raise ConnectionError("connection closed mid-frame")
+            stored, raw = struct.unpack("!II", header)
+            data = reader.read(stored)
+            if len(data) < stored:
+                raise ConnectionError("connection closed mid-frame")
+            if stored < raw:
+                data = lz4_decompress(data, raw)
+        else:
+            data = reader.read1(min(length, TCP_CHUNK))
+            if not data:
+                raise ConnectionError("connection closed mid-transfer")
+        write(data)
+        length -= len(data)
 
 class FileTransferClient:
     def __init__(self):
@@ -97,20 +219,188 @@ class FileTransferClient:
         except Exception as e:
             return f"ERROR: {str(e)}"
 
+    def format_ack(self, cumulative, have, highest):
+        # All packets below cumulative plus up to MAX_SACK_RANGES received ranges above it
+        ranges = []
+        seq = cumulative
+        while seq < highest and len(ranges) < MAX_SACK_RANGES:
+            while seq < highest and seq not in have:
+                seq += 1
+            if seq >= highest:
+                break
+            first = seq
+            while seq < highest and seq in have:
+                seq += 1
+            ranges.append((first, seq - 1))
+        body = struct.pack("!I", cumulative) + b"".join(struct.pack("!II", *r) for r in ranges)
+        return struct.pack("!IH", ACK_SEQ, len(body)) + body
+
+    def parse_ack(self, data):
+        if len(data) < UDP_HEADER + 4:
+            return None
+        seq, _ = struct.unpack("!IH", data[:UDP_HEADER])
+        if seq != ACK_SEQ:
+            return None
+        cumulative, = struct.unpack("!I", data[UDP_HEADER:UDP_HEADER + 4])
+        count = min((len(data) - UDP_HEADER - 4) // 8, MAX_SACK_RANGES)
+        ranges = [struct.unpack("!II", data[UDP_HEADER + 4 + i * 8:UDP_HEADER + 12 + i * 8]) for i in range(count)]
+        return cumulative, ranges
+
+    def udp_receive_file(self, sock, file, file_size, payload, progress, task, compressed=False):
+        total = (file_size + payload - 1) // payload
+        have = set()
+        cumulative = 0
+        highest = 0
+        last_packet = time.time()
+
+        while True:
+            try:
+                data, _ = sock.recvfrom(payload + UDP_HEADER)
+            except socket.timeout:
+                if time.time() - last_packet > UDP_IDLE_TIMEOUT:
+                    console.print(f"🛑 Timeout waiting for packet {cumulative}", style="bold red")
+                    return False
+                continue
+            last_packet = time.time()
+            if len(data) < UDP_HEADER:
+                continue
+
+            seq, length = struct.unpack("!IH", data[:UDP_HEADER])
+            if seq == END_SEQ:
+                if cumulative == total:
+                    sock.sendto(self.format_ack(END_SEQ, set(), 0), (self.ip, self.port))
+                    return True
+                continue
+            if seq >= total or len(data) - UDP_HEADER != length:
+                continue
+
+            if seq not in have:
+                body = data[UDP_HEADER:]
+                # Compressed packet: shorter than its piece of the file
+                raw = min(payload, file_size - seq * payload)
+                if compressed and length < raw:
+                    body = lz4_decompress(body, raw)
+                length = raw
+                # Packets may arrive out of order: write each one at its own offset
+                file.seek(seq * payload)
+                file.write(body)
+                have.add(seq)
+                highest = max(highest, seq + 1)
+                while cumulative in have:
+                    have.discard(cumulative)
+                    cumulative += 1
+                progress.update(task, advance=length)
+            sock.sendto(self.format_ack(cumulative, have, highest), (self.ip, self.port))
+
+    def udp_send_file(self, sock, file, file_size, payload, progress, task):
+        total = (file_size + payload - 1) // payload
+        # Window in packets, capped in bytes so large packets do not overrun the server buffer
+        window = max(4, min(UDP_WINDOW, UDP_MAX_INFLIGHT // payload))
+        base = next_seq = 0
+        sent_at = {}
+        transmissions = {}
+        sacked = set()
+        fast_retransmitted = set()
+        srtt = rttvar = None
+        rto = 0.25
+        last_progress = time.time()
+        sock.settimeout(0.01)
+
+        def transmit(seq):
+            file.seek(seq * payload)
+            chunk = file.read(payload)
+            sock.sendto(struct.pack("!IH", seq, len(chunk)) + chunk, (self.ip, self.port))
+            sent_at[seq] = time.time()
+            transmissions[seq] = transmissions.get(seq, 0) + 1
+
+        while base < total:
+            while next_seq < total and next_seq < base + window:
+                transmit(next_seq)
+                next_seq += 1
+
+            try:
+                data, _ = sock.recvfrom(BUFFER_SIZE)
+                ack = self.parse_ack(data)
+            except socket.timeout:
+                ack = None
+
+            now = time.time()
+            if ack:
+                cumulative, ranges = ack
+                sample = None
+                for seq in range(base, min(cumulative, next_seq)):
+                    if transmissions.get(seq) == 1 and seq not in sacked:
+                        sample = now - sent_at[seq]
+                    progress.update(task, advance=min(payload, file_size - seq * payload))
+                    sent_at.pop(seq, None)
+                    transmissions.pop(seq, None)
+                    sacked.discard(seq)
+                    fast_retransmitted.discard(seq)
+                if cumulative > base:
+                    base = min(cumulative, next_seq)
+                    last_progress = now
+                highest = 0
+                for first, last in ranges:
+                    for seq in range(max(first, base), min(last + 1, next_seq)):
+                        if seq not in sacked:
+                            sacked.add(seq)
+                            if transmissions.get(seq) == 1:
+                                sample = now - sent_at[seq]
+                    highest = max(highest, last + 1)
+                if sample is not None:
+                    # RFC 6298 estimate, retransmitted packets are not sampled (Karn)
+                    if srtt is None:
+                        srtt, rttvar = sample, sample / 2
+                    else:
+                        rttvar = 0.75 * rttvar + 0.25 * abs(srtt - sample)
+                        srtt = 0.875 * srtt + 0.125 * sample
+                    rto = min(max(srtt + 4 * rttvar, 0.02), 2.0)
+                # Fast retransmit of holes with enough packets acknowledged above them
+                for seq in range(base, min(highest - DUP_THRESHOLD, next_seq)):
+                    if seq not in sacked and seq not in fast_retransmitted:
+                        fast_retransmitted.add(seq)
+                        transmit(seq)
+
+            timed_out = False
+            for seq in range(base, next_seq):
+                if seq not in sacked and now - sent_at[seq] >= rto:
+                    transmit(seq)
+                    timed_out = True
+            if timed_out:
+                rto = min(rto * 2, 2.0)
+            if now - last_progress > UDP_IDLE_TIMEOUT:
+                console.print("🛑 No acknowledgements, upload failed", style="bold red")
+                return False
+
+        # Send end packet and wait for confirmation
+        sock.settimeout(UDP_TIMEOUT)
+        for attempt in range(MAX_RETRIES):
+            sock.sendto(struct.pack("!IH", END_SEQ, 0), (self.ip, self.port))
+            try:
+                while True:
+                    data, _ = sock.recvfrom(BUFFER_SIZE)
+                    ack = self.parse_ack(data)
+                    if ack and ack[0] == END_SEQ:
+                        return True
+            except socket.timeout:
+                continue
+        console.print("⚠️ Warning: No final ACK received", style="bold yellow")
+        return True
+
     def handle_udp_transfer(self, filename, mode):
         sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
         sock.settimeout(UDP_TIMEOUT)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, UDP_SOCKET_BUFFER)
 
         try:
             start_time = time.time()
-            transfered = 0
 
             if mode == "download":
                 # 1. Отправляем запрос на загрузку
-                request = f"UDP_DOWNLOAD {filename}\n".encode()
+                request = f"UDP_DOWNLOAD {filename}{' LZ4' if COMPRESS else ''} PAYLOAD={UDP_MAX_PAYLOAD}\n".encode()
                 sock.sendto(request, (self.ip, self.port))
 
-                # 2. Получаем ответ READY с размером файла
+                # 2. Получаем ответ READY с размером файла и согласованным размером пакета
                 response, _ = sock.recvfrom(BUFFER_SIZE)
                 response = response.decode().strip()
 
@@ -118,57 +408,21 @@ class FileTransferClient:
                     console.print(f"🛑 Server error: {response}", style="bold red")
                     return False
 
-                _, file_size = response.split()
-                file_size = int(file_size)
+                fields = response.split()
+                file_size = int(fields[1])
+                payload = int(fields[2]) if len(fields) > 2 and fields[2].isdigit() else UDP_LEGACY_PAYLOAD
+                compressed = fields[-1] == "LZ4"
 
                 # 3. Подготовка к сохранению файла
                 os.makedirs("downloads", exist_ok=True)
                 save_path = os.path.join("downloads", filename)
 
                 with open(save_path, "wb") as file:
-                    expected_seq = 0
-                    seq = 0
-                    received = 0
-
                     with Progress(BarColumn(), TimeRemainingColumn()) as progress:
                         task = progress.add_task("download", total=file_size)
+                        if not self.udp_receive_file(sock, file, file_size, payload, progress, task, compressed):
+                            return False
 
-                        while received < file_size:
-                            try:
-                                # 4. Получаем пакет данных
-                                data, addr = sock.recvfrom(BUFFER_SIZE)
-
-                                # 5. Проверяем пакет завершения
-                                if len(data) >= 4:
-                                    packet_seq = struct.unpack("!I", data[:4])[0]
-                                    if packet_seq == 0xFFFFFFFF:
-                                        break
-
-                                # 6. Обрабатываем обычный пакет
-                                if len(data) >= 6:
-                                    packet_seq, chunk_size = struct.unpack("!IH", data[:6])
-                                    chunk_data = data[6:6+chunk_size]
-
-                                    # 7. Проверяем порядковый номер
-                                    if packet_seq == expected_seq:
-                                        file.write(chunk_data)
-                                        received += chunk_size
-
-                                        # 8. Немедленно отправляем подтверждение
-                                        ack_msg = f"ACK {expected_seq}".encode()
-                                        sock.sendto(ack_msg, (self.ip, self.port))
-
-                                        expected_seq += 1
-                                        progress.update(task, advance=chunk_size)
-
-                                    else:
-                                        # 9. Повторно отправляем ACK для предыдущего пакета
-                                        ack_msg = f"ACK {packet_seq}".encode()
-                                        sock.sendto(ack_msg, (self.ip, self.port))
-                            except socket.timeout:
-                                console.print(f"⏳ Timeout waiting for packet {expected_seq}, retrying...", style="bold yellow")
-                                continue
-                            transfered += chunk_size
                 duration = time.time() - start_time
                 bitrate = (file_size * 8) / duration
                 console.print(f"🎉 Download completed successfully! Bitrate: {self.format_bitrate(bitrate)}", style="bold green")
@@ -183,59 +437,27 @@ class FileTransferClient:
                     file_size = os.path.getsize(filename)
                     basename = os.path.basename(filename)
                     start_time = time.time()
-                    transfered = 0
 
                     # Send upload request
-                    sock.sendto(f"UDP_UPLOAD {basename} {file_size}\n".encode(), (self.ip, self.port))
+                    sock.sendto(f"UDP_UPLOAD {basename} {file_size} PAYLOAD={UDP_MAX_PAYLOAD}\n".encode(),
+                                (self.ip, self.port))
 
-                    # Wait for READY response
+                    # Wait for READY response, optionally with the negotiated packet size
                     response, _ = sock.recvfrom(BUFFER_SIZE)
-                    if response.decode().strip() != "READY":
+                    fields = response.decode().split()
+                    if not fields or fields[0] != "READY":
                         console.print(f"🛑 Server error: {response.decode()}", style="bold red")
                         return False
+                    payload = int(fields[1]) if len(fields) > 1 else UDP_LEGACY_PAYLOAD
 
-                    seq = 0
                     with open(filename, "rb") as file:
                         with Progress(BarColumn(), TimeRemainingColumn()) as progress:
                             task = progress.add_task("upload", total=file_size)
-
-                            while chunk := file.read(BUFFER_SIZE):
-                                header = struct.pack("!IH", seq, len(chunk))
-                                packet = header + chunk
-
-                                # Send with retries
-                                for attempt in range(MAX_RETRIES + 1):
-                                    sock.sendto(packet, (self.ip, self.port))
-
-                                    try:
-                                        ack, _ = sock.recvfrom(BUFFER_SIZE)
-                                        ack = ack.decode().strip()
-
-                                        if ack == f"ACK {seq}":
-                                            transfered += len(chunk)
-                                            progress.update(task, advance=len(chunk))
-                                            break
-
-                                    except socket.timeout:
-                                        if attempt == MAX_RETRIES:
-                                            console.print("🛑 Max retries reached, upload failed", style="bold red")
-                                            return False
-
-                                seq += 1
-
-                    # Send end packet and wait for confirmation
-                    end_packet = struct.pack("!IH", 0xFFFFFFFF, 0)
-                    sock.sendto(end_packet, (self.ip, self.port))
-
-                    try:
-                        ack, _ = sock.recvfrom(BUFFER_SIZE)
-                        if "ACK 4294967295" not in ack.decode().strip():
-                            console.print("⚠️ Warning: Invalid final ACK", style="bold yellow")
-                    except socket.timeout:
-                        console.print("⚠️ Warning: No final ACK received", style="bold yellow")
+                            if not self.udp_send_file(sock, file, file_size, payload, progress, task):
+                                return False
 
                     duration = time.time() - start_time
-                    bitrate = (transfered * 8) / duration if duration > 0 else 0
+                    bitrate = (file_size * 8) / duration if duration > 0 else 0
                     console.print(f"🚀 Upload complete! Bitrate: {self.format_bitrate(bitrate)}", style="bold green")
                     return True
 
@@ -245,6 +467,92 @@ class FileTransferClient:
         finally:
             sock.close()
 
+    def tcp_ranges(self, file_size):
+        stripe = -(-file_size // TCP_STREAMS)
+        return [(offset, min(stripe, file_size - offset)) for offset in range(0, file_size, stripe)]
+
+    def run_parallel(self, worker, ranges):
+        errors = []
+        lock = Lock()
+
+        def run(offset, length):
+            try:
+                worker(offset, length)
+            except Exception as e:
+                with lock:
+                    errors.append(f"range {offset}+{length}: {e}")
+
+        threads = [Thread(target=run, args=r) for r in ranges]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        return errors
+
+    def tcp_range_download(self, filename, fd, offset, length, progress, task):
+        with socket.create_connection((self.ip, self.port), timeout=TCP_TIMEOUT) as sock:
+            sock.sendall(f"DOWNLOAD {filename} {offset} {length}{' LZ4' if COMPRESS else ''}\n".encode())
+            reader = sock.makefile("rb")
+            response = reader.readline().decode().strip()
+            if not response.startswith("READY"):
+                raise RuntimeError(response)
+
+            def write(data):
+                nonlocal offset
+                os.pwrite(fd, data, offset)
+                offset += len(data)
+                progress.update(task, advance=len(data))
+
+            read_tcp_body(reader, length, response.endswith(" LZ4"), write)
+
+    def upload_crc_matches(self, response, crc):
+        """Server reports "File upload complete. CRC32C=<hex>" for the bytes it received."""
+        match = re.search(r"CRC32C=([0-9a-f]{8})", response)
+        if crc is None or not match:
+            return True
+        return int(match.group(1), 16) == crc
+
+    def tcp_range_upload(self, path, basename, file_size, offset, length, progress, task):
+        with socket.create_connection((self.ip, self.port), timeout=TCP_TIMEOUT) as sock, \
+                open(path, "rb") as file:
+            compressed = upload_compressible(path, offset)
+            sock.sendall(f"UPLOAD {basename} {file_size} {offset} {length}{' LZ4' if compressed else ''}\n".encode())
+            reader = sock.makefile("rb")
+            response = reader.readline().decode().strip()
+            if not response.startswith("READY"):
+                raise RuntimeError(response)
+            crc = 0 if crc32c_update else None
+            while length > 0:
+                chunk = os.pread(file.fileno(), min(length, LZ4_FRAME_BLOCK if compressed else TCP_CHUNK), offset)
+                if not chunk:
+                    raise RuntimeError("file shrank during upload")
+                if crc is not None:
+                    crc = crc32c_update(chunk, crc)
+                sock.sendall(lz4_frame(chunk) if compressed else chunk)
+                offset += len(chunk)
+                length -= len(chunk)
+                progress.update(task, advance=len(chunk))
+            response = reader.readline().decode().strip()
+            if not response.startswith("File upload complete."):
+                raise RuntimeError(response)
+            if not self.upload_crc_matches(response, crc):
+                raise RuntimeError(f"checksum mismatch: {response}")
+
+    def tcp_parallel_download(self, filename, file_size):
+        os.makedirs("downloads", exist_ok=True)
+        save_path = os.path.join("downloads", filename)
+        fd = os.open(save_path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+        try:
+            os.ftruncate(fd, file_size)
+            with Progress(BarColumn(), TimeRemainingColumn()) as progress:
+                task = progress.add_task("download", total=file_size)
+                errors = self.run_parallel(
+                    lambda offset, length: self.tcp_range_download(filename, fd, offset, length, progress, task),
+                    self.tcp_ranges(file_size))
+        finally:
+            os.close(fd)
+        return errors
+
     def handle_tcp_transfer(self, filename, mode):
         try:
             if not self.connected:
@@ -252,34 +560,46 @@ class FileTransferClient:
                 self.connected = True
 
             if mode == "download":
-                self.tcp_socket.sendall(f"DOWNLOAD {filename}\n".encode())
-
-                # Get READY response
+                # Empty range: the server only reports the file size
+                self.tcp_socket.sendall(f"DOWNLOAD {filename} 0 0\n".encode())
                 response = self.tcp_socket.recv(BUFFER_SIZE).decode().strip()
                 if not response.startswith("READY"):
                     console.print(f"🛑 Server error: {response}", style="bold red")
                     return False
+                file_size = int(response.split()[2])
+                if file_size >= TCP_PARALLEL_MIN:
+                    errors = self.tcp_parallel_download(filename, file_size)
+                    if errors:
+                        console.print(f"🛑 Download failed: {'; '.join(errors)}", style="bold red")
+                        return False
+                    console.print(f"🎉 Download completed over {TCP_STREAMS} connections!", style="bold green")
+                    return True
 
-                _, file_size = response.split()
-                file_size = int(file_size)
+                self.tcp_socket.sendall(f"DOWNLOAD {filename}{' LZ4' if COMPRESS else ''}\n".encode())
+
+                # Get READY response; the body follows it on the same stream
+                reader = self.tcp_socket.makefile("rb")
+                response = reader.readline().decode().strip()
+                if not response.startswith("READY"):
+                    console.print(f"🛑 Server error: {response}", style="bold red")
+                    return False
+
+                file_size = int(response.split()[1])
 
                 # Prepare to save file
                 os.makedirs("downloads", exist_ok=True)
                 save_path = os.path.join("downloads", filename)
 
                 with open(save_path, "wb") as file:
-                    received = 0
                     with Progress(BarColumn(), TimeRemainingColumn()) as progress:
                         task = progress.add_task("download", total=file_size)
 
-                        while received < file_size:
-                            data = self.tcp_socket.recv(BUFFER_SIZE)
-                            if not data:
-                                break
+                        def write(data):
                             file.write(data)
-                            received += len(data)
                             progress.update(task, advance=len(data))
 
+                        read_tcp_body(reader, file_size, response.endswith(" LZ4"), write)
+
                 console.print("🎉 Download completed successfully!", style="bold green")
                 return True
 
@@ -292,8 +612,23 @@ class FileTransferClient:
                 file_size = os.path.getsize(filename)
                 basename = os.path.basename(filename)
 
-                # Send upload request
-                self.tcp_socket.sendall(f"UPLOAD {basename} {file_size}\n".encode())
+                if file_size >= TCP_PARALLEL_MIN:
+                    with Progress(BarColumn(), TimeRemainingColumn()) as progress:
+                        task = progress.add_task("upload", total=file_size)
+                        errors = self.run_parallel(
+                            lambda offset, length: self.tcp_range_upload(
+                                filename, basename, file_size, offset, length, progress, task),
+                            self.tcp_ranges(file_size))
+                    if errors:
+                        console.print(f"🛑 Upload failed: {'; '.join(errors)}", style="bold red")
+                        return False
+                    console.print(f"🚀 File upload complete over {TCP_STREAMS} connections.", style="bold green")
+                    return True
+
+                # Send upload request; the server resumes at its current size, which is
+                # unknown yet, so the compression sample is taken from the start of the file
+                compressed = upload_compressible(filename, 0)
+                self.tcp_socket.sendall(f"UPLOAD {basename} {file_size}{' LZ4' if compressed else ''}\n".encode())
 
                 # Wait for READY response
                 response = self.tcp_socket.recv(BUFFER_SIZE).decode().strip()
@@ -301,19 +636,29 @@ class FileTransferClient:
                     console.print(f"🛑 Server error: {response}", style="bold red")
                     return False
 
+                # Server replies "READY <offset>": resume from the bytes it already has
+                offset = int(response.split()[1])
+
                 # Send file data
+                crc = 0 if crc32c_update else None
                 with open(filename, "rb") as file:
-                    sent = 0
+                    file.seek(offset)
+                    sent = offset
                     with Progress(BarColumn(), TimeRemainingColumn()) as progress:
-                        task = progress.add_task("upload", total=file_size)
+                        task = progress.add_task("upload", total=file_size, completed=offset)
 
-                        while chunk := file.read(BUFFER_SIZE):
-                            self.tcp_socket.sendall(chunk)
+                        while chunk := file.read(LZ4_FRAME_BLOCK if compressed else BUFFER_SIZE):
+                            if crc is not None:
+                                crc = crc32c_update(chunk, crc)
+                            self.tcp_socket.sendall(lz4_frame(chunk) if compressed else chunk)
                             sent += len(chunk)
                             progress.update(task, advance=len(chunk))
 
                 # Get final confirmation
                 response = self.tcp_socket.recv(BUFFER_SIZE).decode().strip()
+                if not self.upload_crc_matches(response, crc):
+                    console.print(f"🛑 Checksum mismatch: {response}", style="bold red")
+                    return False
                 console.print(f"🚀 {response}", style="bold green")
                 return True
 
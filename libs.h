@@ -5,22 +5,32 @@
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <direct.h>
 #pragma comment(lib, "Ws2_32.lib")
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
 #endif
 
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <ctime>
-#include <direct.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -30,15 +40,55 @@
 #include <csignal>
 #include "ThreadPool.cpp"
 
-#define TCP_PORT 8080
-#define UDP_PORT 8081
-#define BUFFER_SIZE 1024
+// Параметры запуска: файл --config и флаги командной строки (см. server/config.cpp)
+struct ServerConfig {
+    int tcpPort = 8080;
+    int udpPort = 8081;
+    std::string tcpBind;            // числовой адрес; пусто - "::" (dual-stack), без IPv6 - "0.0.0.0"
+    std::string udpBind;
+    std::string storageRoot = "uploads";   // каталог принятых и отдаваемых файлов
+    int reactors = 0;               // 0 - по одному реактору на ядро
+    bool pinReactors = false;       // привязать реактор i к CPU i (или к cpus[i])
+    std::vector<int> cpus;          // CPU для привязки реакторов по порядку, пусто - все подряд
+    int recvBufferKB = 1024;        // буфер приёма реактора, общий для его соединений
+    int tcpRcvBufKB = 0;            // SO_RCVBUF соединений, 0 - автонастройка ядра
+    int tcpSndBufKB = 0;            // SO_SNDBUF соединений, 0 - автонастройка ядра
+    bool tcpNoDelay = true;         // TCP_NODELAY: ответы уже собраны в один send, Nagle их только задержит
+    int busyPollUs = 0;             // SO_BUSY_POLL слушающих сокетов и UDP, мкс; 0 - выключен
+    int udpRcvBufKB = 4096;         // SO_RCVBUF UDP-сокета: переживать всплески
+    int udpSndBufKB = 4096;
+    bool reusePort = true;          // свой SO_REUSEPORT сокет на каждый реактор
+    int listenBacklog = SOMAXCONN;
+    int diskThreads = 2;            // потоки для fsync принятых файлов
+    int udpWindow = 64;             // пакетов в полёте у UDP-отправителя
+    double udpLossPercent = 0;      // имитация потерь UDP-пакетов передачи, %
+    bool udpOffload = true;         // UDP_SEGMENT (GSO) и UDP_GRO, если ядро умеет
+    int fileCacheMB = 256;          // кэш горячих файлов для DOWNLOAD/UDP_DOWNLOAD, 0 - выключен
+    bool ioUring = false;           // TCP-реакторы на io_uring вместо epoll, если ядро умеет
+    int metricsPort = 9464;         // HTTP-порт метрик Prometheus на 127.0.0.1, 0 - выключен
+    int maxConnections = 0;         // TCP-соединений одновременно, 0 - без ограничения
+    int idleTimeout = 300;          // с: молчание между командами, 0 - без таймаута
+    int readTimeout = 60;           // с: тело UPLOAD не приходит
+    int writeTimeout = 60;          // с: клиент не забирает ответ или файл
+    int rateLimitKB = 0;            // КБ/с на соединение при передаче файлов, 0 - без ограничения
+    int globalRateLimitKB = 0;      // КБ/с на все передачи сервера вместе
+    int outputHighWaterKB = 1024;   // неотправленных ответов больше - команды соединения не читаются
+    int drainTimeout = 30;          // с: мягкая остановка ждёт начатые передачи не дольше
+    std::string controlSocket;      // Unix-сокет для TAKEOVER/DRAIN, пусто - выключен
+    std::string takeover;           // забрать слушающие сокеты у процесса на этом Unix-сокете
+};
+
+extern ServerConfig g_config;
+extern volatile std::sig_atomic_t g_shutdown;
+// Мягкая остановка: приём закрыт, начатые передачи доделываются (см. server/lifecycle.h)
+extern volatile std::sig_atomic_t g_draining;
 
 //functions
 void initializeSockets();
 void cleanupSockets();
-void handleClient(int clientSocket);
 void handleUDPServer();
+// Сокет семейства адреса g_config.tcpBind, ещё не привязанный
+SOCKET createTcpSocket();
 int handleTCPServer(SOCKET serverSocket);
 int closeSockets(SOCKET serverSocket, int exitCode);
 void signal_handler(int);
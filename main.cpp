@@ -1,20 +1,47 @@
 #include "libs.h"
+#include "server/config.h"
+#include "server/lifecycle.h"
+#include "server/metrics.h"
+#include "server/storage.h"
 
-int main() {
+ServerConfig g_config;
+
+int main(int argc, char *argv[]) {
+    if (!loadConfig(argc, argv)) {
+        return EXIT_FAILURE;
+    }
+    // Индекс строится до приёма клиентов; при горячем перезапуске предшественник тем временем работает
+    if (!storage().open(g_config.storageRoot)) {
+        return EXIT_FAILURE;
+    }
 
     initializeSockets();
-//    std::signal(SIGINT, signal_handler);
-//    std::signal(SIGTERM, signal_handler);
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+    std::signal(SIGPIPE, SIG_IGN);
 
-    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    // Сокеты забираются до запуска серверов: те пропускают bind и сразу принимают клиентов
+    if (!g_config.takeover.empty() && !takeOverListeners(g_config.takeover)) {
+        cleanupSockets();
+        return EXIT_FAILURE;
+    }
+    int serverSocket = inheritedListeners(ListenerKind::Tcp) > 0 ? inheritedListener(ListenerKind::Tcp, 0)
+                                                                 : createTcpSocket();
     if (serverSocket == -1) {
         std::cerr << "Error creating socket" << std::endl;
         cleanupSockets();
         return EXIT_FAILURE;
     }
     std::thread udpThread(handleUDPServer);
-    handleTCPServer(serverSocket);
+    std::thread metricsThread(runMetricsServer);
+    std::thread controlThread(runControlServer);
+    // TCP возвращается, когда реакторы закончили drain; UDP доделывает свои передачи сам
+    if (handleTCPServer(serverSocket) != EXIT_SUCCESS) g_shutdown = 1;
+    udpThread.join();
+    g_shutdown = 1;
+    metricsThread.join();
+    controlThread.join();
 
     closeSockets(serverSocket, EXIT_SUCCESS);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
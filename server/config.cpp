@@ -0,0 +1,256 @@
+#include "config.h"
+#include "../libs.h"
+#include "logger.h"
+#include "net_address.h"
+#include <climits>
+#include <functional>
+#include <sched.h>
+
+// Одна запись таблицы - и флаг командной строки, и ключ файла конфигурации
+struct Option {
+    const char *name;       // без "--"
+    const char *argument;   // nullptr - флаг без значения
+    const char *help;
+    std::function<bool(const std::string &)> apply;
+};
+
+static std::string trim(const std::string &text) {
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) return "";
+    return text.substr(first, text.find_last_not_of(" \t\r\n") - first + 1);
+}
+
+// Целое в [low, high]; мусор в значении - ошибка, а не 0, как у atoi
+static bool parseInt(const std::string &text, long low, long high, int &out) {
+    char *end = nullptr;
+    errno = 0;
+    long value = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno != 0 || value < low || value > high) return false;
+    out = static_cast<int>(value);
+    return true;
+}
+
+static bool parseBool(const std::string &text, bool &out) {
+    if (text == "1" || text == "true" || text == "yes" || text == "on") {
+        out = true;
+        return true;
+    }
+    if (text == "0" || text == "false" || text == "no" || text == "off") {
+        out = false;
+        return true;
+    }
+    return false;
+}
+
+// "0-3,8,10" -> 0 1 2 3 8 10
+static bool parseCpuList(const std::string &text, std::vector<int> &out) {
+    std::vector<int> cpus;
+    std::stringstream items(text);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        size_t dash = item.find('-');
+        int first, last;
+        if (!parseInt(trim(item.substr(0, dash)), 0, CPU_SETSIZE - 1, first)) return false;
+        last = first;
+        if (dash != std::string::npos && !parseInt(trim(item.substr(dash + 1)), first, CPU_SETSIZE - 1, last)) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    if (cpus.empty()) return false;
+    out = std::move(cpus);
+    return true;
+}
+
+static std::function<bool(const std::string &)> intOption(int &field, long low, long high) {
+    return [&field, low, high](const std::string &value) { return parseInt(value, low, high, field); };
+}
+
+static std::function<bool(const std::string &)> flagOption(bool &field, bool value) {
+    return [&field, value](const std::string &) {
+        field = value;
+        return true;
+    };
+}
+
+static std::function<bool(const std::string &)> stringOption(std::string &field) {
+    return [&field](const std::string &value) {
+        field = value;
+        return !value.empty();
+    };
+}
+
+static const std::vector<Option> &options() {
+    ServerConfig &c = g_config;
+    static const std::vector<Option> table = {
+            {"config", "FILE", "read options from FILE (\"name = value\" lines); command-line flags override it", nullptr},
+            {"tcp-port", "N", "TCP port (default: 8080)", intOption(c.tcpPort, 1, 65535)},
+            {"udp-port", "N", "UDP port (default: 8081)", intOption(c.udpPort, 1, 65535)},
+            {"tcp-bind", "ADDR", "TCP address, IPv4 or IPv6 (default: :: dual-stack, 0.0.0.0 without IPv6)",
+             stringOption(c.tcpBind)},
+            {"udp-bind", "ADDR", "UDP address, IPv4 or IPv6 (default: as --tcp-bind)", stringOption(c.udpBind)},
+            {"storage", "DIR", "directory for uploaded and downloadable files (default: uploads)",
+             stringOption(c.storageRoot)},
+            {"reactors", "N", "number of TCP reactor threads (default: CPU count)", intOption(c.reactors, 0, 4096)},
+            {"pin-cpus", nullptr, "pin each reactor thread to its own CPU", flagOption(c.pinReactors, true)},
+            {"cpus", "LIST", "CPUs for reactor threads in order, e.g. 0-3,8 (implies --pin-cpus)",
+             [&c](const std::string &value) {
+                 if (!parseCpuList(value, c.cpus)) return false;
+                 c.pinReactors = true;
+                 return true;
+             }},
+            {"no-reuseport", nullptr, "share one listening socket instead of SO_REUSEPORT",
+             flagOption(c.reusePort, false)},
+            {"backlog", "N", "listen() backlog (default: SOMAXCONN)", intOption(c.listenBacklog, 1, INT_MAX)},
+            {"disk-threads", "N", "threads for fsync of finished uploads (default: 2)",
+             intOption(c.diskThreads, 1, 1024)},
+            {"recv-buffer", "KB", "per-reactor receive buffer shared by its connections (default: 1024)",
+             intOption(c.recvBufferKB, 64, 1024 * 1024)},
+            {"tcp-rcvbuf", "KB", "SO_RCVBUF of TCP connections (default: 0 = kernel autotuning)",
+             intOption(c.tcpRcvBufKB, 0, 1024 * 1024)},
+            {"tcp-sndbuf", "KB", "SO_SNDBUF of TCP connections (default: 0 = kernel autotuning)",
+             intOption(c.tcpSndBufKB, 0, 1024 * 1024)},
+            {"no-tcp-nodelay", nullptr, "leave Nagle's algorithm on for TCP connections",
+             flagOption(c.tcpNoDelay, false)},
+            {"busy-poll", "US", "SO_BUSY_POLL on listening and UDP sockets, microseconds (default: 0 = off)",
+             intOption(c.busyPollUs, 0, 1000000)},
+            {"udp-rcvbuf", "KB", "SO_RCVBUF of the UDP socket (default: 4096)", intOption(c.udpRcvBufKB, 0, 1024 * 1024)},
+            {"udp-sndbuf", "KB", "SO_SNDBUF of the UDP socket (default: 4096)", intOption(c.udpSndBufKB, 0, 1024 * 1024)},
+            {"udp-window", "N", "UDP packets in flight per transfer (default: 64)", intOption(c.udpWindow, 1, 65536)},
+            {"udp-loss", "P", "drop P% of UDP transfer packets, for testing",
+             [&c](const std::string &value) {
+                 char *end = nullptr;
+                 c.udpLossPercent = std::strtod(value.c_str(), &end);
+                 return !value.empty() && *end == '\0' && c.udpLossPercent >= 0 && c.udpLossPercent <= 100;
+             }},
+            {"no-udp-offload", nullptr, "disable UDP_SEGMENT/UDP_GRO batching offloads", flagOption(c.udpOffload, false)},
+            {"io-uring", nullptr, "run TCP reactors on io_uring (falls back to epoll)", flagOption(c.ioUring, true)},
+            {"file-cache", "MB", "in-memory cache of hot download files (default: 256, 0 = off)",
+             intOption(c.fileCacheMB, 0, INT_MAX)},
+            {"metrics-port", "N", "Prometheus metrics on 127.0.0.1:N/metrics (default: 9464, 0 = off)",
+             intOption(c.metricsPort, 0, 65535)},
+            {"max-connections", "N", "refuse TCP clients beyond N open connections (default: 0 = no limit)",
+             intOption(c.maxConnections, 0, INT_MAX)},
+            {"idle-timeout", "S", "close connections silent between commands for S seconds (default: 300, 0 = off)",
+             intOption(c.idleTimeout, 0, INT_MAX)},
+            {"read-timeout", "S", "close uploads that receive nothing for S seconds (default: 60, 0 = off)",
+             intOption(c.readTimeout, 0, INT_MAX)},
+            {"write-timeout", "S", "close connections whose client reads nothing for S seconds (default: 60, 0 = off)",
+             intOption(c.writeTimeout, 0, INT_MAX)},
+            {"rate-limit", "KB", "per-connection transfer bandwidth, KB/s (default: 0 = no limit)",
+             intOption(c.rateLimitKB, 0, INT_MAX)},
+            {"global-rate-limit", "KB", "bandwidth of all transfers together, KB/s (default: 0 = no limit)",
+             intOption(c.globalRateLimitKB, 0, INT_MAX)},
+            {"output-high-water", "KB", "stop reading commands while this many reply bytes are unsent (default: 1024)",
+             intOption(c.outputHighWaterKB, 1, INT_MAX)},
+            {"drain-timeout", "S", "on SIGTERM/SIGINT finish running transfers for up to S seconds (default: 30)",
+             intOption(c.drainTimeout, 0, INT_MAX)},
+            {"control-socket", "PATH", "Unix socket accepting TAKEOVER (hot restart) and DRAIN",
+             stringOption(c.controlSocket)},
+            {"takeover", "PATH", "take listening sockets over from the server at PATH, which then drains",
+             stringOption(c.takeover)},
+            {"log-level", "L", "debug, info, warn, error or off (default: info)",
+             [](const std::string &value) {
+                 LogLevel level;
+                 if (!parseLogLevel(value, level)) return false;
+                 setLogLevel(level);
+                 return true;
+             }},
+            {"log-rate", "N", "max lines per second from one log site per thread (default: 1000, 0 = no limit)",
+             [](const std::string &value) {
+                 int rate;
+                 if (!parseInt(value, 0, INT_MAX, rate)) return false;
+                 setLogRate(static_cast<uint32_t>(rate));
+                 return true;
+             }},
+    };
+    return table;
+}
+
+static const Option *findOption(const std::string &name) {
+    for (const Option &option : options()) {
+        if (name == option.name) return &option;
+    }
+    return nullptr;
+}
+
+static void printUsage(const char *program) {
+    std::cout << "Usage: " << program << " [options]\n";
+    for (const Option &option : options()) {
+        std::string flag = std::string("  --") + option.name;
+        if (option.argument) flag += std::string(" ") + option.argument;
+        flag.resize(std::max<size_t>(flag.size() + 1, 24), ' ');
+        std::cout << flag << option.help << "\n";
+    }
+}
+
+static bool applyConfigFile(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+        size_t equals = line.find('=');
+        std::string name = trim(line.substr(0, equals));
+        std::string value = equals == std::string::npos ? "" : trim(line.substr(equals + 1));
+        const Option *option = findOption(name);
+        bool valid = option && option->apply;
+        if (valid && !option->argument) {
+            // Флаг: "io-uring", "io-uring = yes"; "= no" оставляет значение по умолчанию
+            bool enabled = true;
+            valid = value.empty() || parseBool(value, enabled);
+            if (valid && enabled) option->apply(value);
+        } else if (valid) {
+            valid = option->apply(value);
+        }
+        if (!valid) {
+            std::cerr << path << ":" << number << ": invalid option \"" << line << "\"" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool applyCommandLine(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        const Option *option = arg.rfind("--", 0) == 0 ? findOption(arg.substr(2)) : nullptr;
+        if (!option || (option->argument && i + 1 >= argc)) return false;
+        std::string value = option->argument ? argv[++i] : "";
+        if (!option->apply) continue;   // --config прочитан раньше остальных
+        if (!option->apply(value)) {
+            std::cerr << "Invalid value for " << arg << ": " << value << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Адрес по умолчанию - dual-stack, если ядро умеет IPv6
+static bool resolveBindAddress(std::string &address, const char *flag) {
+    if (address.empty()) {
+        SOCKET probe = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        address = probe != INVALID_SOCKET ? "::" : "0.0.0.0";
+        if (probe != INVALID_SOCKET) closesocket(probe);
+    }
+    NetAddress parsed;
+    if (NetAddress::parse(address, 0, parsed)) return true;
+    std::cerr << "Invalid address for --" << flag << ": " << address << std::endl;
+    return false;
+}
+
+bool loadConfig(int argc, char *argv[]) {
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--config" && !applyConfigFile(argv[i + 1])) return false;
+    }
+    if (!applyCommandLine(argc, argv)) {
+        printUsage(argv[0]);
+        return false;
+    }
+    if (g_config.udpBind.empty()) g_config.udpBind = g_config.tcpBind;
+    return resolveBindAddress(g_config.tcpBind, "tcp-bind") && resolveBindAddress(g_config.udpBind, "udp-bind");
+}
@@ -0,0 +1,10 @@
+#ifndef TCP_SERVER_CONFIG_H
+#define TCP_SERVER_CONFIG_H
+
+// Заполняет g_config: сначала файл --config (если задан), затем флаги командной строки,
+// которые его перекрывают. В файле те же имена без "--": "имя = значение" по строке,
+// флаг без значения - одним именем или "имя = true|false"; '#' - комментарий.
+// false - ошибка разбора (уже выведена вместе со справкой).
+bool loadConfig(int argc, char *argv[]);
+
+#endif//TCP_SERVER_CONFIG_H
@@ -0,0 +1,166 @@
+#ifndef TCP_SERVER_CORO_H
+#define TCP_SERVER_CORO_H
+
+#include "reactor.h"
+#include "session.h"
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+// Свободные кадры корутин по классам размера, свои у каждого потока. Корутины обработчиков
+// создаются и возобновляются потоком своего реактора, так что без блокировок;
+// отработавший кадр ждёт следующую команду, а не возвращается в malloc.
+class FramePool {
+    static constexpr size_t GRANULE = 64;
+    static constexpr size_t CLASSES = 16;   // кадры до 1 КБ, крупнее - обычный new
+
+    struct FreeFrame {
+        FreeFrame *next;
+    };
+
+    FreeFrame *lists[CLASSES] = {};
+
+    static size_t sizeClass(size_t size) { return (std::max<size_t>(size, 1) + GRANULE - 1) / GRANULE - 1; }
+
+public:
+    static FramePool &local() {
+        thread_local FramePool pool;
+        return pool;
+    }
+
+    void *allocate(size_t size) {
+        size_t index = sizeClass(size);
+        if (index >= CLASSES) return ::operator new(size);
+        if (FreeFrame *frame = lists[index]) {
+            lists[index] = frame->next;
+            return frame;
+        }
+        return ::operator new((index + 1) * GRANULE);
+    }
+
+    void release(void *frame, size_t size) {
+        size_t index = sizeClass(size);
+        if (index >= CLASSES) {
+            ::operator delete(frame);
+            return;
+        }
+        auto *free = static_cast<FreeFrame *>(frame);
+        free->next = lists[index];
+        lists[index] = free;
+    }
+
+    ~FramePool() {
+        for (FreeFrame *&list : lists) {
+            while (list) ::operator delete(std::exchange(list, list->next));
+        }
+    }
+};
+
+// Обработчик команды, который ждёт пул или диск, не занимая реактор: начинает работу сразу,
+// на co_await отдаёт поток реактору и сам освобождает свой кадр, когда дойдёт до конца
+struct SessionCoroutine {
+    struct promise_type {
+        SessionCoroutine get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t size) { return FramePool::local().allocate(size); }
+        static void operator delete(void *frame, size_t size) { FramePool::local().release(frame, size); }
+    };
+};
+
+// Сессия, переживающая co_await: пока корутина ждала, соединение могло закрыться,
+// а слот - достаться новому клиенту. Слабы не освобождаются, так что указатель валиден.
+class SessionRef {
+    Session *session;
+    uint64_t serial;
+
+public:
+    explicit SessionRef(Session &conn) : session(&conn), serial(conn.serial) {}
+
+    explicit operator bool() const { return session->inUse && session->serial == serial; }
+    Session &operator*() const { return *session; }
+    Session *operator->() const { return session; }
+};
+
+// Задача mailbox, возобновляющая корутину. Не выполненная к остановке реактора - уничтожает кадр.
+class ResumeTask {
+    std::coroutine_handle<> handle;
+
+public:
+    explicit ResumeTask(std::coroutine_handle<> handle) : handle(handle) {}
+    ResumeTask(ResumeTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    ResumeTask &operator=(ResumeTask &&) = delete;
+
+    ~ResumeTask() {
+        if (handle) handle.destroy();
+    }
+
+    void operator()() { std::exchange(handle, nullptr).resume(); }
+};
+
+// co_await onDiskPool(reactor, work): work выполняется в дисковом пуле, корутина продолжается
+// в потоке реактора с его результатом - через mailbox, как прежние колбэки
+template<class Work>
+class DiskPoolAwaiter {
+    using Result = std::invoke_result_t<Work &>;
+
+    Reactor *reactor;
+    Work work;
+    Result result{};
+
+public:
+    DiskPoolAwaiter(Reactor &reactor, Work work) : reactor(&reactor), work(std::move(work)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        reactor->diskPool->enqueue([this, handle] {
+            result = work();
+            postToReactor(*reactor, ResumeTask(handle));
+        });
+    }
+
+    Result await_resume() { return std::move(result); }
+};
+
+template<class Work>
+DiskPoolAwaiter<Work> onDiskPool(Reactor &reactor, Work work) {
+    return {reactor, std::move(work)};
+}
+
+// co_await socketReady(conn, EPOLLIN): корутина передачи ждёт, пока сокет снова станет
+// читаемым/записываемым (или кончится пауза ограничителя полосы) - её продолжит serviceConnection
+struct SocketReady {
+    Session &conn;
+    uint32_t events;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        conn.transferWaiter = handle;
+        conn.transferEvents = events;
+    }
+
+    void await_resume() const noexcept {}
+};
+
+inline SocketReady socketReady(Session &conn, uint32_t events) {
+    return {conn, events};
+}
+
+// Пока жив кадр корутины передачи, сессия знает, что тело читает/пишет она
+class TransferScope {
+    Session &conn;
+
+public:
+    explicit TransferScope(Session &conn) : conn(conn) { conn.transferActive = true; }
+    TransferScope(const TransferScope &) = delete;
+    TransferScope &operator=(const TransferScope &) = delete;
+    ~TransferScope() { conn.transferActive = false; }
+};
+
+#endif//TCP_SERVER_CORO_H
@@ -0,0 +1,88 @@
+#include "crc32c.h"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+// Отражённый полином Castagnoli
+constexpr uint32_t CRC32C_POLY = 0x82F63B78;
+
+using Crc32cTables = std::array<std::array<uint32_t, 256>, 8>;
+
+// tables[k][b] - CRC байта b, за которым идут ещё k нулевых байт
+static constexpr Crc32cTables makeTables() {
+    Crc32cTables tables{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        tables[0][i] = crc;
+    }
+    for (size_t k = 1; k < 8; ++k) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+        }
+    }
+    return tables;
+}
+
+static constexpr Crc32cTables TABLES = makeTables();
+
+uint32_t crc32cSoftware(uint32_t crc, const void *data, size_t size) {
+    auto *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = TABLES[7][word & 0xFF] ^ TABLES[6][(word >> 8) & 0xFF] ^
+              TABLES[5][(word >> 16) & 0xFF] ^ TABLES[4][(word >> 24) & 0xFF] ^
+              TABLES[3][(word >> 32) & 0xFF] ^ TABLES[2][(word >> 40) & 0xFF] ^
+              TABLES[1][(word >> 48) & 0xFF] ^ TABLES[0][word >> 56];
+        p += 8;
+        size -= 8;
+    }
+#endif
+    while (size--) crc = (crc >> 8) ^ TABLES[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const void *data, size_t size) {
+    auto *p = static_cast<const uint8_t *>(data);
+    uint64_t state = ~crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        state = _mm_crc32_u64(state, word);
+        p += 8;
+        size -= 8;
+    }
+    auto tail = static_cast<uint32_t>(state);
+    while (size--) tail = _mm_crc32_u8(tail, *p++);
+    return ~tail;
+}
+#endif
+
+using Crc32cFunction = uint32_t (*)(uint32_t, const void *, size_t);
+
+static Crc32cFunction pickImplementation() {
+#ifdef CRC32C_X86
+    if (__builtin_cpu_supports("sse4.2")) return crc32cSse42;
+#endif
+    return crc32cSoftware;
+}
+
+static const Crc32cFunction implementation = pickImplementation();
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    return implementation(crc, data, size);
+}
+
+bool crc32cHardware() {
+    return implementation != crc32cSoftware;
+}
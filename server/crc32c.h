@@ -0,0 +1,13 @@
+#ifndef TCP_SERVER_CRC32C_H
+#define TCP_SERVER_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli) с продолжением: crc32c(crc32c(0, a), b) == crc32c(0, a + b).
+// На x86 с SSE4.2 считается инструкцией crc32 по 8 байт, иначе таблицами slicing-by-8.
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+uint32_t crc32cSoftware(uint32_t crc, const void *data, size_t size);
+bool crc32cHardware();
+
+#endif//TCP_SERVER_CRC32C_H
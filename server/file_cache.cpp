@@ -0,0 +1,153 @@
+#include "file_cache.h"
+#include "../libs.h"
+#include "crc32c.h"
+#include <cerrno>
+
+FileCache::FileCache(size_t capacity, size_t maxFileSize)
+    : capacity(capacity), maxFileSize(std::min(maxFileSize, capacity)) {}
+
+static bool sameVersion(const CachedFile &file, const struct stat &st) {
+    return static_cast<size_t>(st.st_size) == file.size && st.st_mtim.tv_sec == file.mtime.tv_sec &&
+           st.st_mtim.tv_nsec == file.mtime.tv_nsec;
+}
+
+CachedFileRef FileCache::find(std::string_view path) {
+    if (capacity == 0) return nullptr;
+    auto now = std::chrono::steady_clock::now();
+    CachedFileRef file;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(path);
+        if (it == index.end()) {
+            ++misses;
+            return nullptr;
+        }
+        Entry &entry = *it->second;
+        lru.splice(lru.begin(), lru, it->second);
+        if (now - entry.checkedAt < FILE_CACHE_REVALIDATE) {
+            ++hits;
+            return entry.file;
+        }
+        // Сверку берёт на себя этот поток, остальные пока отдают запись как есть
+        entry.checkedAt = now;
+        file = entry.file;
+    }
+
+    // stat - без мьютекса: соседние потоки в это время обслуживают попадания
+    struct stat st{};
+    bool fresh = stat(file->path.c_str(), &st) == 0 && sameVersion(*file, st);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fresh) {
+        ++hits;
+        return file;
+    }
+    auto it = index.find(file->path);
+    if (it != index.end() && it->second->file == file) erase(it->second);
+    ++misses;
+    return nullptr;
+}
+
+bool FileCache::cacheable(const struct stat &st) const {
+    size_t size = st.st_size;
+    if (size == 0 || size > maxFileSize || !S_ISREG(st.st_mode)) return false;
+    timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec - st.st_mtim.tv_sec > FILE_CACHE_REVALIDATE.count();
+}
+
+void FileCache::missed(std::string_view path, const struct stat &st) {
+    if (capacity == 0 || !cacheable(st)) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!loader) return;
+    auto it = candidates.find(std::string(path));
+    if (it == candidates.end()) {
+        // Забываются файлы, которые просили по разу; читаемые дождутся своего load
+        if (candidates.size() >= FILE_CACHE_CANDIDATES) {
+            std::erase_if(candidates, [](const auto &candidate) { return !candidate.second.loading; });
+        }
+        it = candidates.emplace(std::string(path), Candidate{}).first;
+    }
+    Candidate &candidate = it->second;
+    if (candidate.loading) return;
+    if (candidate.mtime.tv_sec != st.st_mtim.tv_sec || candidate.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        candidate.mtime = st.st_mtim;
+        candidate.requests = 0;
+    }
+    if (++candidate.requests < FILE_CACHE_ADMIT_AFTER) return;
+    candidate.loading = true;
+    loader->enqueue([this, name = it->first] { load(name); });
+}
+
+void FileCache::load(const std::string &path) {
+    uint64_t started;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        started = invalidations;
+    }
+    CachedFileRef loaded;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (fd != -1 && fstat(fd, &st) == 0 && cacheable(st)) {
+        size_t size = st.st_size;
+        auto file = std::make_shared<CachedFile>();
+        file->path = path;
+        file->size = size;
+        file->mtime = st.st_mtim;
+        file->data.reset(new char[size]);
+        size_t done = 0;
+        while (done < size) {
+            ssize_t rc = pread(fd, file->data.get() + done, size - done, done);
+            if (rc == -1 && errno == EINTR) continue;
+            if (rc <= 0) break;
+            done += rc;
+        }
+        if (done == size) {
+            file->crc = crc32c(0, file->data.get(), size);
+            loaded = std::move(file);
+        }
+    }
+    if (fd != -1) close(fd);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    candidates.erase(path);
+    if (!loaded) return;
+    auto it = index.find(path);
+    if (it != index.end()) erase(it->second);
+    // Файл заменили, пока он читался: запись сверится со stat при первом же попадании
+    std::chrono::steady_clock::time_point checkedAt;
+    if (started == invalidations) checkedAt = std::chrono::steady_clock::now();
+    lru.push_front(Entry{loaded, checkedAt});
+    index.emplace(loaded->path, lru.begin());
+    bytes += loaded->size;
+    while (bytes > capacity) erase(std::prev(lru.end()));
+}
+
+void FileCache::invalidate(std::string_view path) {
+    if (capacity == 0) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    ++invalidations;
+    auto it = index.find(path);
+    if (it != index.end()) erase(it->second);
+}
+
+void FileCache::setLoader(ThreadPool *pool) {
+    std::lock_guard<std::mutex> lock(mutex);
+    loader = pool;
+}
+
+FileCache::Stats FileCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return Stats{hits, misses, index.size(), bytes};
+}
+
+// Отдачи, которые ещё держат CachedFileRef, дочитывают свою копию спокойно
+void FileCache::erase(Lru::iterator it) {
+    bytes -= it->file->size;
+    index.erase(it->file->path);
+    lru.erase(it);
+}
+
+FileCache &fileCache() {
+    static FileCache cache(static_cast<size_t>(g_config.fileCacheMB) * 1024 * 1024, FILE_CACHE_MAX_FILE);
+    return cache;
+}
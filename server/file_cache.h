@@ -0,0 +1,107 @@
+#ifndef TCP_SERVER_FILE_CACHE_H
+#define TCP_SERVER_FILE_CACHE_H
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unordered_map>
+
+class ThreadPool;
+
+// Файлы больше этого в кэш не попадают - их отдаёт sendfile/pread прямо с диска
+constexpr size_t FILE_CACHE_MAX_FILE = 8 * 1024 * 1024;
+// Файл читается в кэш на таком по счёту промахе: однократная отдача не вытесняет горячие
+constexpr uint32_t FILE_CACHE_ADMIT_AFTER = 2;
+// Сколько промахнувшихся файлов помнится ради этого счёта
+constexpr size_t FILE_CACHE_CANDIDATES = 4096;
+// Как часто попадание сверяется со stat: реже - быстрее, но дольше виден устаревший файл.
+// Файл, изменённый меньше этого времени назад, не кэшируется: его, скорее всего, ещё пишут.
+constexpr auto FILE_CACHE_REVALIDATE = std::chrono::seconds(1);
+
+// Содержимое файла в памяти. Копия в анонимной памяти, а не mmap: ranged UPLOAD
+// может обрезать файл (ftruncate), и чтение из отображения посреди отдачи дало бы SIGBUS.
+struct CachedFile {
+    std::string path;
+    std::unique_ptr<char[]> data;
+    size_t size = 0;
+    timespec mtime{};
+    uint32_t crc = 0;   // CRC32C всего файла: HASH горячего файла ничего не читает
+};
+using CachedFileRef = std::shared_ptr<const CachedFile>;
+
+// LRU-кэш горячих файлов, общий для TCP-реакторов и UDP-потока. Попадание не делает
+// системных вызовов: запись сверяется со stat (размер, mtime) не чаще раза в
+// FILE_CACHE_REVALIDATE, а UPLOAD того же файла сбрасывает её сразу.
+// Промах отдаётся с диска как обычно; повторно запрошенный файл читается в память
+// в дисковом пуле, а не в потоке, обслуживающем клиентов.
+class FileCache {
+public:
+    FileCache(size_t capacity, size_t maxFileSize);
+
+    // Свежая запись или nullptr - тогда вызывающий открывает файл сам и зовёт missed
+    CachedFileRef find(std::string_view path);
+    // Промах по файлу, который вызывающий открыл и fstat'нул: на FILE_CACHE_ADMIT_AFTER-м
+    // подходящий файл ставится на чтение в пул загрузчика. Сам не ждёт и не читает.
+    void missed(std::string_view path, const struct stat &st);
+    void invalidate(std::string_view path);
+    // Пул, в котором читаются файлы; nullptr - новые файлы в кэш не попадают
+    void setLoader(ThreadPool *pool);
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        size_t entries;
+        size_t bytes;
+    };
+    Stats stats() const;
+
+private:
+    struct Entry {
+        CachedFileRef file;
+        std::chrono::steady_clock::time_point checkedAt;
+    };
+    using Lru = std::list<Entry>;
+
+    // Промахнувшийся файл: сколько раз его просили в этой версии
+    struct Candidate {
+        timespec mtime{};
+        uint32_t requests = 0;
+        bool loading = false;
+    };
+
+    void erase(Lru::iterator it);
+    bool cacheable(const struct stat &st) const;
+    // В потоке пула: читает файл, считает CRC и кладёт в кэш
+    void load(const std::string &path);
+
+    const size_t capacity;
+    const size_t maxFileSize;
+    mutable std::mutex mutex;
+    Lru lru;   // в начале - последние попадания
+    std::unordered_map<std::string_view, Lru::iterator> index;   // ключи ссылаются на file->path
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    std::unordered_map<std::string, Candidate> candidates;
+    uint64_t invalidations = 0;   // load, пересёкшийся с invalidate, сверит запись при первом find
+    ThreadPool *loader = nullptr;
+};
+
+// Кэш процесса; размер берётся из g_config при первом обращении
+FileCache &fileCache();
+
+// Пока жив, кэш процесса читает файлы в pool; снимается раньше, чем пул разрушится
+class FileCacheLoader {
+public:
+    explicit FileCacheLoader(ThreadPool &pool) { fileCache().setLoader(&pool); }
+    ~FileCacheLoader() { fileCache().setLoader(nullptr); }
+    FileCacheLoader(const FileCacheLoader &) = delete;
+    FileCacheLoader &operator=(const FileCacheLoader &) = delete;
+};
+
+#endif//TCP_SERVER_FILE_CACHE_H
@@ -0,0 +1,273 @@
+#include "lifecycle.h"
+#include "../libs.h"
+#include "logger.h"
+#include <atomic>
+#include <cerrno>
+#include <poll.h>
+#include <sys/un.h>
+
+// Сколько fd помещается в одно сообщение SCM_RIGHTS (SCM_MAX_FD ядра)
+constexpr size_t HANDOFF_MAX_FDS = 253;
+constexpr int CONTROL_TIMEOUT_SEC = 5;
+
+enum class ListenerState : int { Serving, HandedOff, Retired };
+
+static std::atomic<uint64_t> g_drainDeadline{0};
+static std::atomic<ListenerState> g_listenerState{ListenerState::Serving};
+
+static std::mutex g_publishedMutex;
+static std::vector<int> g_publishedTcp;
+static int g_publishedUdp = -1;
+static int g_publishedMetrics = -1;
+
+// Заполняются в main до запуска серверов, дальше только читаются
+static std::vector<int> g_inheritedTcp;
+static int g_inheritedUdp = -1;
+static int g_inheritedMetrics = -1;
+
+static uint64_t steadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t drainDeadlineMs() {
+    uint64_t deadline = g_drainDeadline.load(std::memory_order_acquire);
+    if (deadline != 0) return deadline;
+    uint64_t candidate = steadyMs() + static_cast<uint64_t>(std::max(0, g_config.drainTimeout)) * 1000;
+    // Первый заметивший drain поток задаёт срок для всех
+    g_drainDeadline.compare_exchange_strong(deadline, candidate, std::memory_order_acq_rel);
+    return g_drainDeadline.load(std::memory_order_acquire);
+}
+
+void publishListener(ListenerKind kind, int fd) {
+    std::lock_guard<std::mutex> lock(g_publishedMutex);
+    if (kind == ListenerKind::Tcp) {
+        g_publishedTcp.push_back(fd);
+    } else if (kind == ListenerKind::Udp) {
+        g_publishedUdp = fd;
+    } else {
+        g_publishedMetrics = fd;
+    }
+}
+
+size_t inheritedListeners(ListenerKind kind) {
+    if (kind == ListenerKind::Tcp) return g_inheritedTcp.size();
+    return (kind == ListenerKind::Udp ? g_inheritedUdp : g_inheritedMetrics) != -1 ? 1 : 0;
+}
+
+int inheritedListener(ListenerKind kind, size_t index) {
+    if (kind == ListenerKind::Tcp) return index < g_inheritedTcp.size() ? g_inheritedTcp[index] : -1;
+    if (index != 0) return -1;
+    return kind == ListenerKind::Udp ? g_inheritedUdp : g_inheritedMetrics;
+}
+
+bool listenersHandedOff() {
+    return g_listenerState.load(std::memory_order_acquire) == ListenerState::HandedOff;
+}
+
+bool retireListeners() {
+    ListenerState expected = ListenerState::Serving;
+    if (g_listenerState.compare_exchange_strong(expected, ListenerState::Retired)) return true;
+    return expected == ListenerState::Retired;
+}
+
+// То же, что beginDrain реакторов: отказ клиентам из очереди accept всех TCP-сокетов
+static void shutdownPublishedListeners() {
+    std::lock_guard<std::mutex> lock(g_publishedMutex);
+    for (int fd : g_publishedTcp) shutdown(fd, SHUT_RD);
+}
+
+static bool fillUnixAddress(const std::string &path, sockaddr_un &addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+static void setReceiveTimeout(int fd, int seconds) {
+    timeval timeout{seconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Строка-заголовок и все fd одним sendmsg: сначала TCP, затем UDP и метрики
+static bool sendDescriptors(int client, const std::string &header, const std::vector<int> &fds) {
+    iovec iov{const_cast<char *>(header.data()), header.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    return sendmsg(client, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(header.size());
+}
+
+static void sendControlReply(int client, std::string_view reply) {
+    ssize_t rc = send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+    (void) rc;
+}
+
+// TAKEOVER: отдаёт слушающие сокеты и уводит процесс в drain. true - сокеты отданы.
+static bool handOffListeners(int client) {
+    if (g_draining) {
+        sendControlReply(client, "ERROR: Draining\n");
+        return false;
+    }
+    std::vector<int> fds;
+    size_t tcpCount, udpCount, metricsCount;
+    {
+        std::lock_guard<std::mutex> lock(g_publishedMutex);
+        fds = g_publishedTcp;
+        tcpCount = fds.size();
+        udpCount = g_publishedUdp != -1 ? 1 : 0;
+        metricsCount = g_publishedMetrics != -1 ? 1 : 0;
+        if (udpCount) fds.push_back(g_publishedUdp);
+        if (metricsCount) fds.push_back(g_publishedMetrics);
+    }
+    if (tcpCount == 0 || fds.size() > HANDOFF_MAX_FDS) {
+        sendControlReply(client, "ERROR: Listeners not ready\n");
+        return false;
+    }
+    // Занимаем сокеты раньше отправки: начавшийся тем временем drain не закроет их у преемника
+    ListenerState expected = ListenerState::Serving;
+    if (!g_listenerState.compare_exchange_strong(expected, ListenerState::HandedOff)) {
+        sendControlReply(client, "ERROR: Draining\n");
+        return false;
+    }
+    std::string header = "LISTENERS " + std::to_string(tcpCount) + " " + std::to_string(udpCount) + " " +
+                         std::to_string(metricsCount) + "\n";
+    if (!sendDescriptors(client, header, fds)) {
+        int error = errno;
+        expected = ListenerState::HandedOff;
+        g_listenerState.compare_exchange_strong(expected, ListenerState::Serving);
+        // Начавшийся тем временем drain видел HandedOff и сокеты не закрыл - закрываем за него
+        if (g_draining && retireListeners()) shutdownPublishedListeners();
+        LOG_WARN("control", "handoff_failed", "error=\"%s\"", strerror(error));
+        return false;
+    }
+    LOG_INFO("control", "handoff", "tcp=%zu udp=%zu metrics=%zu drain_timeout=%d", tcpCount, udpCount, metricsCount,
+             g_config.drainTimeout);
+    g_draining = 1;
+    return true;
+}
+
+// Одна команда на подключение; true - сокеты отданы преемнику
+static bool serveControlClient(int client) {
+    setReceiveTimeout(client, CONTROL_TIMEOUT_SEC);
+    char request[64];
+    size_t size = 0;
+    while (size < sizeof(request) - 1) {
+        ssize_t rc = recv(client, request + size, sizeof(request) - 1 - size, 0);
+        if (rc <= 0) break;
+        size += rc;
+        if (memchr(request, '\n', size)) break;
+    }
+    std::string_view line(request, size);
+    line = line.substr(0, line.find_first_of("\r\n"));
+
+    if (line == "TAKEOVER") return handOffListeners(client);
+    if (line == "DRAIN") {
+        g_draining = 1;
+        sendControlReply(client, "OK\n");
+        return false;
+    }
+    sendControlReply(client, "ERROR: Unknown command\n");
+    return false;
+}
+
+void runControlServer() {
+    const std::string &path = g_config.controlSocket;
+    if (path.empty()) return;
+    sockaddr_un addr;
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!fillUnixAddress(path, addr) || sock == INVALID_SOCKET) {
+        LOG_ERROR("control", "listen_failed", "path=%s error=\"bad path or socket\"", path.c_str());
+        if (sock != INVALID_SOCKET) close(sock);
+        return;
+    }
+    // Путь мог остаться от предшественника, которому этот процесс пришёл на смену
+    unlink(path.c_str());
+    if (bind(sock, (sockaddr *) &addr, sizeof(addr)) == -1 || listen(sock, 4) == -1) {
+        LOG_ERROR("control", "listen_failed", "path=%s error=\"%s\"", path.c_str(), strerror(errno));
+        close(sock);
+        return;
+    }
+    // Забрать сокеты сервера может только его владелец
+    chmod(path.c_str(), 0600);
+    LOG_INFO("control", "listening", "path=%s", path.c_str());
+
+    bool handedOff = false;
+    while (!g_shutdown && !handedOff) {
+        pollfd pfd{sock, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) continue;
+        int client = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) continue;
+        handedOff = serveControlClient(client);
+        close(client);
+    }
+    close(sock);
+    // После передачи путь принадлежит преемнику
+    if (!handedOff) unlink(path.c_str());
+}
+
+bool takeOverListeners(const std::string &path) {
+    sockaddr_un addr;
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!fillUnixAddress(path, addr) || sock == INVALID_SOCKET ||
+        connect(sock, (sockaddr *) &addr, sizeof(addr)) == -1) {
+        LOG_ERROR("control", "takeover_failed", "path=%s error=\"%s\"", path.c_str(), strerror(errno));
+        if (sock != INVALID_SOCKET) close(sock);
+        return false;
+    }
+    setReceiveTimeout(sock, CONTROL_TIMEOUT_SEC);
+    sendControlReply(sock, "TAKEOVER\n");
+
+    char header[128];
+    iovec iov{header, sizeof(header) - 1};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    close(sock);
+    if (size <= 0) {
+        LOG_ERROR("control", "takeover_failed", "path=%s error=\"no reply\"", path.c_str());
+        return false;
+    }
+    header[size] = '\0';
+
+    std::vector<int> fds;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t first = fds.size();
+        fds.resize(first + count);
+        memcpy(fds.data() + first, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+
+    // Счётчика метрик нет у предшественника, который их ещё не передавал
+    size_t tcpCount = 0, udpCount = 0, metricsCount = 0;
+    bool valid = sscanf(header, "LISTENERS %zu %zu %zu", &tcpCount, &udpCount, &metricsCount) >= 2 && tcpCount > 0 &&
+                 udpCount <= 1 && metricsCount <= 1 && fds.size() == tcpCount + udpCount + metricsCount &&
+                 !(msg.msg_flags & MSG_CTRUNC);
+    if (!valid) {
+        for (int fd : fds) close(fd);
+        LOG_ERROR("control", "takeover_failed", "path=%s reply=\"%.*s\"", path.c_str(),
+                  static_cast<int>(strcspn(header, "\r\n")), header);
+        return false;
+    }
+    g_inheritedTcp.assign(fds.begin(), fds.begin() + tcpCount);
+    if (udpCount) g_inheritedUdp = fds[tcpCount];
+    if (metricsCount) g_inheritedMetrics = fds.back();
+    LOG_INFO("control", "takeover", "path=%s tcp=%zu udp=%zu metrics=%zu", path.c_str(), tcpCount, udpCount,
+             metricsCount);
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef TCP_SERVER_LIFECYCLE_H
+#define TCP_SERVER_LIFECYCLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Мягкая остановка и горячий перезапуск.
+// Первый SIGTERM/SIGINT (или DRAIN в управляющий сокет) выставляет g_draining: приём новых
+// соединений и передач прекращается, начатые доделываются до --drain-timeout, после чего
+// оставшиеся закрываются. Повторный сигнал - немедленная остановка (g_shutdown).
+// Горячий перезапуск: новый процесс с --takeover PATH подключается к --control-socket PATH
+// старого и получает его слушающие сокеты через SCM_RIGHTS. Очередь accept живёт в ядре
+// и переходит вместе с сокетом, поэтому клиенты не получают отказов; старый уходит в drain.
+// Сокет метрик передаётся так же: порт занят старым процессом до конца его drain.
+enum class ListenerKind : uint8_t { Tcp, Udp, Metrics };
+
+// Срок мягкой остановки по steady_clock, мс; отсчёт с первого вызова после g_draining
+uint64_t drainDeadlineMs();
+
+// Сокет, который можно передать преемнику (после bind/listen)
+void publishListener(ListenerKind kind, int fd);
+// Сокеты, полученные от предшественника по --takeover; до запуска серверов
+bool takeOverListeners(const std::string &path);
+size_t inheritedListeners(ListenerKind kind);
+int inheritedListener(ListenerKind kind, size_t index);
+
+// Сокеты отданы преемнику: они по-прежнему общие, закрывать приём на них нельзя
+bool listenersHandedOff();
+// Вызывается при начале drain; true - преемника нет и слушающие сокеты нужно закрыть
+// (shutdown), чтобы клиенты из очереди получили отказ сразу, а не по истечении срока
+bool retireListeners();
+
+// Поток управляющего Unix-сокета --control-socket: TAKEOVER и DRAIN, пока не выставлен g_shutdown
+void runControlServer();
+
+#endif//TCP_SERVER_LIFECYCLE_H
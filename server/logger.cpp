@@ -0,0 +1,327 @@
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Запись занимает четыре строки кэша; длиннее - обрезается
+constexpr size_t LOG_RECORD_SIZE = 256;
+constexpr size_t LOG_RING_RECORDS = 1024;   // 256 КБ на поток
+// Фоновый поток просыпается сам раз в LOG_FLUSH_INTERVAL; раньше - если кольцо
+// заполнено наполовину или пришла строка warn/error
+constexpr auto LOG_FLUSH_INTERVAL = std::chrono::milliseconds(10);
+
+std::atomic<uint8_t> g_logLevel{static_cast<uint8_t>(LogLevel::Info)};
+static std::atomic<uint32_t> g_logRate{1000};
+static std::atomic<int> g_logOut{STDOUT_FILENO};
+static std::atomic<int> g_logErr{STDERR_FILENO};
+
+struct LogRecord {
+    int64_t timeNs;   // system_clock
+    LogLevel level;
+    uint16_t length;
+    char text[LOG_RECORD_SIZE - sizeof(int64_t) - 4];
+};
+static_assert(sizeof(LogRecord) == LOG_RECORD_SIZE);
+
+// Кольцо одного потока. head двигает только фоновый поток, tail и счётчики - только владелец.
+struct LogRing {
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> suppressed{0};
+    uint64_t droppedReported = 0;   // фоновый поток: о скольких уже написал
+    LogRecord records[LOG_RING_RECORDS];
+};
+
+static std::mutex g_ringsMutex;
+static std::vector<std::unique_ptr<LogRing>> g_rings;
+
+static std::mutex g_writerMutex;
+static std::condition_variable g_writerWake;
+static bool g_wakeRequested = false;
+static bool g_writerStop = false;
+// Запуск и остановка фонового потока
+static std::mutex g_lifecycleMutex;
+static std::thread g_writer;
+static std::atomic<bool> g_async{true};
+static std::atomic<uint64_t> g_written{0};
+// После flushLog строки пишутся синхронно под этим мьютексом
+static std::mutex g_syncMutex;
+
+static void writerLoop();
+
+// Фоновый поток запускается с первой строкой, а останавливается при выходе из процесса
+static void startWriter() {
+    std::lock_guard<std::mutex> lock(g_lifecycleMutex);
+    if (g_writer.joinable() || !g_async.load(std::memory_order_relaxed)) return;
+    g_writer = std::thread(writerLoop);
+    std::atexit(flushLog);
+}
+
+static LogRing &localRing() {
+    thread_local LogRing *ring = [] {
+        startWriter();
+        std::lock_guard<std::mutex> lock(g_ringsMutex);
+        g_rings.emplace_back(new LogRing);
+        return g_rings.back().get();
+    }();
+    return *ring;
+}
+
+static void bump(std::atomic<uint64_t> &value) {
+    value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void setLogLevel(LogLevel level) {
+    g_logLevel.store(static_cast<uint8_t>(level), std::memory_order_relaxed);
+}
+
+bool parseLogLevel(std::string_view name, LogLevel &level) {
+    static constexpr std::pair<std::string_view, LogLevel> LEVELS[] = {
+            {"debug", LogLevel::Debug}, {"info", LogLevel::Info}, {"warn", LogLevel::Warn},
+            {"error", LogLevel::Error}, {"off", LogLevel::Off},
+    };
+    for (auto &[levelName, value] : LEVELS) {
+        if (levelName == name) {
+            level = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void setLogRate(uint32_t perSecond) {
+    g_logRate.store(perSecond, std::memory_order_relaxed);
+}
+
+void setLogOutput(int out, int err) {
+    g_logOut.store(out, std::memory_order_relaxed);
+    g_logErr.store(err, std::memory_order_relaxed);
+}
+
+bool LogLimiter::allow(uint64_t &suppressed) {
+    uint32_t limit = g_logRate.load(std::memory_order_relaxed);
+    if (limit != 0) {
+        uint64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        if (second != window) {
+            window = second;
+            used = 0;
+        }
+        if (used >= limit) {
+            ++dropped;
+            bump(localRing().suppressed);
+            return false;
+        }
+        ++used;
+    }
+    suppressed = dropped;
+    dropped = 0;
+    return true;
+}
+
+static const char *levelName(LogLevel level) {
+    static const char *NAMES[] = {"debug", "info", "warn", "error", "off"};
+    return NAMES[static_cast<size_t>(level)];
+}
+
+// Дописывает строку без printf: заголовок записи есть у каждой строки
+static size_t appendText(char *text, size_t length, size_t capacity, const char *value) {
+    size_t size = std::min(strlen(value), capacity - 1 - length);
+    memcpy(text + length, value, size);
+    return length + size;
+}
+
+static size_t formatRecord(char *text, size_t capacity, LogLevel level, const char *source, const char *event,
+                           uint64_t suppressed, const char *format, va_list args) {
+    size_t length = appendText(text, 0, capacity, "level=");
+    length = appendText(text, length, capacity, levelName(level));
+    length = appendText(text, length, capacity, " src=");
+    length = appendText(text, length, capacity, source);
+    length = appendText(text, length, capacity, " event=");
+    length = appendText(text, length, capacity, event);
+    length = appendText(text, length, capacity, " ");
+    int n = vsnprintf(text + length, capacity - length, format, args);
+    length = std::min<size_t>(length + std::max(n, 0), capacity - 1);
+    if (suppressed != 0) {
+        n = snprintf(text + length, capacity - length, " suppressed=%llu", static_cast<unsigned long long>(suppressed));
+        length = std::min<size_t>(length + std::max(n, 0), capacity - 1);
+    }
+    while (length > 0 && text[length - 1] == ' ') --length;
+    return length;
+}
+
+static void wakeWriter() {
+    {
+        std::lock_guard<std::mutex> lock(g_writerMutex);
+        g_wakeRequested = true;
+    }
+    g_writerWake.notify_one();
+}
+
+static void writeAll(int fd, const std::string &data) {
+    for (size_t done = 0; done < data.size();) {
+        ssize_t rc = write(fd, data.data() + done, data.size() - done);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return;
+        done += rc;
+    }
+}
+
+// ts=2026-10-17T05:07:41.123456Z; секунды форматируются заново только когда сменились
+static void appendTimestamp(std::string &out, int64_t timeNs) {
+    thread_local time_t cachedSecond = -1;
+    thread_local char cachedPrefix[32];
+    time_t second = static_cast<time_t>(timeNs / 1000000000);
+    if (second != cachedSecond) {
+        tm parts{};
+        gmtime_r(&second, &parts);
+        strftime(cachedPrefix, sizeof(cachedPrefix), "ts=%Y-%m-%dT%H:%M:%S", &parts);
+        cachedSecond = second;
+    }
+    char fraction[] = ".000000Z ";
+    int micros = static_cast<int>(timeNs % 1000000000 / 1000);
+    for (int i = 6; i >= 1; --i, micros /= 10) fraction[i] = static_cast<char>('0' + micros % 10);
+    out.append(cachedPrefix);
+    out.append(fraction, sizeof(fraction) - 1);
+}
+
+static void appendRecord(std::string &out, const LogRecord &record) {
+    appendTimestamp(out, record.timeNs);
+    out.append(record.text, record.length);
+    out.push_back('\n');
+}
+
+static int64_t wallClockNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void logWrite(LogLevel level, const char *source, const char *event, uint64_t suppressed, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (!g_async.load(std::memory_order_acquire)) {
+        LogRecord record;
+        record.timeNs = wallClockNs();
+        record.level = level;
+        record.length = static_cast<uint16_t>(
+                formatRecord(record.text, sizeof(record.text), level, source, event, suppressed, format, args));
+        va_end(args);
+        std::string line;
+        appendRecord(line, record);
+        std::lock_guard<std::mutex> lock(g_syncMutex);
+        writeAll(level >= LogLevel::Warn ? g_logErr.load() : g_logOut.load(), line);
+        g_written.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRing &ring = localRing();
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    uint64_t used = tail - ring.head.load(std::memory_order_acquire);
+    if (used >= LOG_RING_RECORDS) {
+        va_end(args);
+        bump(ring.dropped);
+        return;
+    }
+    LogRecord &record = ring.records[tail % LOG_RING_RECORDS];
+    record.timeNs = wallClockNs();
+    record.level = level;
+    record.length = static_cast<uint16_t>(
+            formatRecord(record.text, sizeof(record.text), level, source, event, suppressed, format, args));
+    va_end(args);
+    ring.tail.store(tail + 1, std::memory_order_release);
+    if (level >= LogLevel::Warn || used + 1 == LOG_RING_RECORDS / 2) wakeWriter();
+}
+
+// Забирает всё, что накопилось во всех кольцах, в порядке времени
+static void drainRings(std::string &out, std::string &err) {
+    struct Pending {
+        LogRing *ring;
+        uint64_t head;
+        uint64_t tail;
+    };
+    std::vector<Pending> pending;
+    std::vector<const LogRecord *> records;
+    {
+        std::lock_guard<std::mutex> lock(g_ringsMutex);
+        for (auto &ring : g_rings) {
+            uint64_t head = ring->head.load(std::memory_order_relaxed);
+            uint64_t tail = ring->tail.load(std::memory_order_acquire);
+            pending.push_back(Pending{ring.get(), head, tail});
+            for (uint64_t i = head; i < tail; ++i) records.push_back(&ring->records[i % LOG_RING_RECORDS]);
+        }
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const LogRecord *a, const LogRecord *b) { return a->timeNs < b->timeNs; });
+    for (const LogRecord *record : records) appendRecord(record->level >= LogLevel::Warn ? err : out, *record);
+    g_written.fetch_add(records.size(), std::memory_order_relaxed);
+
+    for (Pending &entry : pending) {
+        entry.ring->head.store(entry.tail, std::memory_order_release);
+        uint64_t dropped = entry.ring->dropped.load(std::memory_order_relaxed);
+        if (dropped != entry.ring->droppedReported) {
+            char line[128];
+            LogRecord notice{};
+            notice.timeNs = wallClockNs();
+            int n = snprintf(line, sizeof(line), "level=warn src=log event=ring_overflow dropped=%llu",
+                             static_cast<unsigned long long>(dropped - entry.ring->droppedReported));
+            notice.length = static_cast<uint16_t>(std::min<size_t>(n, sizeof(notice.text) - 1));
+            memcpy(notice.text, line, notice.length);
+            appendRecord(err, notice);
+            entry.ring->droppedReported = dropped;
+        }
+    }
+}
+
+static void flushPending() {
+    std::string out, err;
+    drainRings(out, err);
+    if (!out.empty()) writeAll(g_logOut.load(), out);
+    if (!err.empty()) writeAll(g_logErr.load(), err);
+}
+
+static void writerLoop() {
+    std::unique_lock<std::mutex> lock(g_writerMutex);
+    while (!g_writerStop) {
+        g_writerWake.wait_for(lock, LOG_FLUSH_INTERVAL, [] { return g_wakeRequested || g_writerStop; });
+        g_wakeRequested = false;
+        lock.unlock();
+        flushPending();
+        lock.lock();
+    }
+}
+
+void flushLog() {
+    std::lock_guard<std::mutex> lifecycle(g_lifecycleMutex);
+    // Новые строки сразу идут в вывод; то, что уже в кольцах, дописывается ниже
+    g_async.store(false, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(g_writerMutex);
+        g_writerStop = true;
+    }
+    g_writerWake.notify_one();
+    if (g_writer.joinable()) g_writer.join();
+    flushPending();
+}
+
+LogStats logStats() {
+    LogStats stats{g_written.load(std::memory_order_relaxed), 0, 0};
+    std::lock_guard<std::mutex> lock(g_ringsMutex);
+    for (auto &ring : g_rings) {
+        stats.dropped += ring->dropped.load(std::memory_order_relaxed);
+        stats.suppressed += ring->suppressed.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
@@ -0,0 +1,89 @@
+#ifndef TCP_SERVER_LOGGER_H
+#define TCP_SERVER_LOGGER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+// Асинхронный журнал. Строка форматируется в потоке-источнике прямо в его кольцо
+// (один писатель, один читатель - без блокировок), фоновый поток раз в несколько
+// миллисекунд собирает кольца всех потоков и пишет пачкой одним write(2).
+// Переполненное кольцо не ждёт: запись отбрасывается и попадает в счётчик.
+// Строки в формате logfmt: ts=... level=info src=tcp event=client_connected peer=... reactor=0
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error, Off };
+
+// Уровни ниже LOG_COMPILED_LEVEL (0 - debug ... 3 - error) вырезаются при компиляции:
+// в релизной сборке debug-строк нет вовсе, их аргументы не вычисляются
+#ifndef LOG_COMPILED_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILED_LEVEL 1
+#else
+#define LOG_COMPILED_LEVEL 0
+#endif
+#endif
+
+extern std::atomic<uint8_t> g_logLevel;
+
+// Уровень не вырезан при компиляции; сравнение перечислений, а не int с 0 - без -Wtype-limits
+constexpr bool logCompiled(LogLevel level) {
+    return level >= static_cast<LogLevel>(LOG_COMPILED_LEVEL);
+}
+
+inline bool logEnabled(LogLevel level) {
+    return static_cast<uint8_t>(level) >= g_logLevel.load(std::memory_order_relaxed);
+}
+
+void setLogLevel(LogLevel level);
+// debug, info, warn, error, off
+bool parseLogLevel(std::string_view name, LogLevel &level);
+// Не больше perSecond строк в секунду из одного места кода в одном потоке, 0 - без ограничения
+void setLogRate(uint32_t perSecond);
+// Куда писать: info и ниже - в out, warn и error - в err (по умолчанию stdout и stderr)
+void setLogOutput(int out, int err);
+
+// Ограничитель частоты для одного места вызова в одном потоке: окно в одну секунду.
+// Пропущенные строки не теряются бесследно - их число уходит в suppressed= следующей.
+class LogLimiter {
+public:
+    bool allow(uint64_t &suppressed);
+
+private:
+    uint64_t window = 0;
+    uint32_t used = 0;
+    uint64_t dropped = 0;
+};
+
+void logWrite(LogLevel level, const char *source, const char *event, uint64_t suppressed, const char *format, ...)
+        __attribute__((format(printf, 5, 6)));
+
+struct LogStats {
+    uint64_t written;      // строк отдано в вывод
+    uint64_t dropped;      // отброшено из-за переполненного кольца
+    uint64_t suppressed;   // пропущено ограничителем частоты
+};
+LogStats logStats();
+
+// Дописывает всё накопленное и останавливает фоновый поток; вызывается и при exit.
+// После остановки строки пишутся сразу, синхронно.
+void flushLog();
+
+// format - поля "ключ=значение" через пробел, printf-подстановки проверяются компилятором
+#define LOG_AT(level, source, event, ...)                                                          \
+    do {                                                                                           \
+        if constexpr (logCompiled(level)) {                                                        \
+            if (logEnabled(level)) {                                                               \
+                static thread_local LogLimiter logLimiter;                                         \
+                uint64_t logSuppressed;                                                            \
+                if (logLimiter.allow(logSuppressed)) {                                             \
+                    logWrite(level, source, event, logSuppressed, __VA_ARGS__);                    \
+                }                                                                                  \
+            }                                                                                      \
+        }                                                                                          \
+    } while (0)
+
+#define LOG_DEBUG(source, event, ...) LOG_AT(LogLevel::Debug, source, event, __VA_ARGS__)
+#define LOG_INFO(source, event, ...) LOG_AT(LogLevel::Info, source, event, __VA_ARGS__)
+#define LOG_WARN(source, event, ...) LOG_AT(LogLevel::Warn, source, event, __VA_ARGS__)
+#define LOG_ERROR(source, event, ...) LOG_AT(LogLevel::Error, source, event, __VA_ARGS__)
+
+#endif//TCP_SERVER_LOGGER_H
@@ -0,0 +1,202 @@
+#include "lz4.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <vector>
+
+constexpr int LZ4_HASH_LOG = 12;
+constexpr size_t LZ4_MIN_MATCH = 4;
+// Требования формата: последние 5 байт блока - всегда литералы,
+// последнее совпадение начинается не ближе 12 байт к концу
+constexpr size_t LZ4_LAST_LITERALS = 5;
+constexpr size_t LZ4_MF_LIMIT = 12;
+constexpr size_t LZ4_MAX_DISTANCE = 65535;
+// Образец должен сжаться хотя бы на 1/8, иначе файл идёт без сжатия
+constexpr size_t LZ4_MIN_GAIN_SHIFT = 3;
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash4(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *writeLength(uint8_t *out, size_t length) {
+    for (; length >= 255; length -= 255) *out++ = 255;
+    *out++ = static_cast<uint8_t>(length);
+    return out;
+}
+
+// Жадный поиск совпадений по хэшу 4 байт, как в LZ4_compress_fast. На несжимаемых
+// данных шаг поиска растёт с длиной текущей полосы литералов.
+size_t lz4Compress(const char *src, size_t size, char *dst, size_t capacity) {
+    auto *in = reinterpret_cast<const uint8_t *>(src);
+    const uint8_t *end = in + size;
+    auto *out = reinterpret_cast<uint8_t *>(dst);
+    const uint8_t *outEnd = out + capacity;
+    const uint8_t *anchor = in;
+
+    // Последовательность: литералы [anchor, literalEnd) и, кроме последней, совпадение
+    auto emit = [&](const uint8_t *literalEnd, size_t offset, size_t matchLength, bool last) {
+        size_t literals = literalEnd - anchor;
+        size_t needed = 1 + literals / 255 + 1 + literals + (last ? 0 : 2 + matchLength / 255 + 1);
+        if (needed > static_cast<size_t>(outEnd - out)) return false;
+        uint8_t *token = out++;
+        *token = static_cast<uint8_t>(std::min<size_t>(literals, 15) << 4);
+        if (literals >= 15) out = writeLength(out, literals - 15);
+        memcpy(out, anchor, literals);
+        out += literals;
+        if (last) return true;
+        *out++ = static_cast<uint8_t>(offset);
+        *out++ = static_cast<uint8_t>(offset >> 8);
+        matchLength -= LZ4_MIN_MATCH;
+        *token |= static_cast<uint8_t>(std::min<size_t>(matchLength, 15));
+        if (matchLength >= 15) out = writeLength(out, matchLength - 15);
+        return true;
+    };
+
+    if (size > LZ4_MF_LIMIT) {
+        uint32_t table[1 << LZ4_HASH_LOG] = {};   // позиция от начала блока по хэшу
+        const uint8_t *matchLimit = end - LZ4_LAST_LITERALS;
+        const uint8_t *lastMatchStart = end - LZ4_MF_LIMIT;
+        const uint8_t *p = in;
+        while (p <= lastMatchStart) {
+            uint32_t sequence = read32(p);
+            uint32_t &slot = table[hash4(sequence)];
+            const uint8_t *candidate = in + slot;
+            slot = static_cast<uint32_t>(p - in);
+            if (candidate >= p || static_cast<size_t>(p - candidate) > LZ4_MAX_DISTANCE ||
+                read32(candidate) != sequence) {
+                p += 1 + ((p - anchor) >> 6);
+                continue;
+            }
+
+            while (p > anchor && candidate > in && p[-1] == candidate[-1]) {
+                --p;
+                --candidate;
+            }
+            // Продолжение совпадения сравнивается по 8 байт: первый отличающийся байт - по ctz
+            const uint8_t *matchEnd = p + LZ4_MIN_MATCH;
+            const uint8_t *from = candidate + LZ4_MIN_MATCH;
+            while (matchEnd + 8 <= matchLimit) {
+                uint64_t diff = read64(matchEnd) ^ read64(from);
+                if (diff != 0) {
+                    matchEnd += __builtin_ctzll(diff) >> 3;
+                    goto matched;
+                }
+                matchEnd += 8;
+                from += 8;
+            }
+            while (matchEnd < matchLimit && *matchEnd == *from) {
+                ++matchEnd;
+                ++from;
+            }
+        matched:
+            if (!emit(p, p - candidate, matchEnd - p, false)) return 0;
+            p = anchor = matchEnd;
+            // Позиция прямо перед концом совпадения часто начинает следующее
+            if (p <= lastMatchStart) table[hash4(read32(p - 2))] = static_cast<uint32_t>(p - 2 - in);
+        }
+    }
+    if (!emit(end, 0, 0, true)) return 0;
+    return out - reinterpret_cast<uint8_t *>(dst);
+}
+
+bool lz4Decompress(const char *src, size_t size, char *dst, size_t rawSize) {
+    auto *in = reinterpret_cast<const uint8_t *>(src);
+    const uint8_t *inEnd = in + size;
+    auto *out = reinterpret_cast<uint8_t *>(dst);
+    auto *begin = out;
+    const uint8_t *outEnd = out + rawSize;
+
+    auto readLength = [&](size_t &length) {
+        uint8_t byte;
+        do {
+            if (in == inEnd) return false;
+            byte = *in++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (in < inEnd) {
+        uint8_t token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(literals)) return false;
+        if (literals > static_cast<size_t>(inEnd - in) || literals > static_cast<size_t>(outEnd - out)) {
+            return false;
+        }
+        // Короткие полосы - одной копией 16 байт, если с обеих сторон есть запас
+        if (literals <= 16 && inEnd - in >= 16 && outEnd - out >= 16) {
+            memcpy(out, in, 16);
+        } else {
+            memcpy(out, in, literals);
+        }
+        in += literals;
+        out += literals;
+        if (in == inEnd) break;   // последняя последовательность - без совпадения
+
+        if (inEnd - in < 2) return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !readLength(length)) return false;
+        length += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > static_cast<size_t>(out - begin) ||
+            length > static_cast<size_t>(outEnd - out)) {
+            return false;
+        }
+        const uint8_t *from = out - offset;
+        if (offset >= 8 && outEnd - out >= static_cast<ptrdiff_t>(length + 8)) {
+            // Копия по 8 байт с заходом за конец совпадения: лишнее перезапишет следующая
+            // последовательность, а с шагом не меньше 8 источник всегда уже записан
+            uint8_t *matchEnd = out + length;
+            for (; out < matchEnd; out += 8, from += 8) memcpy(out, from, 8);
+            out = matchEnd;
+        } else if (offset >= length) {
+            memcpy(out, from, length);
+            out += length;
+        } else if (offset >= 8) {
+            // Перекрытие с шагом не меньше 8: каждая порция по 8 байт уже записана
+            const uint8_t *matchEnd = out + length;
+            for (; out + 8 <= matchEnd; out += 8, from += 8) memcpy(out, from, 8);
+            while (out < matchEnd) *out++ = *from++;
+        } else {
+            // Повтор короткого образца, байт за байтом
+            for (size_t i = 0; i < length; ++i) *out++ = *from++;
+        }
+    }
+    return out == outEnd;
+}
+
+void lz4AppendFrame(std::string &out, const char *data, size_t size) {
+    size_t start = out.size();
+    out.resize(start + LZ4_FRAME_HEADER + lz4Bound(size));
+    char *frame = out.data() + start;
+    // Не сжавшийся блок (результат не короче исходного) кладётся как есть
+    size_t stored = lz4Compress(data, size, frame + LZ4_FRAME_HEADER, size - 1);
+    if (stored == 0) {
+        memcpy(frame + LZ4_FRAME_HEADER, data, size);
+        stored = size;
+    }
+    uint32_t header[2] = {htonl(static_cast<uint32_t>(stored)), htonl(static_cast<uint32_t>(size))};
+    memcpy(frame, header, sizeof(header));
+    out.resize(start + LZ4_FRAME_HEADER + stored);
+}
+
+bool lz4Worthwhile(const char *sample, size_t size) {
+    if (size == 0) return false;
+    thread_local std::vector<char> scratch(lz4Bound(LZ4_FRAME_BLOCK));
+    size = std::min(size, LZ4_FRAME_BLOCK);
+    size_t limit = size - (size >> LZ4_MIN_GAIN_SHIFT);
+    return lz4Compress(sample, size, scratch.data(), limit) != 0;
+}
@@ -0,0 +1,31 @@
+#ifndef TCP_SERVER_LZ4_H
+#define TCP_SERVER_LZ4_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Сжатие передач в формате блоков LZ4 (совместим с lz4.block и LZ4_decompress_safe).
+// Поток TCP - кадры [сжато u32][исходно u32][данные] в сетевом порядке байт; кадр,
+// который не сжался, идёт как есть (сжато == исходно). Кадр не длиннее LZ4_FRAME_BLOCK
+// исходных байт, чтобы при приёме целиком помещаться в буфер сессии.
+constexpr size_t LZ4_FRAME_BLOCK = 32 * 1024;
+constexpr size_t LZ4_FRAME_HEADER = 8;
+
+// Худший размер сжатого блока
+constexpr size_t lz4Bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+// Сжимает блок в dst ёмкостью capacity; 0 - результат не поместился
+size_t lz4Compress(const char *src, size_t size, char *dst, size_t capacity);
+// Распаковывает блок ровно в rawSize байт; false - данные повреждены
+bool lz4Decompress(const char *src, size_t size, char *dst, size_t rawSize);
+
+// Дописывает кадр с блоком в out
+void lz4AppendFrame(std::string &out, const char *data, size_t size);
+// Стоит ли сжимать файл, судя по образцу из его начала: уже сжатые данные
+// (архивы, медиа) передаются как есть и не тратят процессор
+bool lz4Worthwhile(const char *sample, size_t size);
+
+#endif//TCP_SERVER_LZ4_H
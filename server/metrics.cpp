@@ -0,0 +1,390 @@
+#include "metrics.h"
+#include "../libs.h"
+#include "file_cache.h"
+#include "lifecycle.h"
+#include "logger.h"
+#include "storage.h"
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <list>
+#include <memory>
+#include <poll.h>
+
+// Всё, что пишет один поток. Шард живёт до конца процесса, даже если поток завершился,
+// поэтому суммы счётчиков не убывают.
+struct MetricsShard {
+    std::atomic<uint64_t> counters[static_cast<size_t>(Counter::Count)]{};
+    std::atomic<uint64_t> gauges[static_cast<size_t>(Gauge::Count)]{};   // int64 в дополнительном коде
+    Histogram commands[METRIC_COMMANDS];
+    Histogram transfers[static_cast<size_t>(Transfer::Count)];
+};
+
+struct MetricSourceEntry {
+    const MetricSource *owner;
+    std::string name;
+    std::string help;
+    std::function<double()> read;
+};
+
+static std::mutex g_shardsMutex;
+static std::vector<std::unique_ptr<MetricsShard>> g_shards;
+static std::mutex g_sourcesMutex;
+static std::list<MetricSourceEntry> g_sources;
+static const auto g_started = std::chrono::steady_clock::now();
+
+static MetricsShard &localShard() {
+    thread_local MetricsShard *shard = [] {
+        std::lock_guard<std::mutex> lock(g_shardsMutex);
+        g_shards.emplace_back(new MetricsShard);
+        return g_shards.back().get();
+    }();
+    return *shard;
+}
+
+static void bump(std::atomic<uint64_t> &value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+size_t Histogram::bucketOf(uint64_t value) {
+    if (value < SUB_COUNT) return value;
+    int exponent = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (exponent - SUB_BITS)) & (SUB_COUNT - 1);
+    return std::min(BUCKETS - 1, (exponent - SUB_BITS + 1) * SUB_COUNT + sub);
+}
+
+uint64_t Histogram::upperBound(size_t bucket) {
+    if (bucket < SUB_COUNT) return bucket;
+    int exponent = static_cast<int>(bucket / SUB_COUNT) + SUB_BITS - 1;
+    uint64_t sub = bucket % SUB_COUNT;
+    return ((SUB_COUNT + sub + 1) << (exponent - SUB_BITS)) - 1;
+}
+
+void countMetric(Counter counter, uint64_t n) {
+    bump(localShard().counters[static_cast<size_t>(counter)], n);
+}
+
+void gaugeMetric(Gauge gauge, int64_t delta) {
+    bump(localShard().gauges[static_cast<size_t>(gauge)], static_cast<uint64_t>(delta));
+}
+
+void recordCommand(CommandId command, uint64_t micros) {
+    localShard().commands[static_cast<size_t>(command)].record(micros);
+}
+
+void recordTransfer(Transfer transfer, uint64_t micros) {
+    localShard().transfers[static_cast<size_t>(transfer)].record(micros);
+}
+
+MetricSource::MetricSource(std::string name, std::string help, std::function<double()> read) {
+    std::lock_guard<std::mutex> lock(g_sourcesMutex);
+    g_sources.push_back(MetricSourceEntry{this, std::move(name), std::move(help), std::move(read)});
+}
+
+MetricSource::~MetricSource() {
+    std::lock_guard<std::mutex> lock(g_sourcesMutex);
+    g_sources.remove_if([this](const MetricSourceEntry &entry) { return entry.owner == this; });
+}
+
+// Сумма шардов всех потоков на момент чтения
+struct Snapshot {
+    uint64_t counters[static_cast<size_t>(Counter::Count)]{};
+    int64_t gauges[static_cast<size_t>(Gauge::Count)]{};
+    struct Distribution {
+        uint64_t counts[Histogram::BUCKETS]{};
+        uint64_t total = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        void add(const Histogram &histogram) {
+            for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+                counts[i] += histogram.counts[i].load(std::memory_order_relaxed);
+            }
+            total += histogram.total.load(std::memory_order_relaxed);
+            sum += histogram.sum.load(std::memory_order_relaxed);
+            max = std::max(max, histogram.max.load(std::memory_order_relaxed));
+        }
+
+        // Верхняя граница корзины, в которую попал квантиль q
+        uint64_t quantile(double q) const {
+            uint64_t rank = static_cast<uint64_t>(q * total);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+                seen += counts[i];
+                if (seen > rank) return std::min(Histogram::upperBound(i), max);
+            }
+            return max;
+        }
+
+        // Сколько значений не больше limit (по верхним границам корзин)
+        uint64_t countUpTo(uint64_t limit) const {
+            uint64_t result = 0;
+            for (size_t i = 0; i < Histogram::BUCKETS && Histogram::upperBound(i) <= limit; ++i) {
+                result += counts[i];
+            }
+            return result;
+        }
+    };
+    Distribution commands[METRIC_COMMANDS];
+    Distribution transfers[static_cast<size_t>(Transfer::Count)];
+};
+
+static std::unique_ptr<Snapshot> takeSnapshot() {
+    auto snapshot = std::make_unique<Snapshot>();
+    std::lock_guard<std::mutex> lock(g_shardsMutex);
+    for (auto &shard : g_shards) {
+        for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i) {
+            snapshot->counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < static_cast<size_t>(Gauge::Count); ++i) {
+            snapshot->gauges[i] += static_cast<int64_t>(shard->gauges[i].load(std::memory_order_relaxed));
+        }
+        for (size_t i = 0; i < METRIC_COMMANDS; ++i) snapshot->commands[i].add(shard->commands[i]);
+        for (size_t i = 0; i < static_cast<size_t>(Transfer::Count); ++i) {
+            snapshot->transfers[i].add(shard->transfers[i]);
+        }
+    }
+    return snapshot;
+}
+
+struct MetricInfo {
+    const char *name;
+    const char *help;
+};
+
+static constexpr MetricInfo COUNTER_INFO[] = {
+        {"tcp_connections_accepted_total", "TCP connections accepted"},
+        {"tcp_connections_rejected_total", "TCP connections refused over --max-connections"},
+        {"tcp_connections_timed_out_total", "TCP connections closed by idle, read or write timeout"},
+        {"tcp_throttle_pauses_total", "Transfer pauses imposed by the bandwidth limits"},
+        {"tcp_received_bytes_total", "Bytes received on TCP connections"},
+        {"tcp_sent_bytes_total", "Bytes sent on TCP connections"},
+        {"udp_received_bytes_total", "Bytes of UDP datagrams received"},
+        {"udp_sent_bytes_total", "Bytes of UDP transfer packets sent"},
+        {"udp_retransmits_total", "UDP transfer packets sent again"},
+};
+static_assert(std::size(COUNTER_INFO) == static_cast<size_t>(Counter::Count));
+
+static constexpr MetricInfo GAUGE_INFO[] = {
+        {"tcp_connections", "Open TCP connections"},
+        {"udp_sessions", "UDP transfers in progress or lingering"},
+};
+static_assert(std::size(GAUGE_INFO) == static_cast<size_t>(Gauge::Count));
+
+static constexpr const char *TRANSFER_NAMES[] = {"tcp_download", "tcp_upload", "udp_download", "udp_upload"};
+static_assert(std::size(TRANSFER_NAMES) == static_cast<size_t>(Transfer::Count));
+
+static std::string_view commandName(size_t command) {
+    for (const CommandSpec &spec : COMMANDS) {
+        if (static_cast<size_t>(spec.id) == command) return spec.name;
+    }
+    return "UNKNOWN";
+}
+
+static void appendLine(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendLine(std::string &out, const char *format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (n > 0) out.append(line, std::min<size_t>(n, sizeof(line) - 1));
+}
+
+static void appendSources(std::string &out, bool prometheus) {
+    std::lock_guard<std::mutex> lock(g_sourcesMutex);
+    for (const MetricSourceEntry &source : g_sources) {
+        if (prometheus) {
+            appendLine(out, "# HELP tcp_server_%s %s\n# TYPE tcp_server_%s gauge\n", source.name.c_str(),
+                       source.help.c_str(), source.name.c_str());
+            appendLine(out, "tcp_server_%s %.17g\n", source.name.c_str(), source.read());
+        } else {
+            appendLine(out, "%s %.17g\n", source.name.c_str(), source.read());
+        }
+    }
+}
+
+// Счётчики, которые ведут сами подсистемы: кэш файлов и журнал
+static void appendSubsystemStats(std::string &out, bool prometheus) {
+    FileCache::Stats cache = fileCache().stats();
+    LogStats log = logStats();
+    Storage::Stats stored = storage().stats();
+    struct {
+        MetricInfo info;
+        const char *type;
+        uint64_t value;
+    } const values[] = {
+            {{"file_cache_hits_total", "Downloads served from the file cache"}, "counter", cache.hits},
+            {{"file_cache_misses_total", "Downloads that missed the file cache"}, "counter", cache.misses},
+            {{"file_cache_files", "Files in the file cache"}, "gauge", cache.entries},
+            {{"file_cache_bytes", "Bytes held by the file cache"}, "gauge", cache.bytes},
+            {{"storage_files", "Files in the storage index"}, "gauge", stored.files},
+            {{"storage_bytes", "Bytes of the files in the storage index"}, "gauge", stored.bytes},
+            {{"storage_pending_uploads", "Unfinished uploads the server keeps track of"}, "gauge", stored.uploads},
+            {{"log_lines_total", "Log lines written"}, "counter", log.written},
+            {{"log_dropped_total", "Log lines dropped because a thread's ring was full"}, "counter", log.dropped},
+            {{"log_suppressed_total", "Log lines skipped by the per-site rate limit"}, "counter", log.suppressed},
+    };
+    for (auto &[info, type, value] : values) {
+        if (prometheus) {
+            appendLine(out, "# HELP tcp_server_%s %s\n# TYPE tcp_server_%s %s\n", info.name, info.help, info.name,
+                       type);
+            appendLine(out, "tcp_server_%s %" PRIu64 "\n", info.name, value);
+        } else {
+            appendLine(out, "%s %" PRIu64 "\n", info.name, value);
+        }
+    }
+}
+
+std::string renderStats() {
+    auto snapshot = takeSnapshot();
+    std::string out;
+    appendLine(out, "uptime_seconds %" PRIu64 "\n",
+               static_cast<uint64_t>(microsSince(g_started) / 1000000));
+    for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i) {
+        appendLine(out, "%s %" PRIu64 "\n", COUNTER_INFO[i].name, snapshot->counters[i]);
+    }
+    for (size_t i = 0; i < static_cast<size_t>(Gauge::Count); ++i) {
+        appendLine(out, "%s %" PRId64 "\n", GAUGE_INFO[i].name, snapshot->gauges[i]);
+    }
+    appendSubsystemStats(out, false);
+    appendSources(out, false);
+
+    auto appendDistribution = [&out](const char *kind, std::string_view name, const Snapshot::Distribution &d) {
+        if (d.total == 0) return;
+        appendLine(out, "%s %.*s count=%" PRIu64 " p50_us=%" PRIu64 " p99_us=%" PRIu64 " p999_us=%" PRIu64
+                        " max_us=%" PRIu64 "\n",
+                   kind, static_cast<int>(name.size()), name.data(), d.total, d.quantile(0.5), d.quantile(0.99),
+                   d.quantile(0.999), d.max);
+    };
+    for (size_t i = 0; i < METRIC_COMMANDS; ++i) appendDistribution("command", commandName(i), snapshot->commands[i]);
+    for (size_t i = 0; i < static_cast<size_t>(Transfer::Count); ++i) {
+        appendDistribution("transfer", TRANSFER_NAMES[i], snapshot->transfers[i]);
+    }
+    out.append("END\n");
+    return out;
+}
+
+// Границы корзин гистограмм в формате Prometheus, секунды
+static constexpr double COMMAND_BUCKETS[] = {0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1};
+static constexpr double TRANSFER_BUCKETS[] = {0.001, 0.01, 0.1, 0.5, 1, 5, 10, 30, 60, 300};
+
+template<size_t N>
+static void appendHistogram(std::string &out, const char *name, const char *labelName, std::string_view label,
+                            const Snapshot::Distribution &d, const double (&bounds)[N]) {
+    for (double bound : bounds) {
+        appendLine(out, "tcp_server_%s_bucket{%s=\"%.*s\",le=\"%g\"} %" PRIu64 "\n", name, labelName,
+                   static_cast<int>(label.size()), label.data(), bound,
+                   d.countUpTo(static_cast<uint64_t>(bound * 1e6)));
+    }
+    appendLine(out, "tcp_server_%s_bucket{%s=\"%.*s\",le=\"+Inf\"} %" PRIu64 "\n", name, labelName,
+               static_cast<int>(label.size()), label.data(), d.total);
+    appendLine(out, "tcp_server_%s_sum{%s=\"%.*s\"} %.6f\n", name, labelName, static_cast<int>(label.size()),
+               label.data(), d.sum / 1e6);
+    appendLine(out, "tcp_server_%s_count{%s=\"%.*s\"} %" PRIu64 "\n", name, labelName,
+               static_cast<int>(label.size()), label.data(), d.total);
+}
+
+std::string renderPrometheus() {
+    auto snapshot = takeSnapshot();
+    std::string out;
+    for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i) {
+        appendLine(out, "# HELP tcp_server_%s %s\n# TYPE tcp_server_%s counter\n", COUNTER_INFO[i].name,
+                   COUNTER_INFO[i].help, COUNTER_INFO[i].name);
+        appendLine(out, "tcp_server_%s %" PRIu64 "\n", COUNTER_INFO[i].name, snapshot->counters[i]);
+    }
+    for (size_t i = 0; i < static_cast<size_t>(Gauge::Count); ++i) {
+        appendLine(out, "# HELP tcp_server_%s %s\n# TYPE tcp_server_%s gauge\n", GAUGE_INFO[i].name,
+                   GAUGE_INFO[i].help, GAUGE_INFO[i].name);
+        appendLine(out, "tcp_server_%s %" PRId64 "\n", GAUGE_INFO[i].name, snapshot->gauges[i]);
+    }
+    appendSubsystemStats(out, true);
+    appendSources(out, true);
+
+    out.append("# HELP tcp_server_command_duration_seconds Time a reactor spent handling a command\n"
+               "# TYPE tcp_server_command_duration_seconds histogram\n");
+    for (size_t i = 0; i < METRIC_COMMANDS; ++i) {
+        appendHistogram(out, "command_duration_seconds", "command", commandName(i), snapshot->commands[i],
+                        COMMAND_BUCKETS);
+    }
+    out.append("# HELP tcp_server_transfer_duration_seconds Duration of completed file transfers\n"
+               "# TYPE tcp_server_transfer_duration_seconds histogram\n");
+    for (size_t i = 0; i < static_cast<size_t>(Transfer::Count); ++i) {
+        appendHistogram(out, "transfer_duration_seconds", "transfer", TRANSFER_NAMES[i], snapshot->transfers[i],
+                        TRANSFER_BUCKETS);
+    }
+    return out;
+}
+
+// Один запрос на соединение: GET /metrics (или /) - метрики, остальное - 404
+static void serveMetricsClient(int client) {
+    timeval timeout{1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[2048];
+    size_t size = 0;
+    while (size < sizeof(request) - 1) {
+        ssize_t rc = recv(client, request + size, sizeof(request) - 1 - size, 0);
+        if (rc <= 0) break;
+        size += rc;
+        request[size] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    request[size] = '\0';
+
+    std::string_view line(request, size);
+    line = line.substr(0, line.find_first_of("\r\n"));
+    bool found = line.rfind("GET /metrics ", 0) == 0 || line.rfind("GET / ", 0) == 0;
+    std::string body = found ? renderPrometheus() : "not found\n";
+    std::string response = found ? "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 : "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+    response += body;
+    for (size_t sent = 0; sent < response.size();) {
+        ssize_t rc = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (rc <= 0) break;
+        sent += rc;
+    }
+}
+
+// Свой сокет на 127.0.0.1 или полученный от предшественника при горячем перезапуске
+static SOCKET openMetricsListener() {
+    if (inheritedListeners(ListenerKind::Metrics) > 0) return inheritedListener(ListenerKind::Metrics, 0);
+    SOCKET sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);   // только локально: метрики не для внешнего мира
+    addr.sin_port = htons(static_cast<uint16_t>(g_config.metricsPort));
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (sock == INVALID_SOCKET || bind(sock, (sockaddr *) &addr, sizeof(addr)) == -1 || listen(sock, 16) == -1) {
+        LOG_ERROR("metrics", "listen_failed", "port=%d error=\"%s\"", g_config.metricsPort, strerror(errno));
+        if (sock != INVALID_SOCKET) close(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+void runMetricsServer() {
+    if (g_config.metricsPort <= 0) {
+        if (inheritedListeners(ListenerKind::Metrics) > 0) close(inheritedListener(ListenerKind::Metrics, 0));
+        return;
+    }
+    SOCKET sock = openMetricsListener();
+    if (sock == INVALID_SOCKET) return;
+    publishListener(ListenerKind::Metrics, sock);
+    LOG_INFO("metrics", "listening", "url=http://127.0.0.1:%d/metrics inherited=%zu", g_config.metricsPort,
+             inheritedListeners(ListenerKind::Metrics));
+
+    // Опрос раз в полсекунды, чтобы заметить g_shutdown. Отдав сокет преемнику, процесс
+    // перестаёт отвечать: метрики дальше показывает новый процесс
+    while (!g_shutdown && !listenersHandedOff()) {
+        pollfd pfd{sock, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) continue;
+        int client = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) continue;
+        serveMetricsClient(client);
+        close(client);
+    }
+    close(sock);
+}
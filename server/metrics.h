@@ -0,0 +1,104 @@
+#ifndef TCP_SERVER_METRICS_H
+#define TCP_SERVER_METRICS_H
+
+#include "protocol.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// Счётчики сервера. Каждый поток пишет в свой шард (один писатель - без блокировок
+// и без lock-префикса), чтение складывает шарды всех потоков: STATS и HTTP-порт метрик.
+enum class Counter {
+    TcpAccepted,
+    TcpRejected,
+    TcpTimeouts,
+    TcpThrottled,
+    TcpBytesIn,
+    TcpBytesOut,
+    UdpBytesIn,
+    UdpBytesOut,
+    UdpRetransmits,
+    Count
+};
+
+// Величины, которые растут и убывают; складываются так же, как счётчики
+enum class Gauge {
+    TcpConnections,
+    UdpSessions,
+    Count
+};
+
+// Команды TCP-протокола по типам, включая Unknown
+constexpr size_t METRIC_COMMANDS = static_cast<size_t>(CommandId::Unknown) + 1;
+
+enum class Transfer {
+    TcpDownload,
+    TcpUpload,
+    UdpDownload,
+    UdpUpload,
+    Count
+};
+
+// Лог-линейная гистограмма в духе HDR: по 8 корзин на каждую степень двойки, то есть
+// ошибка квантиля не больше 1/8 значения на всём диапазоне. Пишет только поток-владелец.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = (41 - SUB_BITS) * SUB_COUNT;   // значения до 2^40 (мкс - 12 суток)
+
+    static size_t bucketOf(uint64_t value);
+    // Наибольшее значение, попадающее в корзину
+    static uint64_t upperBound(size_t bucket);
+
+    void record(uint64_t value) {
+        bump(counts[bucketOf(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+        if (value > max.load(std::memory_order_relaxed)) max.store(value, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> counts[BUCKETS]{};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+
+private:
+    static void bump(std::atomic<uint64_t> &value, uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+void countMetric(Counter counter, uint64_t n = 1);
+void gaugeMetric(Gauge gauge, int64_t delta);
+// Время обработки команды в реакторе, микросекунды
+void recordCommand(CommandId command, uint64_t micros);
+// Длительность завершённой передачи, микросекунды
+void recordTransfer(Transfer transfer, uint64_t micros);
+
+inline uint64_t microsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Значение, которое снимается при чтении метрик (очередь пула, кэш). Регистрация живёт,
+// пока жив объект: деструктор ждёт идущего чтения, так что источник можно удалять следом.
+class MetricSource {
+public:
+    MetricSource(std::string name, std::string help, std::function<double()> read);
+    ~MetricSource();
+    MetricSource(const MetricSource &) = delete;
+    MetricSource &operator=(const MetricSource &) = delete;
+};
+
+// Сводка для команды STATS: по строке на метрику, квантили гистограмм, в конце "END"
+std::string renderStats();
+// Текстовый формат Prometheus для GET /metrics
+std::string renderPrometheus();
+
+// HTTP-порт метрик на 127.0.0.1:g_config.metricsPort, пока не выставлен g_shutdown
+void runMetricsServer();
+
+#endif//TCP_SERVER_METRICS_H
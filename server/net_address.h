@@ -0,0 +1,69 @@
+#ifndef TCP_SERVER_NET_ADDRESS_H
+#define TCP_SERVER_NET_ADDRESS_H
+
+#include "../libs.h"
+#include <netinet/in.h>
+
+// Адрес сокета IPv4 или IPv6. На сокете dual-stack ("::") клиенты IPv4 приходят
+// как IPv6, отображённые из IPv4 (::ffff:a.b.c.d); печатаются они как IPv4.
+struct NetAddress {
+    union {
+        sockaddr sa;
+        sockaddr_in v4;
+        sockaddr_in6 v6{};   // самый длинный: обнуляет весь адрес
+    };
+
+    NetAddress() = default;
+    NetAddress(const sockaddr_in &addr) : NetAddress() { v4 = addr; }
+
+    int family() const { return sa.sa_family; }
+    socklen_t length() const { return family() == AF_INET6 ? sizeof(v6) : sizeof(v4); }
+    uint16_t port() const { return ntohs(family() == AF_INET6 ? v6.sin6_port : v4.sin_port); }
+
+    bool mappedV4() const { return family() == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&v6.sin6_addr); }
+
+    // IPv4 - своим адресом, отображённый тоже; чистый IPv6 - false
+    bool ipv4(in_addr &out) const {
+        if (family() == AF_INET) {
+            out = v4.sin_addr;
+            return true;
+        }
+        if (!mappedV4()) return false;
+        memcpy(&out, v6.sin6_addr.s6_addr + 12, sizeof(out));
+        return true;
+    }
+
+    // Адрес без порта для журнала
+    const char *host(char (&buffer)[INET6_ADDRSTRLEN]) const {
+        in_addr addr4;
+        if (ipv4(addr4)) return inet_ntop(AF_INET, &addr4, buffer, sizeof(buffer));
+        return inet_ntop(AF_INET6, &v6.sin6_addr, buffer, sizeof(buffer));
+    }
+
+    bool operator==(const NetAddress &other) const {
+        if (family() != other.family()) return false;
+        if (family() == AF_INET6) {
+            return v6.sin6_port == other.v6.sin6_port &&
+                   memcmp(&v6.sin6_addr, &other.v6.sin6_addr, sizeof(v6.sin6_addr)) == 0;
+        }
+        return v4.sin_port == other.v4.sin_port && v4.sin_addr.s_addr == other.v4.sin_addr.s_addr;
+    }
+
+    // Числовой адрес ("0.0.0.0", "::", "192.168.1.5", "2001:db8::1") и порт
+    static bool parse(const std::string &host, uint16_t port, NetAddress &out) {
+        out = NetAddress();
+        if (inet_pton(AF_INET, host.c_str(), &out.v4.sin_addr) == 1) {
+            out.v4.sin_family = AF_INET;
+            out.v4.sin_port = htons(port);
+            return true;
+        }
+        if (inet_pton(AF_INET6, host.c_str(), &out.v6.sin6_addr) == 1) {
+            out.v6.sin6_family = AF_INET6;
+            out.v6.sin6_port = htons(port);
+            return true;
+        }
+        return false;
+    }
+};
+
+#endif//TCP_SERVER_NET_ADDRESS_H
@@ -0,0 +1,117 @@
+#ifndef TCP_SERVER_PROTOCOL_H
+#define TCP_SERVER_PROTOCOL_H
+
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+
+// Команды строкового TCP-протокола. Разбор работает на string_view поверх
+// буфера сессии и ничего не выделяет в куче.
+enum class CommandId { Echo, Time, Upload, Download, Hash, List, Stats, Quit, Unknown };
+
+// Есть ли у команды аргументы после имени. Optional - проверяет обработчик,
+// чтобы ответить своей ошибкой, а не "Unknown command"
+enum class CommandArgs { None, Optional, Required };
+
+struct CommandSpec {
+    std::string_view name;
+    CommandId id;
+    CommandArgs args;
+};
+
+constexpr CommandSpec COMMANDS[] = {
+        {"ECHO", CommandId::Echo, CommandArgs::Required},
+        {"TIME", CommandId::Time, CommandArgs::None},
+        {"UPLOAD", CommandId::Upload, CommandArgs::Optional},
+        {"DOWNLOAD", CommandId::Download, CommandArgs::Optional},
+        {"HASH", CommandId::Hash, CommandArgs::Optional},
+        {"LIST", CommandId::List, CommandArgs::Optional},
+        {"STATS", CommandId::Stats, CommandArgs::None},
+        {"CLOSE", CommandId::Quit, CommandArgs::None},
+        {"EXIT", CommandId::Quit, CommandArgs::None},
+        {"QUIT", CommandId::Quit, CommandArgs::None},
+};
+
+constexpr const CommandSpec *findCommand(std::string_view name) {
+    for (const CommandSpec &spec : COMMANDS) {
+        if (spec.name == name) return &spec;
+    }
+    return nullptr;
+}
+
+static_assert(findCommand("TIME")->id == CommandId::Time);
+static_assert(findCommand("time") == nullptr);
+
+struct ParsedCommand {
+    CommandId id = CommandId::Unknown;
+    std::string_view args;   // всё после первого пробела, как есть
+};
+
+// Строка без '\n' (и без '\r' в конце) -> команда и её аргументы
+constexpr ParsedCommand parseCommand(std::string_view line) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    size_t space = line.find(' ');
+    std::string_view name = line.substr(0, space);
+    const CommandSpec *spec = findCommand(name);
+    if (!spec) return {};
+
+    bool hasArgs = space != std::string_view::npos;
+    if (spec->args == CommandArgs::None && hasArgs) return {};
+    if (spec->args == CommandArgs::Required && !hasArgs) return {};
+    return {spec->id, hasArgs ? line.substr(space + 1) : std::string_view{}};
+}
+
+static_assert(parseCommand("ECHO  hi\r").args == " hi");
+static_assert(parseCommand("TIME x").id == CommandId::Unknown);
+
+// Следующее слово из args (разделители - пробелы), args сдвигается за него
+constexpr std::string_view nextToken(std::string_view &args) {
+    size_t start = args.find_first_not_of(' ');
+    if (start == std::string_view::npos) {
+        args = {};
+        return {};
+    }
+    args.remove_prefix(start);
+    size_t end = args.find(' ');
+    std::string_view token = args.substr(0, end);
+    args.remove_prefix(end == std::string_view::npos ? args.size() : end);
+    return token;
+}
+
+// Отрезает необязательный последний аргумент-флаг (например, "LZ4"); true - он был
+constexpr bool takeFlag(std::string_view &args, std::string_view flag) {
+    std::string_view rest = args.substr(0, args.find_last_not_of(' ') + 1);
+    if (rest.size() < flag.size() || rest.substr(rest.size() - flag.size()) != flag) return false;
+    rest.remove_suffix(flag.size());
+    if (!rest.empty() && rest.back() != ' ') return false;
+    args = rest;
+    return true;
+}
+
+static_assert([] {
+    std::string_view args = "f.log 0 10 LZ4 ";
+    return takeFlag(args, "LZ4") && args == "f.log 0 10 ";
+}());
+static_assert([] {
+    std::string_view args = "data.LZ4";
+    return !takeFlag(args, "LZ4");
+}());
+
+template<class T>
+bool parseNumber(std::string_view token, T &value) {
+    auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+    return ec == std::errc() && end == token.data() + token.size();
+}
+
+// Текущее время в формате ctime без '\n', в буфер вызывающего
+inline std::string_view formatTime(char (&buffer)[32]) {
+    time_t now = time(nullptr);
+    if (!ctime_r(&now, buffer)) return {};
+    std::string_view text(buffer);
+    if (!text.empty() && text.back() == '\n') text.remove_suffix(1);
+    return text;
+}
+
+#endif//TCP_SERVER_PROTOCOL_H
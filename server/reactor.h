@@ -0,0 +1,89 @@
+#ifndef TCP_SERVER_REACTOR_H
+#define TCP_SERVER_REACTOR_H
+
+#include "../libs.h"
+#include "session.h"
+#include "timer_wheel.h"
+
+struct UringReactor;
+
+// Реактор владеет своим epoll (или io_uring), своим слушающим сокетом и своими соединениями целиком
+struct Reactor {
+    int id = 0;
+    int epfd = -1;
+    SOCKET listenSocket = INVALID_SOCKET;
+    bool ownsListenSocket = true;
+    SessionPool sessions;
+
+    // Один большой буфер приёма на реактор (--recv-buffer), переиспользуется всеми соединениями
+    std::vector<char> recvBuffer;
+
+    // Блокирующие дисковые операции (fsync) уходят в пул, результат
+    // возвращается в реактор через mailbox + eventfd
+    ThreadPool *diskPool = nullptr;
+    int eventFd = -1;
+    std::mutex mailboxMutex;
+    std::vector<Task> mailbox;
+
+    // Не nullptr - реактор работает на io_uring, epfd не используется, mailbox читает SQE
+    UringReactor *uring = nullptr;
+
+    // Часы реактора: читаются раз за итерацию цикла, им следуют таймауты и ограничители полосы
+    int64_t nowNs = 0;
+    uint64_t nowMs = 0;
+    TimerWheel timers;   // тик - TIMER_TICK_MS
+
+    // Мягкая остановка: приём снят, соединения закрываются по мере простоя
+    bool draining = false;
+    uint64_t drainCheckAt = 0;
+};
+
+// Ответы, ещё не ушедшие в сокет (у io_uring часть из них - в io.sending)
+inline size_t pendingOutput(const Session &conn) {
+    return conn.outBuf.size() - conn.outOffset + conn.io.sending.size() - conn.io.sendOffset;
+}
+
+// Общая для обоих движков обработка протокола (tcp.cpp)
+void sendMessage(Session &conn, std::string_view message);
+void sendUploadResult(Session &conn, bool synced);
+void processInput(Session &conn);
+// Кусок UPLOAD принят и записан: отмечается в хранилище, дальше fsync своим движком
+void finishUpload(Session &conn);
+// Соединение закрывается посреди UPLOAD: записанное подряд до writtenEnd засчитывается докачке
+void abandonUpload(Session &conn, off_t writtenEnd);
+void finishDownload(Session &conn);
+// Следующий блок сжатой отдачи - кадром в outBuf; false - файл не прочитался
+bool appendDownloadFrame(Session &conn);
+void pinCurrentThread(int cpu);
+// CPU реактора: по списку --cpus, иначе по номеру
+int reactorCpu(int id);
+
+// Задача из пула, которую выполнит поток реактора
+void postToReactor(Reactor &reactor, Task task);
+void runMailboxTasks(Reactor &reactor);
+
+// Допуск соединений, таймауты и полоса (tcp.cpp), общие для обоих движков.
+// Сверх --max-connections клиент получает отказ; false - fd закрывает вызывающий.
+bool admitConnection(int fd);
+void releaseConnection();
+// Новое соединение: ограничитель полосы и таймер простоя
+void startSessionTimers(Session &conn);
+// Перевзводит таймер под таймаут текущего состояния (после смены состояния)
+void armSessionTimer(Session &conn);
+// Сколько байт передачи можно пропустить сейчас; 0 - соединение встало на паузу до таймера
+size_t bandwidthFor(Session &conn, size_t want);
+void chargeBandwidth(Session &conn, size_t bytes);
+void updateReactorClock(Reactor &reactor);
+// Срабатывания таймеров: истёкшие соединения закрываются, паузы полосы продолжаются
+void runTimers(Reactor &reactor);
+// Сколько можно ждать событий, не пропустив таймер, мс (не больше limit)
+int timerWaitMs(const Reactor &reactor, int limit);
+// Мягкая остановка, общая для обоих движков: beginDrain - после того как движок снял приём;
+// drainReactor закрывает простаивающие соединения и возвращает false, когда реактору пора
+// выходить: соединений не осталось или вышел --drain-timeout
+void beginDrain(Reactor &reactor);
+bool drainReactor(Reactor &reactor, void (*closeSession)(Reactor &, Session &));
+// Порог очереди ответов, выше которого команды соединения не читаются (--output-high-water)
+size_t outputHighWater();
+
+#endif//TCP_SERVER_REACTOR_H
@@ -0,0 +1,297 @@
+#ifndef TCP_SERVER_SESSION_H
+#define TCP_SERVER_SESSION_H
+
+#include "file_cache.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Предел буфера входящих данных сессии: строка команды длиннее - ошибка,
+// а пока идёт передача, чтение сокета приостанавливается на этом уровне
+constexpr size_t SESSION_INPUT_LIMIT = 64 * 1024;
+// Ёмкость, которую сохраняет переиспользуемая сессия; больше - освобождается
+constexpr size_t SESSION_RETAINED_CAPACITY = 4 * 1024;
+
+// Буфер входящих байт сессии: recv пишет в хвост, разбор идёт с головы.
+// Строка команды всегда лежит непрерывно, поэтому отдаётся как string_view;
+// когда хвост упирается в конец, недоразобранный остаток сдвигается в начало.
+// Память выделяется при первом чтении и переживает переиспользование сессии.
+class InputBuffer {
+    std::unique_ptr<char[]> bytes;
+    size_t cap = 0;
+    size_t head = 0;
+    size_t tail = 0;
+
+public:
+    size_t size() const { return tail - head; }
+    bool empty() const { return head == tail; }
+    size_t capacity() const { return cap; }
+    const char *data() const { return bytes.get() + head; }
+    std::string_view view() const { return {data(), size()}; }
+
+    void consume(size_t n) {
+        head += n;
+        if (head == tail) head = tail = 0;
+    }
+
+    // Свободное место для recv, не больше limit - size() байт. Буфер растёт
+    // (удваиваясь, до limit), только если после сдвига он заполнен больше чем наполовину.
+    size_t prepare(size_t limit, char *&out) {
+        if (!bytes) {
+            cap = std::min(SESSION_RETAINED_CAPACITY, limit);
+            bytes.reset(new char[cap]);
+        }
+        if (tail == cap) {
+            if (head > 0) {
+                memmove(bytes.get(), bytes.get() + head, size());
+                tail -= head;
+                head = 0;
+            }
+            if (tail > cap / 2 && cap < limit) {
+                size_t grown = std::min(cap * 2, limit);
+                std::unique_ptr<char[]> larger(new char[grown]);
+                memcpy(larger.get(), bytes.get(), tail);
+                bytes = std::move(larger);
+                cap = grown;
+            }
+        }
+        out = bytes.get() + tail;
+        return std::min(cap - tail, limit - size());
+    }
+
+    void commit(size_t n) { tail += n; }
+
+    // Пустой буфер; память больше retained отдаётся
+    void reset(size_t retained) {
+        head = tail = 0;
+        if (cap > retained) {
+            bytes.reset();
+            cap = 0;
+        }
+    }
+};
+
+// Состояние соединения: разбор команд, приём файла, fsync принятого файла, отдача файла
+// или подсчёт HASH в пуле
+enum class ConnState { Command, Upload, Syncing, Download, Hashing };
+
+struct Reactor;
+
+// Чанк передачи файла в io_uring-реакторе: принятые из сокета байты ждут записи
+// в файл, прочитанные из файла - отправки в сокет
+enum class ChunkState : uint8_t { Free, Receiving, Writing, Reading, Ready, Sending };
+
+struct TransferChunk {
+    ChunkState state = ChunkState::Free;
+    char *data = nullptr;
+    int bufferIndex = -1;   // зарегистрированный буфер реактора; -1 - память из heap
+    std::unique_ptr<char[]> heap;   // когда зарегистрированных буферов не хватило
+    uint32_t length = 0;    // байт в чанке
+    uint32_t done = 0;      // сколько из них уже записано/прочитано/отправлено
+    off_t offset = 0;       // где чанк лежит в файле
+    uint64_t order = 0;     // номер чанка при отдаче: в сокет они уходят строго по порядку
+};
+
+// Состояние соединения, нужное только io_uring-движку (см. uring.cpp)
+struct UringIo {
+    int socketSlot = -1;    // индексы в таблице fixed files; -1 - обычный fd
+    int fileSlot = -1;
+    unsigned inflight = 0;  // SQE, чьи CQE ещё не пришли: пока они есть, слот не освобождается
+    bool recvPending = false;
+    bool sendPending = false;
+    bool aborting = false;
+    int syncFd = -1;        // принятый файл, для которого идёт fsync
+
+    // Ответы копятся в outBuf, пока предыдущая порция уходит из sending
+    std::string sending;
+    size_t sendOffset = 0;
+
+    TransferChunk chunks[2];
+    off_t readOffset = 0;   // следующий кусок файла для чтения при отдаче
+    long readRemaining = 0;
+    bool transferStarted = false;   // файл передачи уже подготовлен движком
+    uint64_t nextOrder = 0;
+    uint64_t sendOrder = 0;
+
+    void reset() {
+        if (syncFd != -1) close(syncFd);
+        syncFd = -1;
+        socketSlot = fileSlot = -1;
+        inflight = 0;
+        recvPending = sendPending = aborting = false;
+        sending.clear();
+        if (sending.capacity() > SESSION_RETAINED_CAPACITY) sending.shrink_to_fit();
+        sendOffset = 0;
+        for (TransferChunk &chunk : chunks) chunk = TransferChunk{};
+        readOffset = readRemaining = 0;
+        transferStarted = false;
+        nextOrder = sendOrder = 0;
+    }
+};
+
+// Всё состояние одного TCP-соединения. Живёт в слабе SessionPool своего реактора,
+// указатель на неё лежит прямо в epoll_event.data.ptr - без поиска по fd.
+struct Session {
+    int fd = -1;
+    uint64_t serial = 0;   // меняется при каждом переиспользовании слота
+    Reactor *reactor = nullptr;
+    ConnState state = ConnState::Command;
+    InputBuffer inBuf;   // принятые, но ещё не разобранные байты
+    std::string outBuf;  // ответы, ожидающие отправки; ёмкость сохраняется между ответами
+    size_t outOffset = 0;
+    bool closing = false;
+    bool readPaused = false;
+
+    int uploadFd = -1;
+    off_t uploadOffset = 0;
+    long uploadRemaining = 0;
+    uint32_t uploadCrc = 0;   // CRC32C принятых в этой передаче байт
+    bool uploadCompressed = false;   // тело приходит кадрами LZ4 через inBuf
+    std::string uploadName;   // имя в хранилище; пишется его .part
+    off_t uploadStart = 0;    // начало куска, который пишет соединение
+    bool uploadWholeCrc = false;   // принят весь файл с нуля: uploadCrc - CRC всего файла
+    bool uploadCommit = false;     // соединение собрало файл: после fsync переименовать его на место
+
+    int downloadFd = -1;
+    CachedFileRef downloadFile;   // файл из кэша: отдаётся из памяти, downloadFd не открыт
+    off_t downloadOffset = 0;
+    long downloadRemaining = 0;
+    long downloadSent = 0;
+    bool downloadCompressed = false;   // отдача кадрами LZ4 через outBuf
+    std::chrono::steady_clock::time_point transferStart;
+
+    // Таймаут текущего состояния или конец паузы ограничителя полосы - в колесе реактора
+    TimerNode timer;
+    uint64_t lastActivity = 0;   // мс часов реактора: последнее событие соединения
+    bool throttled = false;      // передача ждёт полосу, продолжит таймер
+    TokenBucket bandwidth;
+
+    // epoll: тело UPLOAD/DOWNLOAD ведёт корутина (см. tcp.cpp). Ждёт она события сокета
+    // в transferWaiter; закрытие соединения разрушает её кадр вместе с сессией.
+    bool transferActive = false;
+    bool broken = false;   // сокет или файл отказал посреди передачи: закрыть, ничего не досылая
+    uint32_t transferEvents = 0;
+    std::coroutine_handle<> transferWaiter;
+
+    UringIo io;
+
+    bool inUse = false;
+    Session *nextFree = nullptr;
+
+    // Закрывает файлы передачи и возвращает сессию в исходное состояние,
+    // сохраняя небольшие буферы для следующего соединения
+    void reset() {
+        if (uploadFd != -1) close(uploadFd);
+        if (downloadFd != -1) close(downloadFd);
+        uploadFd = downloadFd = -1;
+        downloadFile.reset();
+        fd = -1;
+        state = ConnState::Command;
+        inBuf.reset(SESSION_RETAINED_CAPACITY);
+        outBuf.clear();
+        if (outBuf.capacity() > SESSION_RETAINED_CAPACITY) outBuf.shrink_to_fit();
+        outOffset = 0;
+        closing = false;
+        readPaused = false;
+        uploadOffset = uploadRemaining = 0;
+        uploadCrc = 0;
+        uploadCompressed = downloadCompressed = false;
+        uploadName.clear();
+        uploadStart = 0;
+        uploadWholeCrc = uploadCommit = false;
+        downloadOffset = downloadRemaining = downloadSent = 0;
+        lastActivity = 0;
+        throttled = false;
+        dropTransfer();
+        broken = false;
+        io.reset();
+    }
+
+    // Разрушает кадр ждущей корутины передачи; она снимает transferActive сама
+    void dropTransfer() {
+        if (transferWaiter) std::exchange(transferWaiter, nullptr).destroy();
+        transferEvents = 0;
+    }
+
+    ~Session() {
+        dropTransfer();
+        if (uploadFd != -1) close(uploadFd);
+        if (downloadFd != -1) close(downloadFd);
+        if (io.syncFd != -1) close(io.syncFd);
+    }
+};
+
+// Слабовый пул сессий одного реактора. Без блокировок: им пользуется только поток реактора.
+// Слоты никогда не освобождаются до остановки реактора, поэтому указатель на сессию
+// остаётся валидным, а устаревшие ссылки распознаются по serial.
+class SessionPool {
+    static constexpr size_t SLAB_SESSIONS = 64;
+
+    std::vector<std::unique_ptr<Session[]>> slabs;
+    Session *freeList = nullptr;
+    uint64_t nextSerial = 0;
+    size_t live = 0;
+
+public:
+    Session *acquire() {
+        if (!freeList) grow();
+        Session *session = freeList;
+        freeList = session->nextFree;
+        session->nextFree = nullptr;
+        session->inUse = true;
+        session->serial = ++nextSerial;
+        ++live;
+        return session;
+    }
+
+    void release(Session *session) {
+        session->reset();
+        session->inUse = false;
+        session->nextFree = freeList;
+        freeList = session;
+        --live;
+    }
+
+    template<class F>
+    void forEachLive(F &&f) {
+        for (auto &slab : slabs)
+            for (size_t i = 0; i < SLAB_SESSIONS; ++i)
+                if (slab[i].inUse) f(slab[i]);
+    }
+
+    size_t liveSessions() const { return live; }
+    size_t capacity() const { return slabs.size() * SLAB_SESSIONS; }
+
+    // Память под слабы плюс буферы живых и свободных сессий
+    size_t bytesReserved() const {
+        size_t bytes = capacity() * sizeof(Session);
+        for (auto &slab : slabs)
+            for (size_t i = 0; i < SLAB_SESSIONS; ++i)
+                bytes += slab[i].inBuf.capacity() + slab[i].outBuf.capacity();
+        return bytes;
+    }
+
+private:
+    void grow() {
+        slabs.emplace_back(new Session[SLAB_SESSIONS]);
+        Session *slab = slabs.back().get();
+        for (size_t i = SLAB_SESSIONS; i-- > 0;) {
+            slab[i].nextFree = freeList;
+            freeList = &slab[i];
+        }
+    }
+};
+
+#endif//TCP_SERVER_SESSION_H
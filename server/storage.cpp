@@ -0,0 +1,479 @@
+#include "storage.h"
+#include "../libs.h"
+#include "crc32c.h"
+#include "file_cache.h"
+#include "logger.h"
+#include <cerrno>
+#include <cinttypes>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+
+static_assert((STORAGE_SHARDS & (STORAGE_SHARDS - 1)) == 0, "shard is taken from the low bits of the hash");
+
+// '.' в начале и ".part" в конце имени временного файла
+constexpr size_t PART_EXTRA = 1 + 5;
+// Потоков, обходящих шарды при старте: больше диск всё равно не отдаст
+constexpr size_t STORAGE_SCAN_THREADS = 16;
+
+// CRC хранится вместе с версией файла, для которой посчитан: правка файла меняет mtime,
+// а fsetxattr меняет только ctime
+constexpr const char *CRC_ATTRIBUTE = "user.crc32c";
+struct CrcAttribute {
+    uint32_t crc;
+    uint32_t reserved;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+};
+
+// Записанное подряд от начала .part, пока его пишут кусками не по порядку: размер .part
+// тогда включает дыры. Без атрибута докачка продолжается с размера .part.
+constexpr const char *UPLOAD_ATTRIBUTE = "user.upload";
+struct UploadAttribute {
+    uint64_t size;
+    uint64_t written;
+};
+
+static StoredFile describe(const struct stat &st) {
+    StoredFile file;
+    file.size = static_cast<uint64_t>(st.st_size);
+    file.mtime = st.st_mtim;
+    return file;
+}
+
+static bool sameVersion(const StoredFile &file, const struct stat &st) {
+    return file.size == static_cast<uint64_t>(st.st_size) && file.mtime.tv_sec == st.st_mtim.tv_sec &&
+           file.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+static void readCrcAttribute(const char *path, StoredFile &file) {
+    CrcAttribute attr{};
+    if (getxattr(path, CRC_ATTRIBUTE, &attr, sizeof(attr)) != sizeof(attr)) return;
+    if (attr.size != file.size || attr.mtimeSec != file.mtime.tv_sec || attr.mtimeNsec != file.mtime.tv_nsec) return;
+    file.crc = attr.crc;
+    file.crcKnown = true;
+}
+
+// Файловая система без user xattr - CRC просто посчитается заново после перезапуска
+static void writeCrcAttribute(int fd, const StoredFile &file) {
+    CrcAttribute attr{file.crc, 0, file.size, file.mtime.tv_sec, file.mtime.tv_nsec};
+    fsetxattr(fd, CRC_ATTRIBUTE, &attr, sizeof(attr), 0);
+}
+
+bool Storage::validName(std::string_view name) {
+    if (name.empty() || name.front() == '.' || name.size() > NAME_MAX - PART_EXTRA) return false;
+    return std::none_of(name.begin(), name.end(),
+                        [](char c) { return c == '/' || static_cast<unsigned char>(c) < 0x20; });
+}
+
+size_t Storage::shardOf(std::string_view name) {
+    return crc32c(0, name.data(), name.size()) & (STORAGE_SHARDS - 1);
+}
+
+bool Storage::buildPath(std::string_view name, bool part, char (&path)[PATH_MAX]) const {
+    if (!validName(name)) return false;
+    int length = snprintf(path, sizeof(path), "%s/%02zx/%s%.*s%s", root.c_str(), shardOf(name), part ? "." : "",
+                          static_cast<int>(name.size()), name.data(), part ? ".part" : "");
+    return length > 0 && static_cast<size_t>(length) < sizeof(path);
+}
+
+bool Storage::filePath(std::string_view name, char (&path)[PATH_MAX]) const {
+    return buildPath(name, false, path);
+}
+
+bool Storage::partPath(std::string_view name, char (&path)[PATH_MAX]) const {
+    return buildPath(name, true, path);
+}
+
+// Файлы прежней раскладки, лежащие прямо в корне, переезжают в свои шарды
+size_t Storage::migrateFlatFiles() {
+    DIR *dir = opendir(root.c_str());
+    if (!dir) return 0;
+    std::vector<std::string> names;
+    while (dirent *entry = readdir(dir)) {
+        struct stat st{};
+        if (validName(entry->d_name) && fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISREG(st.st_mode)) {
+            names.emplace_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    size_t moved = 0;
+    for (const std::string &name : names) {
+        char from[PATH_MAX], to[PATH_MAX];
+        if (snprintf(from, sizeof(from), "%s/%s", root.c_str(), name.c_str()) >= static_cast<int>(sizeof(from)) ||
+            !filePath(name, to)) {
+            continue;
+        }
+        if (rename(from, to) == -1) {
+            LOG_WARN("storage", "migrate_failed", "file=%s error=\"%s\"", name.c_str(), strerror(errno));
+            continue;
+        }
+        ++moved;
+    }
+    return moved;
+}
+
+void Storage::scanShard(size_t shard, size_t &parts) {
+    char dirPath[PATH_MAX];
+    snprintf(dirPath, sizeof(dirPath), "%s/%02zx", root.c_str(), shard);
+    DIR *dir = opendir(dirPath);
+    if (!dir) return;
+    NameMap<StoredFile> files;
+    NameMap<PendingUpload> uploads;
+    uint64_t bytes = 0;
+    while (dirent *entry = readdir(dir)) {
+        std::string_view name = entry->d_name;
+        if (name.front() == '.') {
+            if (name.size() <= PART_EXTRA || !name.ends_with(".part")) continue;
+            ++parts;
+            // Незаконченная загрузка: докачка продолжит её и после перезапуска
+            std::string_view upload = name.substr(1, name.size() - PART_EXTRA);
+            int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if (fd == -1) continue;
+            if (validName(upload) && shardOf(upload) == shard) recoverUpload(uploads[std::string(upload)], fd);
+            close(fd);
+            continue;
+        }
+        struct stat st{};
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode)) continue;
+        if (!validName(name) || shardOf(name) != shard) {
+            LOG_WARN("storage", "misplaced_file", "dir=%s file=%s", dirPath, entry->d_name);
+            continue;
+        }
+        StoredFile file = describe(st);
+        char path[PATH_MAX];
+        if (filePath(name, path)) readCrcAttribute(path, file);
+        files.emplace(name, file);
+        bytes += file.size;
+    }
+    closedir(dir);
+
+    std::lock_guard<std::mutex> lock(shards[shard].mutex);
+    shards[shard].files = std::move(files);
+    shards[shard].uploads = std::move(uploads);
+    shards[shard].bytes = bytes;
+}
+
+bool Storage::open(const std::string &dir) {
+    auto start = std::chrono::steady_clock::now();
+    root = dir;
+    std::error_code ec;
+    std::filesystem::create_directories(root, ec);
+    for (size_t shard = 0; shard < STORAGE_SHARDS && !ec; ++shard) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%02zx", root.c_str(), shard);
+        if (mkdir(path, 0755) == -1 && errno != EEXIST) ec.assign(errno, std::generic_category());
+    }
+    if (ec) {
+        LOG_ERROR("storage", "open_failed", "root=%s error=\"%s\"", root.c_str(), ec.message().c_str());
+        return false;
+    }
+    size_t migrated = migrateFlatFiles();
+
+    // Шарды независимы: каждый поток обходит свою часть и заполняет их индексы
+    size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, STORAGE_SCAN_THREADS);
+    std::vector<size_t> parts(threads, 0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([this, t, threads, &parts] {
+            for (size_t shard = t; shard < STORAGE_SHARDS; shard += threads) scanShard(shard, parts[t]);
+        });
+    }
+    for (std::thread &worker : workers) worker.join();
+
+    Stats indexed = stats();
+    size_t partial = 0;
+    for (size_t count : parts) partial += count;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    LOG_INFO("storage", "index_built", "root=%s files=%zu bytes=%" PRIu64 " migrated=%zu partial=%zu ms=%lld",
+             root.c_str(), indexed.files, indexed.bytes, migrated, partial, static_cast<long long>(ms.count()));
+    return true;
+}
+
+bool Storage::lookup(std::string_view name, StoredFile &out) {
+    Shard &shard = shards[shardOf(name)];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.files.find(name);
+        if (it != shard.files.end()) {
+            out = it->second;
+            return true;
+        }
+    }
+    // Нет в индексе: файл мог зафиксировать предшественник после обхода шардов
+    char path[PATH_MAX];
+    struct stat st{};
+    if (!filePath(name, path) || stat(path, &st) == -1 || !S_ISREG(st.st_mode)) return false;
+    StoredFile file = describe(st);
+    readCrcAttribute(path, file);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto [it, added] = shard.files.emplace(std::string(name), file);
+    if (added) shard.bytes += file.size;
+    out = it->second;
+    return true;
+}
+
+void Storage::rememberCrc(std::string_view name, int fd, uint32_t crc) {
+    struct stat st{};
+    if (fstat(fd, &st) == -1) return;
+    Shard &shard = shards[shardOf(name)];
+    StoredFile file;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.files.find(name);
+        if (it == shard.files.end() || !sameVersion(it->second, st)) return;
+        it->second.crc = crc;
+        it->second.crcKnown = true;
+        file = it->second;
+    }
+    writeCrcAttribute(fd, file);
+}
+
+// Кусок [offset, offset + length) сливается с соседними, которые он задевает
+static void addWritten(std::map<uint64_t, uint64_t> &written, uint64_t offset, uint64_t length) {
+    if (length == 0) return;
+    uint64_t begin = offset, end = offset + length;
+    auto it = written.upper_bound(begin);
+    if (it != written.begin() && std::prev(it)->second >= begin) --it;
+    while (it != written.end() && it->first <= end) {
+        begin = std::min(begin, it->first);
+        end = std::max(end, it->second);
+        it = written.erase(it);
+    }
+    written.emplace(begin, end);
+}
+
+// Записанное подряд от начала файла
+static uint64_t writtenPrefix(const std::map<uint64_t, uint64_t> &written) {
+    auto first = written.begin();
+    return first != written.end() && first->first == 0 ? first->second : 0;
+}
+
+void Storage::recoverUpload(PendingUpload &upload, int fd) {
+    struct stat st{};
+    if (fstat(fd, &st) == -1) return;
+    UploadAttribute attr{};
+    upload.written.clear();
+    if (fgetxattr(fd, UPLOAD_ATTRIBUTE, &attr, sizeof(attr)) == sizeof(attr)) {
+        upload.size = attr.size;
+        upload.sizeKnown = true;
+        upload.ranged = true;
+        addWritten(upload.written, 0, std::min<uint64_t>(attr.written, st.st_size));
+    } else {
+        upload.size = 0;
+        upload.sizeKnown = false;
+        upload.ranged = false;
+        addWritten(upload.written, 0, static_cast<uint64_t>(st.st_size));
+    }
+}
+
+// Пока в .part есть куски не подряд, записанное подряд хранится рядом с ними
+void Storage::saveUpload(const PendingUpload &upload) {
+    if (!upload.ranged || upload.lockFd == -1) return;
+    UploadAttribute attr{upload.size, writtenPrefix(upload.written)};
+    fsetxattr(upload.lockFd, UPLOAD_ATTRIBUTE, &attr, sizeof(attr), 0);
+}
+
+void Storage::releaseUpload(PendingUpload &upload) {
+    if (upload.lockFd != -1) close(upload.lockFd);
+    upload.lockFd = -1;
+}
+
+int Storage::beginUpload(std::string_view name, uint64_t size, bool exclusive, bool ranged, uint64_t &resume) {
+    char part[PATH_MAX];
+    if (!partPath(name, part)) {
+        errno = EINVAL;
+        return -1;
+    }
+    Shard &shard = shards[shardOf(name)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.uploads.find(name);
+    bool known = it != shard.uploads.end();
+    // Файл переименовывается, или его пишут другие, а новая загрузка обрезала бы их данные
+    if (known && (it->second.committing ||
+                  (it->second.writers > 0 && (exclusive || it->second.exclusive || it->second.size != size)))) {
+        errno = EBUSY;
+        return -1;
+    }
+    // Открывается под мьютексом шарда: обрезка не придётся на запись соседнего соединения
+    int fd = ::open(part, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    if (!known) it = shard.uploads.emplace(std::string(name), PendingUpload{}).first;
+    PendingUpload &upload = it->second;
+    if (upload.lockFd == -1) {
+        // Мьютекс шарда - только внутри процесса; от второго процесса (горячий перезапуск)
+        // .part защищает flock, который держится, пока загрузка есть в памяти
+        int lockFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (lockFd == -1 || flock(lockFd, LOCK_EX | LOCK_NB) == -1) {
+            int error = errno == EWOULDBLOCK ? EBUSY : errno;
+            if (lockFd != -1) close(lockFd);
+            close(fd);
+            if (!known) shard.uploads.erase(it);
+            errno = error;
+            return -1;
+        }
+        upload.lockFd = lockFd;
+        // Без замка .part мог дописать другой процесс: записанное берётся с диска
+        recoverUpload(upload, fd);
+    }
+    // .part другого размера или для UDP, который пишет файл целиком, пишется с нуля
+    bool fresh = exclusive || (upload.sizeKnown ? upload.size != size : writtenPrefix(upload.written) > size);
+    if (fresh) {
+        if (ftruncate(fd, 0) == -1) LOG_WARN("storage", "truncate_failed", "file=%s error=\"%s\"", part, strerror(errno));
+        fremovexattr(fd, UPLOAD_ATTRIBUTE);
+        upload.written.clear();
+        upload.ranged = false;
+    }
+    upload.size = size;
+    upload.sizeKnown = true;
+    upload.exclusive = exclusive;
+    ++upload.writers;
+    resume = std::min(writtenPrefix(upload.written), size);
+    if (ranged && !upload.ranged) {
+        upload.ranged = true;
+        saveUpload(upload);
+    }
+    return fd;
+}
+
+bool Storage::uploadWritten(std::string_view name, uint64_t offset, uint64_t length) {
+    Shard &shard = shards[shardOf(name)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.uploads.find(name);
+    // Записи нет - файл уже собрал и зафиксировал кто-то другой
+    if (found == shard.uploads.end() || found->second.committing) return false;
+    PendingUpload &upload = found->second;
+    if (upload.writers > 0) --upload.writers;
+
+    addWritten(upload.written, offset, length);
+    bool complete = upload.size == 0 || writtenPrefix(upload.written) >= upload.size;
+    upload.committing = complete;
+    if (!complete) saveUpload(upload);
+    return complete;
+}
+
+void Storage::abandonUpload(std::string_view name, uint64_t offset, uint64_t length) {
+    Shard &shard = shards[shardOf(name)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.uploads.find(name);
+    if (found == shard.uploads.end() || found->second.committing) return;
+    PendingUpload &upload = found->second;
+    if (upload.writers > 0) --upload.writers;
+
+    // Записанное пригодится докачке. Кусок, с которым файл собран целиком, не засчитывается:
+    // фиксировать файл тут некому, докачка перепишет эти байты и зафиксирует сама
+    std::map<uint64_t, uint64_t> written = upload.written;
+    addWritten(written, offset, length);
+    if (writtenPrefix(written) < upload.size) upload.written = std::move(written);
+    if (upload.writers == 0 && upload.written.empty()) {
+        releaseUpload(upload);
+        shard.uploads.erase(found);
+        return;
+    }
+    saveUpload(upload);
+}
+
+bool Storage::commitUpload(std::string_view name, int fd, bool ready, uint32_t crc, bool crcKnown) {
+    char part[PATH_MAX], path[PATH_MAX];
+    struct stat st{};
+    bool ok = ready && partPath(name, part) && filePath(name, path) && fstat(fd, &st) == 0;
+    StoredFile file = describe(st);
+    file.crc = crc;
+    file.crcKnown = crcKnown;
+    if (ok) fremovexattr(fd, UPLOAD_ATTRIBUTE);
+    if (ok && crcKnown) writeCrcAttribute(fd, file);
+    ok = ok && rename(part, path) == 0;
+    if (ready && !ok) {
+        LOG_ERROR("storage", "commit_failed", "file=%.*s error=\"%s\"", static_cast<int>(name.size()), name.data(),
+                  strerror(errno));
+    }
+
+    Shard &shard = shards[shardOf(name)];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.uploads.find(name);
+        if (it != shard.uploads.end()) {
+            releaseUpload(it->second);
+            shard.uploads.erase(it);
+        }
+        if (ok) {
+            auto previous = shard.files.find(name);
+            if (previous != shard.files.end()) {
+                shard.bytes -= previous->second.size;
+                previous->second = file;
+            } else {
+                shard.files.emplace(std::string(name), file);
+            }
+            shard.bytes += file.size;
+        }
+    }
+    if (ok) fileCache().invalidate(path);
+    return ok;
+}
+
+std::string Storage::list(std::string_view prefix, std::string_view after, size_t limit) const {
+    // limit первых по имени - кучей, без копии и сортировки всего индекса
+    using Entry = std::pair<std::string, StoredFile>;
+    auto byName = [](const Entry &a, const Entry &b) { return a.first < b.first; };
+    std::vector<Entry> page;
+    page.reserve(limit);
+    bool more = false;
+    for (const Shard &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto &[name, file] : shard.files) {
+            if (!name.starts_with(prefix) || std::string_view(name) <= after) continue;
+            if (page.size() < limit) {
+                page.emplace_back(name, file);
+                std::push_heap(page.begin(), page.end(), byName);
+                continue;
+            }
+            more = true;
+            if (limit == 0 || name >= page.front().first) continue;
+            std::pop_heap(page.begin(), page.end(), byName);
+            page.back() = Entry(name, file);
+            std::push_heap(page.begin(), page.end(), byName);
+        }
+    }
+    std::sort_heap(page.begin(), page.end(), byName);
+
+    std::string out;
+    out.reserve(page.size() * 64 + 8);
+    for (const auto &[name, file] : page) {
+        char line[64];
+        int length = file.crcKnown
+                     ? snprintf(line, sizeof(line), "%" PRIu64 " %lld %08x ", file.size,
+                                static_cast<long long>(file.mtime.tv_sec), file.crc)
+                     : snprintf(line, sizeof(line), "%" PRIu64 " %lld - ", file.size,
+                                static_cast<long long>(file.mtime.tv_sec));
+        out.append(line, length);
+        out.append(name);
+        out.push_back('\n');
+    }
+    if (more && !page.empty()) {
+        out.append("MORE ");
+        out.append(page.back().first);
+        out.push_back('\n');
+    } else {
+        out.append("END\n");
+    }
+    return out;
+}
+
+Storage::Stats Storage::stats() const {
+    Stats result{0, 0, 0};
+    for (const Shard &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        result.files += shard.files.size();
+        result.uploads += shard.uploads.size();
+        result.bytes += shard.bytes;
+    }
+    return result;
+}
+
+Storage &storage() {
+    static Storage instance;
+    return instance;
+}
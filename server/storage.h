@@ -0,0 +1,128 @@
+#ifndef TCP_SERVER_STORAGE_H
+#define TCP_SERVER_STORAGE_H
+
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Хранилище принятых файлов. Файл name лежит в <root>/<xx>/name, где xx - младший байт
+// CRC32C имени в hex: 256 каталогов вместо одного огромного, на inode которого
+// сходятся все поиски и создания файлов.
+// Метаданные всех файлов - в памяти, индекс разбит по тем же шардам, у каждого свой мьютекс.
+// DOWNLOAD/HASH/LIST узнают о файле из индекса, не трогая диск; при старте индекс строится
+// обходом шардов в несколько потоков, CRC32C берётся из xattr user.crc32c без чтения файлов.
+// Каталог принадлежит серверу: файлы, положенные в него вручную, видны после перезапуска
+// (лежащие прямо в корне, от прежней плоской раскладки, переносятся в свои шарды).
+// Загрузка пишет в "<xx>/.name.part" и после fsync переименовывается на место: читатели
+// видят либо прежнюю версию файла, либо новую целиком.
+// Каталог на время горячего перезапуска делят два процесса: файл, зафиксированный
+// предшественником после обхода, индекс находит по stat при первом промахе, а .part
+// пишет только процесс, держащий на нём flock.
+constexpr size_t STORAGE_SHARDS = 256;
+// Строк в одном ответе LIST
+constexpr size_t LIST_PAGE_ENTRIES = 1000;
+
+struct StoredFile {
+    uint64_t size = 0;
+    timespec mtime{};
+    uint32_t crc = 0;
+    bool crcKnown = false;   // докачанный или собранный по кускам файл - до первого HASH целиком
+};
+
+class Storage {
+public:
+    // Создаёт шарды, переносит файлы плоской раскладки, строит индекс
+    bool open(const std::string &root);
+
+    // Не пустое, без '/' и управляющих символов, не с '.' (так называются .part)
+    static bool validName(std::string_view name);
+    // Пути в буфер вызывающего; false - имя недопустимо или не помещается
+    bool filePath(std::string_view name, char (&path)[PATH_MAX]) const;
+    bool partPath(std::string_view name, char (&path)[PATH_MAX]) const;
+
+    // Промах проверяется stat: файл мог зафиксировать другой процесс (см. выше)
+    bool lookup(std::string_view name, StoredFile &out);
+    // CRC32C всего файла, посчитанный по fd: запоминается, если файл с тех пор не сменился
+    void rememberCrc(std::string_view name, int fd, uint32_t crc);
+
+    // Загрузка name размером size: открывает .part на запись и регистрирует писателя.
+    // Без exclusive к загрузке того же размера присоединяются докачка и диапазоны из других
+    // соединений; resume - сколько записано подряд от начала, в том числе до перезапуска.
+    // ranged - писатель пишет кусок не с resume: пока он есть, записанное хранится в xattr
+    // .part, а не выводится из его размера. Новая загрузка (другого размера, exclusive у UDP)
+    // обрезает .part. -1 с errno: EBUSY - файл переименовывается, его пишут другие, которым
+    // новая загрузка испортила бы данные, или его держит другой процесс.
+    int beginUpload(std::string_view name, uint64_t size, bool exclusive, bool ranged, uint64_t &resume);
+    // Писатель записал свой кусок [offset, offset + length) целиком. true - файл собран, и
+    // вызывающий последним фиксирует его commitUpload; до этого новые загрузки получают отказ.
+    bool uploadWritten(std::string_view name, uint64_t offset, uint64_t length);
+    // Писатель ушёл, не дописав: [offset, offset + length) - записанное им подряд
+    void abandonUpload(std::string_view name, uint64_t offset, uint64_t length);
+    // ready - данные .part на месте (fsync прошёл): rename, индекс, xattr, сброс кэша.
+    // fd - открытый .part. false - файл не зафиксирован.
+    bool commitUpload(std::string_view name, int fd, bool ready, uint32_t crc, bool crcKnown);
+
+    // LIST: до limit строк "<size> <mtime> <crc32c|-> <name>" с именами после after, в порядке
+    // имён. В конце "END" или, если подходящих файлов больше, "MORE <последнее имя>" -
+    // с него продолжает следующий запрос. Ответ не растёт с числом файлов в хранилище.
+    std::string list(std::string_view prefix, std::string_view after, size_t limit) const;
+
+    struct Stats {
+        size_t files;
+        uint64_t bytes;
+        size_t uploads;   // незаконченные загрузки, о которых помнит сервер
+    };
+    Stats stats() const;
+
+private:
+    // Загрузка, которую дописывают: какие куски уже на диске (начало -> конец)
+    struct PendingUpload {
+        uint64_t size = 0;
+        std::map<uint64_t, uint64_t> written;
+        uint32_t writers = 0;     // открытых .part у соединений
+        bool exclusive = false;   // писатель UDP: пишет файл целиком, к нему не присоединяются
+        bool committing = false;
+        bool sizeKnown = true;    // восстановлена по .part без xattr: размер даст первая загрузка
+        bool ranged = false;      // были куски не подряд: записанное - в xattr, а не размер .part
+        // Пока открыт, .part принадлежит этому процессу и written верен; -1 - записанное
+        // перечитывается с диска при следующей загрузке
+        int lockFd = -1;
+    };
+
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>()(name); }
+    };
+    template<class T>
+    using NameMap = std::unordered_map<std::string, T, NameHash, std::equal_to<>>;
+
+    struct Shard {
+        mutable std::mutex mutex;
+        NameMap<StoredFile> files;
+        NameMap<PendingUpload> uploads;
+        uint64_t bytes = 0;   // сумма размеров files
+    };
+
+    static size_t shardOf(std::string_view name);
+    bool buildPath(std::string_view name, bool part, char (&path)[PATH_MAX]) const;
+    void scanShard(size_t shard, size_t &parts);
+    // Записанное в .part по его размеру и xattr; fd - открытый .part
+    static void recoverUpload(PendingUpload &upload, int fd);
+    static void saveUpload(const PendingUpload &upload);
+    static void releaseUpload(PendingUpload &upload);
+    size_t migrateFlatFiles();
+
+    std::string root;
+    std::array<Shard, STORAGE_SHARDS> shards;
+};
+
+// Хранилище процесса; открывается в main до запуска серверов
+Storage &storage();
+
+#endif//TCP_SERVER_STORAGE_H
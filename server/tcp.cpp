@@ -1,23 +1,67 @@
 #include "../libs.h"
+#include "coro.h"
+#include "crc32c.h"
+#include "file_cache.h"
+#include "lifecycle.h"
+#include "logger.h"
+#include "lz4.h"
+#include "metrics.h"
+#include "net_address.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "session.h"
+#include "storage.h"
+#include "uring.h"
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <memory>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
 
 volatile std::sig_atomic_t g_shutdown = 0;
-std::mutex accept_mutex;
-std::mutex log_mutex;
+volatile std::sig_atomic_t g_draining = 0;
 
-// В структуре или глобально (лучше использовать класс)
-std::unordered_map<int, bool> clientUploadMode; // key: clientSocket, value: in upload mode
-std::unordered_map<int, int> clientFileSizes;   // Остаток байт для приёма
-std::unordered_map<int, std::string> clientFileName;
-static std::unordered_map<int, int> bytesReceivedMap;
+constexpr int MAX_EVENTS = 256;
+constexpr size_t TCP_SENDFILE_CHUNK = 16 * 1024 * 1024;
+// Ответы копятся за всё чтение сокета и уходят одним send; столько накопилось - шлём сразу
+constexpr size_t TCP_OUTPUT_FLUSH = 64 * 1024;
+constexpr uint64_t TIMER_TICK_MS = 10;
+// При мягкой остановке: как часто искать простаивающие соединения и сколько молчания
+// считать простоем (клиент, только что получивший ответ, успевает прислать следующую команду)
+constexpr int DRAIN_CHECK_MS = 100;
+constexpr uint64_t DRAIN_IDLE_MS = 500;
 
-void signal_handler(int) {
-    g_shutdown = 1;
-    std::cout << "Detected SIGINT, closing server...";
+static std::atomic<int> g_openConnections{0};
+
+size_t outputHighWater() {
+    return static_cast<size_t>(std::max(1, g_config.outputHighWaterKB)) * 1024;
 }
+// Общая полоса всех передач; настраивается до старта реакторов
+static TokenBucket g_globalBandwidth;
+
+// Метки служебных fd в epoll_event.data.ptr; у соединений там лежит Session*
+static char LISTEN_TAG;
+static char MAILBOX_TAG;
 
-void log_message(const std::string& msg) {
-    std::lock_guard<std::mutex> lock(log_mutex);
-    std::cout << "[LOG] " << msg << std::endl;
+void postToReactor(Reactor &reactor, Task task) {
+    {
+        std::lock_guard<std::mutex> lock(reactor.mailboxMutex);
+        reactor.mailbox.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    ssize_t rc = write(reactor.eventFd, &one, sizeof(one));
+    (void) rc;
+}
+
+// Первый сигнал - мягкая остановка, повторный - немедленная. Только флаги: обработчик
+// прерывает любой поток, а журнал и iostream не async-signal-safe
+void signal_handler(int) {
+    if (g_draining) g_shutdown = 1;
+    g_draining = 1;
 }
 
 int closeSockets(SOCKET serverSocket, int exitCode){
@@ -46,277 +90,1292 @@ void cleanupSockets() {
 #endif
 }
 
-void sendMessage(int clientSocket, const std::string &message) {
-    send(clientSocket, message.c_str(), message.size(), 0);
+static bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
 }
 
-void handleEcho(int clientSocket, const std::string &command) {
-    std::string response = command.substr(5) + '\n';
-    sendMessage(clientSocket, response);
+void sendMessage(Session &conn, std::string_view message) {
+    conn.outBuf.append(message);
 }
 
-void handleTime(int clientSocket) {
-    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    std::string timeStr = ctime(&now);
-    timeStr.pop_back();
-    timeStr += '\n';
-    sendMessage(clientSocket, timeStr);
+static void appendNumber(std::string &out, long value) {
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr - digits);
 }
 
-void handleExit(int clientSocket) {
-    std::cout << "Closing connection." << std::endl;
-#ifdef _WIN32
-    closesocket(clientSocket);
-#else
-    close(clientSocket);
-#endif
+static void appendHex32(std::string &out, uint32_t value) {
+    char digits[8];
+    for (int i = 7; i >= 0; --i, value >>= 4) digits[i] = "0123456789abcdef"[value & 0xF];
+    out.append(digits, sizeof(digits));
 }
 
-int handleTCPServer(SOCKET serverSocket){
-    sockaddr_in serverAddr{};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(TCP_PORT);
+// pread ровно size байт; false - ошибка или файл короче
+static bool readFully(int fd, char *data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t rc = pread(fd, data, size, offset);
+        if (rc == -1 && errno == EINTR) continue;
+        if (rc <= 0) return false;
+        data += rc;
+        size -= rc;
+        offset += rc;
+    }
+    return true;
+}
+
+// Отправляет накопленный outBuf, пока сокет принимает данные.
+// MSG_MORE в flags - следом пойдут ещё данные, ядру не нужно выталкивать неполный сегмент.
+// Возвращает false при ошибке соединения.
+static bool flushOutput(Session &conn, int flags = 0) {
+    while (conn.outOffset < conn.outBuf.size()) {
+        ssize_t sent = send(conn.fd, conn.outBuf.data() + conn.outOffset,
+                            conn.outBuf.size() - conn.outOffset, MSG_NOSIGNAL | flags);
+        if (sent > 0) {
+            conn.outOffset += sent;
+            countMetric(Counter::TcpBytesOut, sent);
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        return false;
+    }
+    conn.outBuf.clear();
+    conn.outOffset = 0;
+    return true;
+}
 
-    ThreadPool pool(4);
+void handleEcho(Session &conn, std::string_view text) {
+    conn.outBuf.append(text);
+    conn.outBuf.push_back('\n');
+}
+
+void handleTime(Session &conn) {
+    char buffer[32];
+    conn.outBuf.append(formatTime(buffer));
+    conn.outBuf.push_back('\n');
+}
+
+void handleExit(Session &conn) {
+    LOG_DEBUG("tcp", "client_quit", "fd=%d", conn.fd);
+    conn.closing = true;
+}
 
-    if (bind(serverSocket, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) == -1) {
-        std::cerr << "Bind failed" << std::endl;
-        closeSockets(serverSocket, EXIT_FAILURE);
+static void serviceConnection(Reactor &reactor, Session &conn, uint32_t events);
+
+// Продолжает соединение после задачи из пула: досылает ответ и разбирает отложенные команды
+static void resumeConnection(Reactor &reactor, Session &conn) {
+    if (reactor.uring) {
+        uringResume(conn);
+    } else {
+        serviceConnection(reactor, conn, EPOLLOUT);
     }
+}
 
-    if (listen(serverSocket, 5) == -1) {
-        std::cerr << "Listen failed" << std::endl;
-        closeSockets(serverSocket, EXIT_FAILURE);
+// Итог UPLOAD; CRC32C принятых байт позволяет клиенту сверить их со своими
+void sendUploadResult(Session &conn, bool synced) {
+    if (!synced) {
+        sendMessage(conn, "ERROR: Could not write file\n");
+        return;
     }
+    recordTransfer(Transfer::TcpUpload, microsSince(conn.transferStart));
+    conn.outBuf.append("File upload complete. CRC32C=");
+    appendHex32(conn.outBuf, conn.uploadCrc);
+    conn.outBuf.push_back('\n');
+}
 
-    std::cout << "[TCP] Server listening on port " << TCP_PORT << "..." << std::endl;
+// fsync принятого файла в пуле; ответ клиенту - после того как данные на диске
+static SessionCoroutine syncUpload(SessionRef conn) {
+    int fileFd = conn->uploadFd;
+    conn->uploadFd = -1;
+    conn->state = ConnState::Syncing;
+    // Имя - в кадре корутины, в задачу идёт ссылка: временный объект с деструктором
+    // внутри co_await GCC 12 разрушает дважды
+    std::string name = conn->uploadName;
+    bool synced = co_await onDiskPool(*conn->reactor, [fileFd, &name, commit = conn->uploadCommit,
+                                                       crc = conn->uploadCrc, wholeCrc = conn->uploadWholeCrc] {
+        bool ok = fsync(fileFd) == 0;
+        // Собравшее файл соединение ставит его на место, даже если клиент уже отключился
+        if (commit) ok = storage().commitUpload(name, fileFd, ok, crc, wholeCrc);
+        close(fileFd);
+        return ok;
+    });
+    if (!conn) co_return;
 
-    while (!g_shutdown) {
-        sockaddr_in clientAddr;
-        socklen_t clientSize = sizeof(clientAddr);
-        std::lock_guard<std::mutex> lock(accept_mutex);
-        int clientSocket = accept(serverSocket, (struct sockaddr *) &clientAddr, &clientSize);
-        if (clientSocket == -1) {
-            //            if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            //                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            //                continue;
-            //            }
-            std::cerr << "Accept failed" << std::endl;
-            break;
+    conn->state = ConnState::Command;
+    sendUploadResult(*conn, synced);
+    resumeConnection(*conn->reactor, *conn);
+}
+
+// Кусок принят целиком: fsync в пуле (у io_uring - отдельным SQE). Файл готов, когда
+// куски из всех его соединений покрыли его целиком
+void finishUpload(Session &conn) {
+    conn.uploadCommit = storage().uploadWritten(conn.uploadName, conn.uploadStart, conn.uploadOffset - conn.uploadStart);
+    if (conn.reactor->uring) {
+        uringFinishUpload(conn);
+        return;
+    }
+    syncUpload(SessionRef(conn));
+}
+
+void abandonUpload(Session &conn, off_t writtenEnd) {
+    if (conn.uploadFd == -1 || conn.uploadName.empty()) return;
+    storage().abandonUpload(conn.uploadName, conn.uploadStart, writtenEnd - conn.uploadStart);
+}
+
+// UPLOAD <file> <size> [<offset> <length>] [LZ4]. С диапазоном соединение пишет только свой
+// кусок файла (pwrite на его место), так что файл можно грузить в несколько соединений сразу.
+// С LZ4 тело идёт кадрами (см. lz4.h), размеры и смещения - по-прежнему в исходных байтах.
+// Пишется .part файла (см. storage.h): докачка продолжает его, а не готовый файл, который
+// UPLOAD целиком заменяет.
+void handleUpload(Session &conn, std::string_view args) {
+    bool compressed = takeFlag(args, "LZ4");
+    std::string_view filename = nextToken(args);
+    long fileSize;
+    char filepath[PATH_MAX];
+    if (filename.empty() || !parseNumber(nextToken(args), fileSize) || fileSize < 0 ||
+        !storage().partPath(filename, filepath)) {
+        sendMessage(conn, "ERROR: Invalid UPLOAD command\n");
+        return;
+    }
+    std::string_view offsetToken = nextToken(args);
+    bool ranged = !offsetToken.empty();
+    long rangeOffset = 0, rangeLength = 0;
+    if (ranged && (!parseNumber(offsetToken, rangeOffset) || !parseNumber(nextToken(args), rangeLength) ||
+                   rangeOffset < 0 || rangeLength < 0 || rangeOffset > fileSize - rangeLength)) {
+        sendMessage(conn, "ERROR: Invalid UPLOAD range\n");
+        return;
+    }
+
+    uint64_t resume = 0;
+    int fd = storage().beginUpload(filename, fileSize, false, ranged, resume);
+    if (fd == -1 && errno == EBUSY) {
+        sendMessage(conn, "ERROR: File is busy with another upload, try again\n");
+        return;
+    }
+    if (fd == -1) {
+        LOG_WARN("tcp", "upload_open_failed", "file=%s error=\"%s\"", filepath, strerror(errno));
+        sendMessage(conn, "ERROR: Could not open file\n");
+        return;
+    }
+
+    // Без диапазона - докачка: продолжаем с того, что прежние соединения записали подряд
+    long startOffset = ranged ? rangeOffset : static_cast<long>(resume);
+    conn.uploadRemaining = ranged ? rangeLength : fileSize - startOffset;
+    if (conn.uploadRemaining > 0) {
+        // Резервируем место заранее
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, startOffset, conn.uploadRemaining);
+    }
+
+    conn.outBuf.append("READY ");
+    appendNumber(conn.outBuf, startOffset);
+    conn.outBuf.append(compressed ? " LZ4\n" : "\n");
+    conn.uploadFd = fd;
+    conn.uploadCrc = 0;
+    conn.uploadCompressed = compressed;
+    conn.uploadOffset = startOffset;
+    conn.uploadName.assign(filename);
+    conn.uploadStart = startOffset;
+    conn.uploadWholeCrc = startOffset == 0 && conn.uploadRemaining == fileSize;
+    conn.transferStart = std::chrono::steady_clock::now();
+    conn.state = ConnState::Upload;
+    armSessionTimer(conn);
+    if (conn.uploadRemaining == 0) finishUpload(conn);
+}
+
+// Пишет в файл не больше uploadRemaining байт, возвращает сколько поглощено
+static size_t receiveFileData(Session &conn, const char *data, size_t size) {
+    size_t take = std::min<size_t>(size, conn.uploadRemaining);
+    size_t written = 0;
+    while (written < take) {
+        ssize_t rc = pwrite(conn.uploadFd, data + written, take - written, conn.uploadOffset);
+        if (rc == -1 && errno == EINTR) continue;
+        if (rc <= 0) {
+            LOG_ERROR("tcp", "upload_write_failed", "error=\"%s\"", strerror(errno));
+            sendMessage(conn, "ERROR: Could not write file\n");
+            conn.closing = true;
+            return size;
         }
+        written += rc;
+        conn.uploadOffset += rc;
+    }
+    conn.uploadCrc = crc32c(conn.uploadCrc, data, take);
+    conn.uploadRemaining -= take;
+    if (conn.uploadRemaining == 0) finishUpload(conn);
+    return take;
+}
 
-        pool.enqueue([clientSocket] {
-            handleClient(clientSocket);
-        });
+// Один целый кадр LZ4 из входа: распаковывается и пишется как обычные данные.
+// Возвращает сколько поглощено; 0 - кадр ещё не пришёл целиком.
+static size_t receiveCompressedData(Session &conn, const char *data, size_t size) {
+    if (size < LZ4_FRAME_HEADER) return 0;
+    uint32_t header[2];
+    memcpy(header, data, sizeof(header));
+    size_t stored = ntohl(header[0]);
+    size_t raw = ntohl(header[1]);
+    if (raw == 0 || raw > LZ4_FRAME_BLOCK || stored > raw || raw > static_cast<size_t>(conn.uploadRemaining)) {
+        sendMessage(conn, "ERROR: Invalid compressed data\n");
+        conn.closing = true;
+        return size;
+    }
+    if (size < LZ4_FRAME_HEADER + stored) return 0;
 
-        log_message("Client connected: " + std::string(inet_ntoa(clientAddr.sin_addr)));
+    const char *payload = data + LZ4_FRAME_HEADER;
+    if (stored < raw) {
+        // Буфер приёма реактора свободен: сжатое тело читается через inBuf
+        char *block = conn.reactor->recvBuffer.data();
+        if (!lz4Decompress(payload, stored, block, raw)) {
+            sendMessage(conn, "ERROR: Invalid compressed data\n");
+            conn.closing = true;
+            return size;
+        }
+        payload = block;
+    }
+    receiveFileData(conn, payload, raw);
+    return LZ4_FRAME_HEADER + stored;
+}
 
-        //        std::thread clientThread(handleClient, clientSocket);
-        //        clientThread.detach();
+// Тело UPLOAD на epoll: читает сокет до конца файла, пока сокет не пуст и полоса позволяет,
+// иначе ждёт EPOLLIN. Начало тела, пришедшее одним recv с командой, берёт из inBuf.
+static SessionCoroutine receiveUpload(Session &conn) {
+    TransferScope scope(conn);
+    while (conn.state == ConnState::Upload && !conn.closing) {
+        char *buffer = conn.reactor->recvBuffer.data();
+        size_t room;
+        if (conn.uploadCompressed) {
+            // Сжатое тело разбирается кадрами, поэтому идёт через inBuf, как команды
+            std::string_view input = conn.inBuf.view();
+            size_t used = receiveCompressedData(conn, input.data(), input.size());
+            if (used > 0) {
+                conn.inBuf.consume(used);
+                continue;
+            }
+            if (conn.inBuf.size() >= SESSION_INPUT_LIMIT) {
+                sendMessage(conn, "ERROR: Invalid compressed data\n");
+                conn.closing = true;
+                break;
+            }
+            room = conn.inBuf.prepare(SESSION_INPUT_LIMIT, buffer);
+        } else {
+            if (!conn.inBuf.empty()) {
+                std::string_view input = conn.inBuf.view();
+                conn.inBuf.consume(receiveFileData(conn, input.data(), input.size()));
+                continue;
+            }
+            // Не забираем из сокета ничего сверх тела файла
+            room = std::min<size_t>(conn.reactor->recvBuffer.size(), conn.uploadRemaining);
+        }
+        if ((room = bandwidthFor(conn, room)) == 0) {
+            co_await socketReady(conn, EPOLLIN);   // пауза ограничителя полосы, продолжит таймер
+            continue;
+        }
+
+        ssize_t received = recv(conn.fd, buffer, room, 0);
+        if (received > 0) {
+            countMetric(Counter::TcpBytesIn, received);
+            chargeBandwidth(conn, received);
+            if (conn.uploadCompressed) {
+                conn.inBuf.commit(received);
+            } else {
+                receiveFileData(conn, buffer, received);
+            }
+            continue;
+        }
+        if (received == -1 && errno == EINTR) continue;
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_await socketReady(conn, EPOLLIN);
+            continue;
+        }
+        conn.broken = true;   // клиент ушёл посреди файла
+        break;
     }
-    return EXIT_SUCCESS;
 }
 
-void receiveFile(int clientSocket, const std::string &filename, int totalFileSize) {
-    std::string save_path = "uploads/" + filename;
+// length < 0 - до конца файла, ответ "READY <осталось>".
+// С длиной - ровно этот кусок, ответ "READY <длина куска> <размер файла>".
+// compress - клиент просил LZ4: файл сжимается, если образец из его начала сжимается,
+// и тогда к READY добавляется " LZ4".
+static void startDownload(Session &conn, const char *filename, long offset, long length, bool compress) {
+    // Горячий файл отдаётся из памяти: ни open, ни fstat
+    CachedFileRef cached = fileCache().find(filename);
+    int fd = -1;
+    long fileSize;
+    if (cached) {
+        fileSize = static_cast<long>(cached->size);
+    } else {
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            if (errno == ENOENT) {
+                LOG_INFO("tcp", "download_not_found", "file=%s", filename);
+                sendMessage(conn, "ERROR: File not found\n");
+            } else {
+                sendMessage(conn, "ERROR: Cannot open file\n");
+            }
+            return;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            sendMessage(conn, "ERROR: Cannot open file\n");
+            return;
+        }
+        fileSize = st.st_size;
+        // Этот раз - с диска; в кэш файл дочитает пул, если его просят не впервые
+        fileCache().missed(filename, st);
+    }
+    if (offset > fileSize) offset = fileSize;
+    if (offset < 0) offset = 0;
+    long remaining = fileSize - offset;
+    if (length >= 0 && length < remaining) remaining = length;
+    if (fd != -1) posix_fadvise(fd, offset, remaining, POSIX_FADV_SEQUENTIAL);
+    if (compress && remaining > 0) {
+        size_t sampleSize = std::min<long>(LZ4_FRAME_BLOCK, remaining);
+        const char *sample = cached ? cached->data.get() + offset : conn.reactor->recvBuffer.data();
+        compress = (cached || readFully(fd, conn.reactor->recvBuffer.data(), sampleSize, offset)) &&
+                   lz4Worthwhile(sample, sampleSize);
+    } else {
+        compress = false;
+    }
+
+    // Отправляем клиенту READY с оставшимся размером
+    conn.outBuf.append("READY ");
+    appendNumber(conn.outBuf, remaining);
+    if (length >= 0) {
+        conn.outBuf.push_back(' ');
+        appendNumber(conn.outBuf, fileSize);
+    }
+    conn.outBuf.append(compress ? " LZ4\n" : "\n");
+    LOG_INFO("tcp", "download_started", "file=%s offset=%ld bytes=%ld cached=%d lz4=%d", filename, offset, remaining,
+             cached != nullptr, compress);
 
-    // Создаем папку uploads, если её нет
-#ifdef _WIN32
-    _mkdir("uploads");
-#else
-    mkdir("uploads", 0777);
-#endif
+    conn.downloadFd = fd;
+    conn.downloadFile = std::move(cached);
+    conn.downloadOffset = offset;
+    conn.downloadRemaining = remaining;
+    conn.downloadSent = 0;
+    conn.downloadCompressed = compress;
+    conn.transferStart = std::chrono::steady_clock::now();
+    conn.state = ConnState::Download;
+    armSessionTimer(conn);
+}
+
+// DOWNLOAD <file> [<offset> [<length>]] [LZ4]: диапазоны позволяют качать файл в несколько
+// соединений, LZ4 - просьба сжимать (сервер может отказать, ответив READY без LZ4)
+void handleDownload(Session &conn, std::string_view args) {
+    bool compress = takeFlag(args, "LZ4");
+    std::string_view filename = nextToken(args);
+    char filepath[PATH_MAX];
+    if (filename.empty() || !storage().filePath(filename, filepath)) {
+        sendMessage(conn, "usage: DOWNLOAD <filename> [offset [length]] [LZ4]\n");
+        return;
+    }
 
-    // Если файл уже существует, получаем текущий размер (offset)
-    int currentSize = 0;
-    if (std::filesystem::exists(save_path)) {
-        currentSize = std::filesystem::file_size(save_path);
+    long offset = 0;
+    if (!parseNumber(nextToken(args), offset)) {
+        offset = 0;
+    }
+    std::string_view lengthToken = nextToken(args);
+    long length = -1;
+    if (!lengthToken.empty() && (!parseNumber(lengthToken, length) || length < 0)) {
+        sendMessage(conn, "ERROR: Invalid DOWNLOAD range\n");
+        return;
     }
-    // Отправляем клиенту сообщение с текущим offset
-    sendMessage(clientSocket, "READY " + std::to_string(currentSize) + "\n");
 
-    // Открываем файл в режиме добавления
-    std::ofstream file(save_path, std::ios::binary | std::ios::app);
-    if (!file) {
-        std::cerr << "Error opening file for writing: " << save_path << std::endl;
-        sendMessage(clientSocket, "ERROR: Could not open file\n");
+    // Нет в индексе - нет и на диске: ответ без open
+    StoredFile stored;
+    if (!storage().lookup(filename, stored)) {
+        LOG_INFO("tcp", "download_not_found", "file=%s", filepath);
+        sendMessage(conn, "ERROR: File not found\n");
         return;
     }
+    startDownload(conn, filepath, offset, length, compress);
+}
 
-    char buffer[BUFFER_SIZE];
-    int bytesReceived;
-    int totalReceived = currentSize; // Начинаем с уже полученных байт
+// "CRC32C <crc> <offset> <length>\n"
+static void sendHashLine(Session &conn, uint32_t crc, long offset, long length) {
+    conn.outBuf.append("CRC32C ");
+    appendHex32(conn.outBuf, crc);
+    conn.outBuf.push_back(' ');
+    appendNumber(conn.outBuf, offset);
+    conn.outBuf.push_back(' ');
+    appendNumber(conn.outBuf, length);
+    conn.outBuf.push_back('\n');
+}
 
-    while (totalReceived < totalFileSize && (bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE, 0)) > 0) {
-        file.write(buffer, bytesReceived);
-        totalReceived += bytesReceived;
+// CRC32C куска файла с диска; выполняется в потоке пула
+static bool hashFileRange(int fd, long offset, long length, uint32_t &crc) {
+    constexpr size_t HASH_BLOCK = 1024 * 1024;
+    thread_local std::vector<char> block(HASH_BLOCK);
+    crc = 0;
+    while (length > 0) {
+        ssize_t rc = pread(fd, block.data(), std::min<size_t>(HASH_BLOCK, length), offset);
+        if (rc == -1 && errno == EINTR) continue;
+        if (rc <= 0) return false;
+        crc = crc32c(crc, block.data(), rc);
+        offset += rc;
+        length -= rc;
     }
+    return true;
+}
 
-    file.close();
-    sendMessage(clientSocket, "File upload complete.\n");
+// Чтение с диска - в пуле, как fsync; команды за HASH ждут результата.
+// wholeFile - имя файла, если считается он целиком: CRC запоминается в индексе
+static SessionCoroutine hashOnDiskPool(SessionRef conn, int fd, long offset, long length, std::string wholeFile) {
+    struct Digest {
+        bool ok = false;
+        uint32_t crc = 0;
+    };
+    conn->state = ConnState::Hashing;
+    Digest digest = co_await onDiskPool(*conn->reactor, [fd, offset, length, &wholeFile] {
+        Digest result;
+        result.ok = hashFileRange(fd, offset, length, result.crc);
+        if (result.ok && !wholeFile.empty()) storage().rememberCrc(wholeFile, fd, result.crc);
+        close(fd);
+        return result;
+    });
+    if (!conn) co_return;
+
+    conn->state = ConnState::Command;
+    if (digest.ok) {
+        sendHashLine(*conn, digest.crc, offset, length);
+    } else {
+        sendMessage(*conn, "ERROR: Could not read file\n");
+    }
+    resumeConnection(*conn->reactor, *conn);
 }
 
+// HASH <file> [<offset> <length>]: CRC32C файла или его куска. Клиент сверяет загруженное
+// или пропускает совпадающие куски вместо повторной передачи.
+void handleHash(Session &conn, std::string_view args) {
+    std::string_view filename = nextToken(args);
+    std::string_view offsetToken = nextToken(args);
+    char filepath[PATH_MAX];
+    long offset = 0, length = LONG_MAX;
+    if (filename.empty() || !storage().filePath(filename, filepath) ||
+        (!offsetToken.empty() && (!parseNumber(offsetToken, offset) || !parseNumber(nextToken(args), length) ||
+                                  offset < 0 || length < 0))) {
+        sendMessage(conn, "usage: HASH <filename> [offset length]\n");
+        return;
+    }
 
-void sendFile(int clientSocket, const std::string &filename, int offset = 0) {
-    if (!std::filesystem::exists(filename)) {
-        std::cerr << "File does not exist: " << filename << std::endl;
-        sendMessage(clientSocket, "ERROR: File not found\n");
+    StoredFile stored;
+    if (!storage().lookup(filename, stored)) {
+        sendMessage(conn, "ERROR: File not found\n");
         return;
     }
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        sendMessage(clientSocket, "ERROR: Cannot open file\n");
+    // CRC всего файла известен индексу с загрузки или прошлого HASH
+    if (stored.crcKnown && offset == 0 && static_cast<uint64_t>(length) >= stored.size) {
+        sendHashLine(conn, stored.crc, 0, static_cast<long>(stored.size));
         return;
     }
-    file.seekg(0, std::ios::end);
-    long fileSize = file.tellg();
-    if (offset > fileSize) offset = fileSize;
-    int remaining = fileSize - offset;
-    file.seekg(offset, std::ios::beg);
 
-    // Отправляем клиенту READY с оставшимся размером
-    std::ostringstream header;
-    header << "READY " << remaining << "\n";
-    send(clientSocket, header.str().c_str(), header.str().size(), 0);
-    std::cout << "READY " << remaining << " sent to client for download" << std::endl;
+    // Горячий файл считается из памяти, целиком - уже посчитан
+    if (CachedFileRef cached = fileCache().find(filepath)) {
+        long size = static_cast<long>(cached->size);
+        offset = std::min(offset, size);
+        length = std::min(length, size - offset);
+        uint32_t crc = offset == 0 && length == size ? cached->crc
+                                                     : crc32c(0, cached->data.get() + offset, length);
+        sendHashLine(conn, crc, offset, length);
+        return;
+    }
 
-    char buffer[BUFFER_SIZE];
-    long totalSent = 0;
-    auto startTime = std::chrono::steady_clock::now();
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (fd != -1) close(fd);
+        sendMessage(conn, "ERROR: File not found\n");
+        return;
+    }
+    offset = std::min<long>(offset, st.st_size);
+    length = std::min<long>(length, st.st_size - offset);
 
-    while (!file.eof()) {
-        file.read(buffer, BUFFER_SIZE);
-        int bytesRead = file.gcount();
-        if (bytesRead > 0) {
-            send(clientSocket, buffer, bytesRead, 0);
-            totalSent += bytesRead;
+    bool whole = offset == 0 && length == st.st_size;
+    hashOnDiskPool(SessionRef(conn), fd, offset, length, whole ? std::string(filename) : std::string());
+}
+
+// LIST [<prefix>]: файлы хранилища из индекса, диск не читается
+// LIST [<prefix> [<after>]]: страница до LIST_PAGE_ENTRIES файлов; ответ "MORE <name>"
+// продолжается запросом LIST <prefix> <name>. Префикс "." (имён с точки не бывает) - все файлы.
+void handleList(Session &conn, std::string_view args) {
+    std::string_view prefix = nextToken(args);
+    std::string_view after = nextToken(args);
+    if (prefix == ".") prefix = {};
+    conn.outBuf.append(storage().list(prefix, after, LIST_PAGE_ENTRIES));
+}
+
+void finishDownload(Session &conn) {
+    auto endTime = std::chrono::steady_clock::now();
+    double elapsedTime = std::chrono::duration<double>(endTime - conn.transferStart).count();
+    double speed = elapsedTime > 0 ? (conn.downloadSent / 1024.0) / elapsedTime : 0; // KB/s
+
+    LOG_INFO("tcp", "download_complete", "bytes=%ld seconds=%.3f kb_per_sec=%.0f", conn.downloadSent, elapsedTime,
+             speed);
+    recordTransfer(Transfer::TcpDownload, microsSince(conn.transferStart));
+    if (conn.downloadFd != -1) close(conn.downloadFd);
+    conn.downloadFd = -1;
+    conn.downloadFile.reset();
+    conn.downloadCompressed = false;
+    conn.state = ConnState::Command;
+}
+
+bool appendDownloadFrame(Session &conn) {
+    size_t size = std::min<long>(LZ4_FRAME_BLOCK, conn.downloadRemaining);
+    const char *block;
+    if (conn.downloadFile) {
+        block = conn.downloadFile->data.get() + conn.downloadOffset;
+    } else {
+        char *buffer = conn.reactor->recvBuffer.data();
+        if (!readFully(conn.downloadFd, buffer, size, conn.downloadOffset)) {
+            LOG_ERROR("tcp", "read_failed", "error=\"%s\"", strerror(errno));
+            return false;
         }
+        block = buffer;
     }
+    lz4AppendFrame(conn.outBuf, block, size);
+    chargeBandwidth(conn, size);
+    conn.downloadOffset += size;
+    conn.downloadRemaining -= size;
+    conn.downloadSent += size;
+    return true;
+}
 
-    auto endTime = std::chrono::steady_clock::now();
-    double elapsedTime = std::chrono::duration<double>(endTime - startTime).count();
-    double speed = (totalSent / 1024.0) / elapsedTime; // KB/s
+// Тело DOWNLOAD на epoll: файл уходит через sendfile(2) прямо из page cache (файл из кэша -
+// send из памяти). Когда сокет полон или полоса исчерпана, корутина ждёт EPOLLOUT;
+// частичная запись просто сдвигает downloadOffset.
+static SessionCoroutine sendDownload(Session &conn) {
+    TransferScope scope(conn);
+    while (true) {
+        if (conn.downloadCompressed) {
+            // Сжатые кадры не отдать через sendfile: собираем порцию в outBuf и шлём её
+            while (conn.downloadRemaining > 0 && conn.outBuf.size() - conn.outOffset < TCP_OUTPUT_FLUSH &&
+                   bandwidthFor(conn, std::min<long>(LZ4_FRAME_BLOCK, conn.downloadRemaining)) > 0) {
+                if (!appendDownloadFrame(conn)) {
+                    conn.broken = true;
+                    co_return;
+                }
+            }
+            if (!flushOutput(conn, conn.downloadRemaining > 0 ? MSG_MORE : 0)) {
+                conn.broken = true;
+                co_return;
+            }
+            if (conn.downloadRemaining == 0 && conn.outBuf.empty()) break;
+            if (!conn.outBuf.empty() || conn.throttled) co_await socketReady(conn, EPOLLOUT);
+            continue;
+        }
+        // READY (и ответы перед ним) уходит с MSG_MORE и ложится в один сегмент
+        // с началом файла, а не отдельным маленьким пакетом
+        if (!flushOutput(conn, conn.downloadRemaining > 0 ? MSG_MORE : 0)) {
+            conn.broken = true;
+            co_return;
+        }
+        if (!conn.outBuf.empty()) {
+            co_await socketReady(conn, EPOLLOUT);   // заголовок READY ещё не ушёл
+            continue;
+        }
+        if (conn.downloadRemaining == 0) break;
+
+        size_t want = bandwidthFor(conn, std::min<size_t>(TCP_SENDFILE_CHUNK, conn.downloadRemaining));
+        if (want == 0) {
+            co_await socketReady(conn, EPOLLOUT);   // пауза ограничителя полосы, продолжит таймер
+            continue;
+        }
+        ssize_t sent;
+        if (conn.downloadFile) {
+            sent = send(conn.fd, conn.downloadFile->data.get() + conn.downloadOffset, want,
+                        MSG_NOSIGNAL | (conn.downloadRemaining > (long) want ? MSG_MORE : 0));
+            if (sent > 0) conn.downloadOffset += sent;
+        } else {
+            sent = sendfile(conn.fd, conn.downloadFd, &conn.downloadOffset, want);
+        }
+        if (sent > 0) {
+            conn.downloadRemaining -= sent;
+            conn.downloadSent += sent;
+            chargeBandwidth(conn, sent);
+            countMetric(Counter::TcpBytesOut, sent);
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_await socketReady(conn, EPOLLOUT);
+            continue;
+        }
+        // sent == 0: файл укоротился во время передачи - соединение уже не согласовано
+        LOG_ERROR("tcp", "sendfile_failed", "error=\"%s\"", sent == 0 ? "unexpected EOF" : strerror(errno));
+        conn.broken = true;
+        co_return;
+    }
+    finishDownload(conn);
+}
+
+static void dispatchCommand(Session &conn, std::string_view line) {
+    auto start = std::chrono::steady_clock::now();
+    ParsedCommand command = parseCommand(line);
+    LOG_DEBUG("tcp", "command", "fd=%d line=\"%.*s\"", conn.fd, static_cast<int>(std::min<size_t>(line.size(), 64)),
+              line.data());
+    switch (command.id) {
+        case CommandId::Echo:
+            handleEcho(conn, command.args);
+            break;
+        case CommandId::Time:
+            handleTime(conn);
+            break;
+        case CommandId::Upload:
+            handleUpload(conn, command.args);
+            break;
+        case CommandId::Download:
+            handleDownload(conn, command.args);
+            break;
+        case CommandId::Hash:
+            handleHash(conn, command.args);
+            break;
+        case CommandId::List:
+            handleList(conn, command.args);
+            break;
+        case CommandId::Stats:
+            sendMessage(conn, renderStats());
+            break;
+        case CommandId::Quit:
+            handleExit(conn);
+            break;
+        case CommandId::Unknown:
+            sendMessage(conn, "Unknown command\n");
+            break;
+    }
+    recordCommand(command.id, microsSince(start));
+}
+
+// Разбирает inBuf: строки команд и данные загружаемого файла
+void processInput(Session &conn) {
+    std::string_view input = conn.inBuf.view();
+    size_t pos = 0;
+    while (!conn.closing && !conn.broken && !conn.transferActive) {
+        bool transfer = conn.state == ConnState::Upload || conn.state == ConnState::Download;
+        if (transfer && !conn.reactor->uring) {
+            // epoll: тело передачи ведёт корутина, начало тела она заберёт из inBuf сама
+            conn.inBuf.consume(pos);
+            pos = 0;
+            if (conn.state == ConnState::Upload) {
+                receiveUpload(conn);
+            } else {
+                sendDownload(conn);
+            }
+            input = conn.inBuf.view();
+            continue;
+        }
+        if (conn.state == ConnState::Upload) {
+            if (pos == input.size()) break;
+            if (conn.uploadCompressed) {
+                size_t used = receiveCompressedData(conn, input.data() + pos, input.size() - pos);
+                if (used == 0) break;
+                pos += used;
+                continue;
+            }
+            pos += receiveFileData(conn, input.data() + pos, input.size() - pos);
+            continue;
+        }
+        // Во время DOWNLOAD и fsync следующие команды ждут окончания передачи
+        if (conn.state != ConnState::Command) break;
+        // Клиент не забирает ответы: остальные команды ждут, пока очередь не разойдётся
+        if (pendingOutput(conn) >= outputHighWater()) {
+            conn.readPaused = true;
+            break;
+        }
 
-    std::cout << "File sent! Speed: " << speed << " KB/s" << std::endl;
-    file.close();
+        size_t end = input.find('\n', pos);
+        if (end == std::string_view::npos) break;
+        dispatchCommand(conn, input.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    conn.inBuf.consume(pos);
 }
 
+static bool sendingFile(const Session &conn) {
+    return conn.transferActive && conn.state == ConnState::Download;
+}
 
-void handleUpload(int clientSocket, std::string command) {
-    std::istringstream iss(command);
-    std::string cmd, filename;
-    int fileSize;
-    if (!(iss >> cmd >> filename >> fileSize)) {
-        sendMessage(clientSocket, "ERROR: Invalid UPLOAD command\n");
-        return;
+// Вычитывает сокет до EAGAIN (edge-triggered). false - соединение нужно закрыть
+static bool onReadable(Session &conn) {
+    // Тело UPLOAD читает его корутина
+    while (!conn.closing && conn.state != ConnState::Upload) {
+        if (conn.state == ConnState::Command && pendingOutput(conn) >= outputHighWater()) {
+            // Клиент не читает ответы: новых команд не берём, пока очередь не разойдётся
+            if (!flushOutput(conn)) return false;
+            if (pendingOutput(conn) >= outputHighWater()) {
+                conn.readPaused = true;
+                armSessionTimer(conn);
+                return true;
+            }
+        }
+        if (conn.inBuf.size() >= SESSION_INPUT_LIMIT) {
+            if (conn.state == ConnState::Command) {
+                sendMessage(conn, "ERROR: Line too long\n");
+                conn.closing = true;
+                break;
+            }
+            // Дочитаем, когда закончится текущая передача
+            conn.readPaused = true;
+            return flushOutput(conn);
+        }
+        // Команды читаются прямо в буфер сессии, без промежуточной копии
+        char *buffer;
+        size_t room = conn.inBuf.prepare(SESSION_INPUT_LIMIT, buffer);
+
+        ssize_t bytesReceived = recv(conn.fd, buffer, room, 0);
+        if (bytesReceived == 0) {
+            flushOutput(conn);
+            return false;
+        }
+        if (bytesReceived < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        countMetric(Counter::TcpBytesIn, bytesReceived);
+        conn.inBuf.commit(bytesReceived);
+        processInput(conn);
+        if (conn.broken) return false;
+        if (conn.outBuf.size() - conn.outOffset >= TCP_OUTPUT_FLUSH && !flushOutput(conn)) return false;
     }
+    // Во время DOWNLOAD outBuf досылает его корутина, с MSG_MORE
+    return sendingFile(conn) || flushOutput(conn);
+}
 
-    // Создаем папку uploads, если её нет
-    if (!std::filesystem::exists("uploads")) {
-        std::filesystem::create_directory("uploads");
+// Досылает ответы и продолжает разбор команд, отложенных на время передачи
+static bool onWritable(Session &conn) {
+    while (!sendingFile(conn)) {
+        if (!flushOutput(conn)) return false;
+        if (conn.state != ConnState::Command || conn.inBuf.empty() || conn.closing) break;
+        size_t before = conn.inBuf.size();
+        processInput(conn);
+        if (conn.broken) return false;
+        if (conn.inBuf.size() == before && conn.state == ConnState::Command) break;
     }
+    // Чтение продолжается, когда очередь ответов ушла ниже половины high-water
+    if (conn.readPaused && conn.state == ConnState::Command && !conn.closing &&
+        pendingOutput(conn) < outputHighWater() / 2) {
+        conn.readPaused = false;
+        return onReadable(conn);
+    }
+    return true;
+}
 
-    std::string filepath = "uploads/" + filename;
-    clientUploadMode[clientSocket] = true;
-    clientFileSizes[clientSocket] = fileSize;
-    clientFileName[clientSocket] = filename;
+static void acceptClients(Reactor &reactor) {
+    while (true) {
+        NetAddress clientAddr;
+        socklen_t clientSize = sizeof(clientAddr);
+        int clientSocket = accept4(reactor.listenSocket, &clientAddr.sa, &clientSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_WARN("tcp", "accept_failed", "error=\"%s\"", strerror(errno));
+            }
+            return;
+        }
+        countMetric(Counter::TcpAccepted);
+        if (!admitConnection(clientSocket)) {
+            close(clientSocket);
+            continue;
+        }
 
-    // Проверяем текущий размер файла
-    int currentSize = 0;
-    if (std::filesystem::exists(filepath)) {
-        currentSize = std::filesystem::file_size(filepath);
+        Session *conn = reactor.sessions.acquire();
+        conn->fd = clientSocket;
+        conn->reactor = &reactor;
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, clientSocket, &ev) == -1) {
+            LOG_ERROR("tcp", "epoll_ctl_failed", "error=\"%s\"", strerror(errno));
+            close(clientSocket);
+            reactor.sessions.release(conn);
+            releaseConnection();
+            continue;
+        }
+        startSessionTimers(*conn);
+
+        char peer[INET6_ADDRSTRLEN];
+        LOG_INFO("tcp", "client_connected", "peer=%s reactor=%d", clientAddr.host(peer), reactor.id);
     }
+}
+
+static void closeConnection(Reactor &reactor, Session &conn) {
+    abandonUpload(conn, conn.uploadOffset);
+    epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    reactor.timers.cancel(conn.timer);
+    close(conn.fd);
+    reactor.sessions.release(&conn);
+    releaseConnection();
+}
+
+bool admitConnection(int fd) {
+    int open = g_openConnections.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (g_config.maxConnections <= 0 || open <= g_config.maxConnections) {
+        gaugeMetric(Gauge::TcpConnections, 1);
+        return true;
+    }
+    g_openConnections.fetch_sub(1, std::memory_order_relaxed);
+    constexpr std::string_view busy = "ERROR: Server busy\n";
+    ssize_t rc = send(fd, busy.data(), busy.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void) rc;
+    countMetric(Counter::TcpRejected);
+    LOG_WARN("tcp", "connection_rejected", "limit=%d", g_config.maxConnections);
+    return false;
+}
+
+void releaseConnection() {
+    g_openConnections.fetch_sub(1, std::memory_order_relaxed);
+    gaugeMetric(Gauge::TcpConnections, -1);
+}
 
-    sendMessage(clientSocket, "READY " + std::to_string(currentSize) + "\n");
+void updateReactorClock(Reactor &reactor) {
+    reactor.nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    reactor.nowMs = static_cast<uint64_t>(reactor.nowNs / 1000000);
+    // Пустое колесо идёт за часами: первый таймер (accept до первого runTimers) ставится
+    // от текущего тика, а не от нуля
+    reactor.timers.restart(reactor.nowMs / TIMER_TICK_MS);
 }
 
-void handleDownload(int clientSocket, std::string command){
-    std::istringstream iss(command);
-    std::string cmd, filename;
+// Тик, не раньше которого наступит момент ms
+static uint64_t tickAt(uint64_t ms) {
+    return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
 
-    int offset = 0;
+int timerWaitMs(const Reactor &reactor, int limit) {
+    if (reactor.draining) limit = std::min(limit, DRAIN_CHECK_MS);
+    uint64_t tick = reactor.timers.nextTick();
+    if (tick == UINT64_MAX) return limit;
+    uint64_t at = tick * TIMER_TICK_MS;
+    if (at <= reactor.nowMs) return 0;
+    return static_cast<int>(std::min<uint64_t>(at - reactor.nowMs, limit));
+}
+
+// Сколько соединение может не подавать признаков жизни в текущем состоянии, мс; 0 - сколько угодно
+static uint64_t sessionTimeoutMs(const Session &conn) {
+    int seconds = 0;
+    switch (conn.state) {
+        case ConnState::Command:
+            seconds = pendingOutput(conn) > 0 ? g_config.writeTimeout : g_config.idleTimeout;
+            break;
+        case ConnState::Upload:
+            seconds = g_config.readTimeout;
+            break;
+        case ConnState::Download:
+            seconds = g_config.writeTimeout;
+            break;
+        case ConnState::Syncing:
+        case ConnState::Hashing:
+            break;   // ждём собственный пул, клиент ни при чём
+    }
+    return seconds > 0 ? static_cast<uint64_t>(seconds) * 1000 : 0;
+}
 
-    if(!(iss >> cmd >> filename)) {
-        const char errorMSG[] = "usage: DOWNLOAD <filename>\n";
-        send(clientSocket, errorMSG, sizeof(errorMSG), 0);
+// Шаг перепроверки соединений, ждущих пул: кратчайший из включённых таймаутов
+static uint64_t recheckMs() {
+    uint64_t shortest = 0;
+    for (int seconds : {g_config.idleTimeout, g_config.readTimeout, g_config.writeTimeout}) {
+        if (seconds > 0 && (shortest == 0 || static_cast<uint64_t>(seconds) * 1000 < shortest)) {
+            shortest = static_cast<uint64_t>(seconds) * 1000;
+        }
+    }
+    return shortest;
+}
+
+void startSessionTimers(Session &conn) {
+    conn.timer.owner = &conn;
+    conn.lastActivity = conn.reactor->nowMs;
+    conn.bandwidth.configure(static_cast<uint64_t>(std::max(0, g_config.rateLimitKB)) * 1024);
+    armSessionTimer(conn);
+}
+
+// Таймер не двигается на каждом recv: он стоит на сроке по lastActivity на момент постановки,
+// а сработав, сверяется с lastActivity и при необходимости встаёт заново
+void armSessionTimer(Session &conn) {
+    if (conn.throttled) return;
+    Reactor &reactor = *conn.reactor;
+    uint64_t timeout = sessionTimeoutMs(conn);
+    uint64_t deadline = conn.lastActivity + timeout;
+    if (timeout == 0) {
+        timeout = recheckMs();
+        deadline = reactor.nowMs + timeout;
+    }
+    if (timeout == 0) {
+        reactor.timers.cancel(conn.timer);
         return;
     }
+    reactor.timers.schedule(conn.timer, tickAt(deadline));
+}
 
-    if (!(iss >> offset)) {
-        offset = 0;
+size_t bandwidthFor(Session &conn, size_t want) {
+    if (!conn.bandwidth.limited() && !g_globalBandwidth.limited()) return want;
+    if (conn.throttled) return 0;
+    int64_t now = conn.reactor->nowNs;
+    size_t allowed = std::min(conn.bandwidth.available(want, now), g_globalBandwidth.available(want, now));
+    if (allowed > 0) return allowed;
+
+    int64_t wait = std::max(conn.bandwidth.waitNanos(want, now), g_globalBandwidth.waitNanos(want, now));
+    conn.throttled = true;
+    countMetric(Counter::TcpThrottled);
+    conn.reactor->timers.schedule(conn.timer, tickAt(static_cast<uint64_t>((now + wait) / 1000000)) + 1);
+    return 0;
+}
+
+void chargeBandwidth(Session &conn, size_t bytes) {
+    conn.bandwidth.consume(bytes, conn.reactor->nowNs);
+    g_globalBandwidth.consume(bytes, conn.reactor->nowNs);
+}
+
+static const char *timeoutReason(const Session &conn) {
+    if (conn.state == ConnState::Upload) return "read";
+    if (conn.state == ConnState::Download || pendingOutput(conn) > 0) return "write";
+    return "idle";
+}
+
+static void expireConnection(Reactor &reactor, Session &conn) {
+    const char *reason = timeoutReason(conn);
+    LOG_INFO("tcp", "timeout", "fd=%d reason=%s silent_ms=%" PRIu64, conn.fd, reason,
+             reactor.nowMs - conn.lastActivity);
+    countMetric(Counter::TcpTimeouts);
+    if (reason[0] == 'i') {
+        // Простаивающему клиенту - объяснение; зависшему на передаче писать бесполезно
+        constexpr std::string_view idle = "ERROR: Idle timeout\n";
+        ssize_t rc = send(conn.fd, idle.data(), idle.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        (void) rc;
+    }
+    if (reactor.uring) {
+        uringClose(conn);
+    } else {
+        closeConnection(reactor, conn);
     }
+}
 
-    std::cout << "Download requested: " << filename << std::endl;
-    //TODO: Make absolute path for files (or idk)
-    std::string serverFilePath = "uploads/" + filename;
-    sendFile(clientSocket, serverFilePath, offset);
+void runTimers(Reactor &reactor) {
+    reactor.timers.advance(reactor.nowMs / TIMER_TICK_MS, [&reactor](TimerNode &node) {
+        Session &conn = *static_cast<Session *>(node.owner);
+        if (conn.throttled) {
+            // Пауза ограничителя полосы не считается молчанием клиента
+            conn.throttled = false;
+            conn.lastActivity = reactor.nowMs;
+            armSessionTimer(conn);
+            if (reactor.uring) {
+                uringResume(conn);
+            } else {
+                serviceConnection(reactor, conn, EPOLLIN | EPOLLOUT);
+            }
+            return;
+        }
+        uint64_t timeout = sessionTimeoutMs(conn);
+        if (timeout == 0 || reactor.nowMs < conn.lastActivity + timeout) {
+            armSessionTimer(conn);
+            return;
+        }
+        expireConnection(reactor, conn);
+    });
 }
 
-void receiveFileData(int clientSocket, const char* data, int size) {
-    std::string filepath = "uploads/" + clientFileName[clientSocket];
-    std::ofstream file(filepath, std::ios::binary | std::ios::app);
+void beginDrain(Reactor &reactor) {
+    reactor.draining = true;
+    // Без преемника очередь accept сбрасывается сразу: ждущие в ней клиенты получат отказ
+    // сейчас, а не после срока. Общий сокет закрывает первый реактор, остальным - ENOTCONN.
+    if (retireListeners()) shutdown(reactor.listenSocket, SHUT_RD);
+    LOG_INFO("tcp", "drain_started", "reactor=%d sessions=%zu handoff=%d", reactor.id,
+             reactor.sessions.liveSessions(), listenersHandedOff());
+}
 
-    if (!file) {
-        std::cerr << "Error opening file: " << filepath << std::endl;
-        sendMessage(clientSocket, "ERROR: Could not open file\n");
-        return;
+// Между командами, ответы отправлены, в буфере ничего не ждёт
+static bool sessionIdle(const Reactor &reactor, const Session &conn) {
+    return conn.state == ConnState::Command && !conn.closing && !conn.throttled && conn.inBuf.empty() &&
+           pendingOutput(conn) == 0 && reactor.nowMs >= conn.lastActivity + DRAIN_IDLE_MS;
+}
+
+bool drainReactor(Reactor &reactor, void (*closeSession)(Reactor &, Session &)) {
+    if (reactor.nowMs < reactor.drainCheckAt) return true;
+    reactor.drainCheckAt = reactor.nowMs + DRAIN_CHECK_MS;
+    if (reactor.nowMs >= drainDeadlineMs()) {
+        LOG_WARN("tcp", "drain_timeout", "reactor=%d sessions=%zu", reactor.id, reactor.sessions.liveSessions());
+        return false;
     }
+    reactor.sessions.forEachLive([&reactor, closeSession](Session &conn) {
+        if (sessionIdle(reactor, conn)) closeSession(reactor, conn);
+    });
+    if (reactor.sessions.liveSessions() > 0) return true;
+    LOG_INFO("tcp", "drain_complete", "reactor=%d", reactor.id);
+    return false;
+}
 
-    file.write(data, size);
-    bytesReceivedMap[clientSocket] += size;
+int reactorCpu(int id) {
+    if (!g_config.cpus.empty()) return g_config.cpus[id % g_config.cpus.size()];
+    return static_cast<int>(id % std::max(1u, std::thread::hardware_concurrency()));
+}
 
-    if (bytesReceivedMap[clientSocket] >= clientFileSizes[clientSocket]) {
-        clientUploadMode[clientSocket] = false;
-        sendMessage(clientSocket, "File upload complete.\n");
-        bytesReceivedMap.erase(clientSocket);
+void pinCurrentThread(int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0) {
+        LOG_WARN("tcp", "pin_failed", "cpu=%d error=\"%s\"", cpu, strerror(rc));
     }
 }
 
-void handleClient(int clientSocket) {
-    char buffer[BUFFER_SIZE];
-    std::string receivedData;
-    clientUploadMode[clientSocket] = false;
-    while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytesReceived <= 0) break;
+// Обрабатывает события соединения и закрывает его, если оно больше не нужно
+static void serviceConnection(Reactor &reactor, Session &conn, uint32_t events) {
+    conn.lastActivity = reactor.nowMs;
+    // Корутина передачи ждала этого события (обрыв её тоже будит: пусть увидит ошибку сама)
+    if (conn.transferWaiter && (events & (conn.transferEvents | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        std::exchange(conn.transferWaiter, nullptr).resume();
+    }
+    bool alive = !conn.broken;
+    if (alive && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        alive = onReadable(conn);
+    }
+    if (alive && (events & EPOLLOUT)) {
+        alive = onWritable(conn);
+    }
+    // QUIT закрывает соединение, как только ответы отправлены
+    if (alive && conn.closing && conn.outBuf.empty()) {
+        alive = false;
+    }
+    if (!alive) {
+        closeConnection(reactor, conn);
+    }
+}
 
-        if (clientUploadMode[clientSocket]) {
-            receiveFileData(clientSocket, buffer, bytesReceived);
-            continue;
-        }
+void runMailboxTasks(Reactor &reactor) {
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(reactor.mailboxMutex);
+        tasks.swap(reactor.mailbox);
+    }
+    for (auto &task : tasks) {
+        task();
+    }
+}
 
-        receivedData.append(buffer, bytesReceived);
+static void runMailbox(Reactor &reactor) {
+    uint64_t counter;
+    ssize_t rc = read(reactor.eventFd, &counter, sizeof(counter));
+    (void) rc;
+    runMailboxTasks(reactor);
+}
 
+static void runReactor(Reactor &reactor) {
+    if (g_config.pinReactors) {
+        pinCurrentThread(reactorCpu(reactor.id));
+    }
+    epoll_event events[MAX_EVENTS];
+    updateReactorClock(reactor);
 
-        size_t pos;
-        while ((pos = receivedData.find('\n')) != std::string::npos) {
-            std::string command = receivedData.substr(0, pos);
-            receivedData.erase(0, pos + 1);
+    while (!g_shutdown) {
+        if (g_draining) {
+            if (!reactor.draining) {
+                epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, reactor.listenSocket, nullptr);
+                beginDrain(reactor);
+            }
+            if (!drainReactor(reactor, closeConnection)) break;
+        }
+        int n = epoll_wait(reactor.epfd, events, MAX_EVENTS, timerWaitMs(reactor, 1000));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("tcp", "epoll_wait_failed", "error=\"%s\"", strerror(errno));
+            break;
+        }
+        updateReactorClock(reactor);
+        runTimers(reactor);
 
-            if (!command.empty() && command.back() == '\r') {
-                command.pop_back();
+        for (int i = 0; i < n; ++i) {
+            void *tag = events[i].data.ptr;
+            if (tag == &LISTEN_TAG) {
+                acceptClients(reactor);
+            } else if (tag == &MAILBOX_TAG) {
+                runMailbox(reactor);
+            } else {
+                Session *conn = static_cast<Session *>(tag);
+                // Сессия могла закрыться раньше в этой же пачке событий
+                if (conn->inUse) serviceConnection(reactor, *conn, events[i].events);
             }
-            std::cout << "Received: " << command << std::endl;
-
-            if (command.rfind("ECHO ", 0) == 0) {
-                handleEcho(clientSocket, command);
-            } else if (command == "TIME") {
-                handleTime(clientSocket);
-            } else if (command.rfind("UPLOAD", 0) == 0) {
-                handleUpload(clientSocket, command);
-            } else if (command.rfind("DOWNLOAD", 0) == 0) {
-                handleDownload(clientSocket, command);
-            } else if (command == "CLOSE" || command == "EXIT" || command == "QUIT") {
-                handleExit(clientSocket);
-                return;
+        }
+    }
+
+    reactor.sessions.forEachLive([&reactor](Session &conn) {
+        reactor.timers.cancel(conn.timer);
+        close(conn.fd);
+        reactor.sessions.release(&conn);
+        releaseConnection();
+    });
+}
+
+SOCKET createTcpSocket() {
+    NetAddress address;
+    NetAddress::parse(g_config.tcpBind, static_cast<uint16_t>(g_config.tcpPort), address);
+    return socket(address.family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+// Опции, которые accept передаёт принятым соединениям: ставятся один раз на слушающий сокет.
+// Буферы - до listen, иначе окно уже согласовано без масштаба под них.
+static void setListenerOptions(SOCKET sock) {
+    int one = 1;
+    if (g_config.tcpNoDelay) setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (g_config.tcpRcvBufKB > 0) {
+        int bytes = g_config.tcpRcvBufKB * 1024;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    }
+    if (g_config.tcpSndBufKB > 0) {
+        int bytes = g_config.tcpSndBufKB * 1024;
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+    }
+    // Больше net.core.busy_read без CAP_NET_ADMIN не дадут
+    if (g_config.busyPollUs > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &g_config.busyPollUs, sizeof(g_config.busyPollUs)) == -1) {
+        LOG_WARN("tcp", "busy_poll_failed", "us=%d error=\"%s\"", g_config.busyPollUs, strerror(errno));
+    }
+}
+
+// bind + listen с SO_REUSEPORT: каждый реактор получает свою очередь accept в ядре
+static bool openListener(SOCKET sock) {
+    NetAddress serverAddr;
+    NetAddress::parse(g_config.tcpBind, static_cast<uint16_t>(g_config.tcpPort), serverAddr);
+    // "::" принимает и IPv4 (dual-stack), даже если net.ipv6.bindv6only включён
+    int v6only = 0;
+    if (serverAddr.family() == AF_INET6) setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    setListenerOptions(sock);
+
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (g_config.reusePort &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+        LOG_ERROR("tcp", "reuseport_failed", "error=\"%s\"", strerror(errno));
+        return false;
+    }
+
+    if (bind(sock, &serverAddr.sa, serverAddr.length()) == -1) {
+        LOG_ERROR("tcp", "bind_failed", "address=%s port=%d error=\"%s\"", g_config.tcpBind.c_str(), g_config.tcpPort,
+                  strerror(errno));
+        return false;
+    }
+
+    if (listen(sock, g_config.listenBacklog) == -1) {
+        LOG_ERROR("tcp", "listen_failed", "error=\"%s\"", strerror(errno));
+        return false;
+    }
+    return setNonBlocking(sock);
+}
+
+// Закрывает дескрипторы реакторов на любом выходе из handleTCPServer. Объявлен до пула и
+// срабатывает после него: задачи, которые пул доделывает в деструкторе, пишут в eventfd реакторов
+struct ReactorDescriptors {
+    std::vector<Reactor> &reactors;
+
+    ~ReactorDescriptors() {
+        for (Reactor &reactor : reactors) {
+            if (reactor.ownsListenSocket && reactor.listenSocket != INVALID_SOCKET) close(reactor.listenSocket);
+            if (reactor.eventFd != -1) close(reactor.eventFd);
+            if (reactor.uring) destroyUringReactor(reactor);
+            if (reactor.epfd != -1) close(reactor.epfd);
+        }
+    }
+};
+
+// serverSocket принадлежит вызывающему и закрывается им, в том числе при ошибке
+int handleTCPServer(SOCKET serverSocket){
+    int reactorCount = g_config.reactors > 0 ? g_config.reactors
+                                             : std::max(1u, std::thread::hardware_concurrency());
+    // Сокеты предшественника уже слушают: режим SO_REUSEPORT берётся у них, а реакторов не
+    // меньше, чем сокетов - очередь лишнего сокета было бы некому разбирать
+    auto inherited = static_cast<int>(inheritedListeners(ListenerKind::Tcp));
+    if (inherited > 0) {
+        int reuse = 0;
+        socklen_t length = sizeof(reuse);
+        getsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, &length);
+        g_config.reusePort = reuse != 0;
+        if (g_config.reusePort) reactorCount = std::max(reactorCount, inherited);
+    }
+    g_globalBandwidth.configure(static_cast<uint64_t>(std::max(0, g_config.globalRateLimitKB)) * 1024);
+    std::vector<Reactor> reactors(reactorCount);
+    ReactorDescriptors descriptors{reactors};
+    // Пул объявлен после реакторов: при выходе он завершается первым
+    ThreadPool diskPool(std::max(1, g_config.diskThreads));
+    FileCacheLoader cacheLoader(diskPool);
+    // Снимается раньше, чем разрушится пул
+    MetricSource diskQueue("disk_queue_depth", "Tasks waiting in the disk thread pool",
+                           [&diskPool] { return static_cast<double>(diskPool.pending()); });
+
+    for (int i = 0; i < reactorCount; ++i) {
+        Reactor &reactor = reactors[i];
+        reactor.id = i;
+        reactor.diskPool = &diskPool;
+        // Не меньше блока LZ4: буфер служит и местом распаковки и чтения блоков сжатой отдачи
+        reactor.recvBuffer.resize(std::max<size_t>(static_cast<size_t>(g_config.recvBufferKB) * 1024, LZ4_FRAME_BLOCK));
+        // Реактор, которому не досталось io_uring, работает на epoll
+        if (g_config.ioUring && !initUringReactor(reactor)) {
+            LOG_WARN("tcp", "uring_unavailable", "reactor=%d fallback=epoll", i);
+        }
+        // io_uring читает eventfd своим SQE и ждёт его сам, поэтому без EFD_NONBLOCK
+        reactor.eventFd = eventfd(0, EFD_CLOEXEC | (reactor.uring ? 0 : EFD_NONBLOCK));
+        if (!reactor.uring) reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+        if ((!reactor.uring && reactor.epfd == -1) || reactor.eventFd == -1) {
+            LOG_ERROR("tcp", "epoll_create_failed", "error=\"%s\"", strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        uint32_t listenEvents = EPOLLIN | EPOLLET;
+        if (i == 0) {
+            reactor.listenSocket = serverSocket;
+            reactor.ownsListenSocket = false;
+            if (inherited == 0 && !openListener(serverSocket)) return EXIT_FAILURE;
+            publishListener(ListenerKind::Tcp, serverSocket);
+        } else if (g_config.reusePort) {
+            if (i < inherited) {
+                reactor.listenSocket = inheritedListener(ListenerKind::Tcp, i);
             } else {
-                sendMessage(clientSocket, "Unknown command\n");
+                reactor.listenSocket = createTcpSocket();
+                if (reactor.listenSocket == INVALID_SOCKET || !openListener(reactor.listenSocket)) {
+                    return EXIT_FAILURE;
+                }
             }
+            publishListener(ListenerKind::Tcp, reactor.listenSocket);
+        } else {
+            // Общий сокет: EPOLLEXCLUSIVE будит только один реактор на входящее соединение
+            reactor.listenSocket = serverSocket;
+            reactor.ownsListenSocket = false;
         }
+        if (reactor.uring) continue;   // accept идёт через SQE, epoll не нужен
+        if (!g_config.reusePort) listenEvents = EPOLLIN | EPOLLEXCLUSIVE;
+
+        epoll_event listenEv{};
+        listenEv.events = listenEvents;
+        listenEv.data.ptr = &LISTEN_TAG;
+        epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.listenSocket, &listenEv);
+
+        epoll_event mailboxEv{};
+        mailboxEv.events = EPOLLIN;
+        mailboxEv.data.ptr = &MAILBOX_TAG;
+        epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.eventFd, &mailboxEv);
     }
-    clientUploadMode.erase(clientSocket);
-    clientFileSizes.erase(clientSocket);
-    clientFileName.erase(clientSocket);
-}
\ No newline at end of file
+
+    LOG_INFO("tcp", "listening", "address=%s port=%d reactors=%d reuseport=%d engine=%s inherited=%d",
+             g_config.tcpBind.c_str(), g_config.tcpPort, reactorCount, g_config.reusePort,
+             reactors[0].uring ? "io_uring" : "epoll", inherited);
+    if (reactors[0].uring) LOG_INFO("tcp", "uring_features", "features=\"%s\"", uringFeatures(reactors[0]));
+    LOG_INFO("tcp", "session_layout", "session_bytes=%zu input_limit_kb=%zu", sizeof(Session),
+             SESSION_INPUT_LIMIT / 1024);
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < reactorCount; ++i) {
+        threads.emplace_back(reactors[i].uring ? runUringReactor : runReactor, std::ref(reactors[i]));
+    }
+    if (reactors[0].uring) {
+        runUringReactor(reactors[0]);
+    } else {
+        runReactor(reactors[0]);
+    }
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    FileCache::Stats cache = fileCache().stats();
+    LOG_INFO("tcp", "file_cache", "hits=%" PRIu64 " misses=%" PRIu64 " files=%zu kb=%zu", cache.hits, cache.misses,
+             cache.entries, cache.bytes / 1024);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+#ifndef TCP_SERVER_TIMER_WHEEL_H
+#define TCP_SERVER_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Узел таймера, встроенный во владельца: постановка и снятие - O(1), без выделений
+struct TimerNode {
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0;   // тик срабатывания
+    void *owner = nullptr;
+
+    bool linked() const { return next != nullptr; }
+
+    void unlink() {
+        if (!next) return;
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+};
+
+// Иерархическое колесо таймеров (Varghese и Lauck): 4 уровня по 64 слота. Нижний уровень -
+// по тику, каждый следующий в 64 раза грубее; когда нижний уровень проходит круг, слот
+// уровня выше раскладывается вниз. С тиком 10 мс колесо покрывает ~45 часов.
+class TimerWheel {
+    static constexpr int LEVELS = 4;
+    static constexpr int BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << BITS;
+    static constexpr uint64_t MASK = SLOTS - 1;
+    // Дальше верхний уровень начал бы путать свой текущий круг со следующим
+    static constexpr uint64_t MAX_DELTA = MASK << ((LEVELS - 1) * BITS);
+
+    TimerNode slots[LEVELS][SLOTS];   // головы кольцевых списков
+    uint64_t current = 0;             // последний обработанный тик
+    size_t pending = 0;
+
+    static bool empty(const TimerNode &head) { return head.next == &head; }
+
+    // earliest - самый ранний допустимый тик: следующий, а при раскладке - и текущий,
+    // слот которого будет обработан сразу после неё
+    void place(TimerNode &node, uint64_t earliest) {
+        uint64_t expires = std::max(node.expires, earliest);
+        if (expires - current > MAX_DELTA) expires = current + MAX_DELTA;
+        // Уровень - старшая группа бит, в которой срок расходится с текущим тиком: слот
+        // на нём ещё впереди и будет разложен вниз ровно тогда, когда совпадут старшие биты
+        uint64_t differ = expires ^ current;
+        int level = 0;
+        while (level < LEVELS - 1 && (differ >> ((level + 1) * BITS)) != 0) ++level;
+        TimerNode &head = slots[level][(expires >> (level * BITS)) & MASK];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    // Переносит узлы слота уровня level на уровни ниже
+    void cascade(int level) {
+        TimerNode &head = slots[level][(current >> (level * BITS)) & MASK];
+        while (!empty(head)) {
+            TimerNode &node = *head.next;
+            node.unlink();
+            place(node, current);
+        }
+    }
+
+public:
+    explicit TimerWheel(uint64_t now = 0) : current(now) {
+        for (auto &level : slots) {
+            for (TimerNode &head : level) head.prev = head.next = &head;
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Переставляет узел, если он уже стоял; срок в прошлом - сработает на следующем тике
+    void schedule(TimerNode &node, uint64_t expires) {
+        if (node.linked()) {
+            node.unlink();
+            --pending;
+        }
+        node.expires = expires;
+        place(node, current + 1);
+        ++pending;
+    }
+
+    void cancel(TimerNode &node) {
+        if (!node.linked()) return;
+        node.unlink();
+        --pending;
+    }
+
+    size_t size() const { return pending; }
+    uint64_t now() const { return current; }
+
+    // Колесо без таймеров переносится на тик now: иначе первый advance шёл бы от нуля
+    void restart(uint64_t now) {
+        if (pending == 0) current = now;
+    }
+
+    // Ближайший тик, на котором колесу есть что делать: срабатывание на нижнем уровне
+    // или раскладка непустого слота уровня выше. UINT64_MAX - таймеров нет.
+    uint64_t nextTick() const {
+        if (pending == 0) return UINT64_MAX;
+        // Узлы уровня лежат впереди текущего слота в пределах круга уровня выше, поэтому
+        // первый непустой слот нижнего уровня всегда раньше любого слота верхнего
+        for (int level = 0; level < LEVELS; ++level) {
+            int shift = level * BITS;
+            uint64_t index = (current >> shift) & MASK;
+            uint64_t base = (current >> shift) - index;
+            // Верхнему уровню круга выше нет: его слоты идут по кольцу
+            uint64_t last = level == LEVELS - 1 ? index + MASK : MASK;
+            for (uint64_t i = index + 1; i <= last; ++i) {
+                if (!empty(slots[level][i & MASK])) return (base + i) << shift;
+            }
+        }
+        return UINT64_MAX;
+    }
+
+    // Проходит тики до now включительно; fire(node) получает уже снятый узел и может
+    // поставить его снова. Пустые тики пропускаются целиком, до ближайшего из nextTick.
+    template<class Fire>
+    void advance(uint64_t now, Fire &&fire) {
+        while (current < now) {
+            if (pending == 0) {
+                current = now;
+                break;
+            }
+            current = std::min(nextTick(), now);
+            for (int level = LEVELS - 1; level > 0; --level) {
+                // Раскладка сверху вниз: слот уровня level начинается ровно на этом тике
+                if ((current & ((uint64_t(1) << (level * BITS)) - 1)) == 0) cascade(level);
+            }
+            TimerNode &head = slots[0][current & MASK];
+            while (!empty(head)) {
+                TimerNode &node = *head.next;
+                node.unlink();
+                --pending;
+                fire(node);
+            }
+        }
+    }
+};
+
+#endif//TCP_SERVER_TIMER_WHEEL_H
@@ -0,0 +1,66 @@
+#ifndef TCP_SERVER_TOKEN_BUCKET_H
+#define TCP_SERVER_TOKEN_BUCKET_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Ограничитель полосы в форме GCRA: вместо счётчика жетонов хранится одно число -
+// момент, к которому полоса "оплачена" (tat, нс). Выдача n байт сдвигает его на n/rate,
+// запас на всплеск - burst байт. Одно атомарное слово, поэтому общий ограничитель
+// разделяют все реакторы без блокировок.
+class TokenBucket {
+public:
+    // Меньше этого не выдаётся (если просили больше): без россыпи крошечных send
+    static constexpr size_t MIN_GRANT = 16 * 1024;
+
+    // bytesPerSecond == 0 - без ограничения
+    void configure(uint64_t bytesPerSecond) {
+        rate = bytesPerSecond;
+        // Всплеск - 100 мс полосы, но не меньше 64 КБ
+        burst = std::max<uint64_t>(bytesPerSecond / 10, 64 * 1024);
+        tat.store(0, std::memory_order_relaxed);
+    }
+
+    bool limited() const { return rate != 0; }
+
+    void reset() { tat.store(0, std::memory_order_relaxed); }
+
+    // Сколько байт из want можно пропустить сейчас (не списывая)
+    size_t available(size_t want, int64_t nowNs) const {
+        if (!limited()) return want;
+        int64_t paid = std::max(tat.load(std::memory_order_relaxed), nowNs);
+        int64_t headroom = nanosFor(burst) - (paid - nowNs);
+        if (headroom <= 0) return 0;
+        size_t bytes = static_cast<size_t>(static_cast<double>(headroom) * rate / 1e9);
+        bytes = std::min(bytes, want);
+        return bytes < std::min(want, MIN_GRANT) ? 0 : bytes;
+    }
+
+    // Списывает bytes; перерасход (гонка между реакторами) уходит в долг и гасится ожиданием
+    void consume(size_t bytes, int64_t nowNs) {
+        if (!limited() || bytes == 0) return;
+        int64_t cost = nanosFor(bytes);
+        int64_t expected = tat.load(std::memory_order_relaxed);
+        while (!tat.compare_exchange_weak(expected, std::max(expected, nowNs) + cost, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Через сколько наносекунд станет доступно min(want, MIN_GRANT) байт
+    int64_t waitNanos(size_t want, int64_t nowNs) const {
+        if (!limited()) return 0;
+        int64_t need = nanosFor(std::min(want, MIN_GRANT));
+        int64_t paid = std::max(tat.load(std::memory_order_relaxed), nowNs);
+        return std::max<int64_t>(0, paid + need - nanosFor(burst) - nowNs);
+    }
+
+private:
+    int64_t nanosFor(uint64_t bytes) const { return static_cast<int64_t>(static_cast<double>(bytes) * 1e9 / rate); }
+
+    uint64_t rate = 0;
+    uint64_t burst = 0;
+    std::atomic<int64_t> tat{0};
+};
+
+#endif//TCP_SERVER_TOKEN_BUCKET_H
@@ -1,271 +1,568 @@
 #include "../libs.h"
+#include "lifecycle.h"
+#include "logger.h"
+#include "lz4.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "storage.h"
+#include "udp_transfer.h"
+#include <cerrno>
+#include <cinttypes>
 #include <filesystem>
+#include <memory>
+#include <poll.h>
+#include <queue>
+
+// Сколько сессия живёт после завершения: повторно подтверждает END и гасит
+// запоздавшие ACK/пакеты, чтобы они не попали в разбор команд
+constexpr auto UDP_LINGER = std::chrono::seconds(5);
+// Сколько пачек recvmmsg разбирается подряд, прежде чем проверить таймеры
+constexpr int UDP_RX_ROUNDS = 8;
+// Предел байт в полёте: с крупными пакетами окно в пакетах иначе переполнит приёмный буфер клиента
+constexpr uint32_t UDP_MAX_INFLIGHT = 1024 * 1024;
+// Заголовки IP и UDP, которые вычитаются из MTU пути
+constexpr int UDP_IPV4_OVERHEAD = 20 + 8;
+constexpr int UDP_IPV6_OVERHEAD = 40 + 8;
+
+// Клиент - адрес и порт отправителя. IPv4 хранится отображённым в IPv6, так что
+// клиент на сокете dual-stack и на сокете IPv4 даёт один и тот же ключ.
+struct PeerKey {
+    uint64_t high = 0;
+    uint64_t low = 0;
+    uint16_t port = 0;
+
+    auto operator<=>(const PeerKey &) const = default;
+};
+
+struct PeerKeyHash {
+    size_t operator()(const PeerKey &key) const {
+        return std::hash<uint64_t>()(key.high * 0x9E3779B97F4A7C15ull ^ key.low ^ (uint64_t(key.port) << 48));
+    }
+};
+
+// Передача одного клиента. Клиент определяется адресом и портом отправителя
+struct UdpSession {
+    UdpPeer peer;
+    std::string filename;
+    std::string path;
+    int fd = -1;
+    uint64_t fileSize = 0;
+    std::unique_ptr<UdpSender> sender;      // UDP_DOWNLOAD
+    std::unique_ptr<UdpReceiver> receiver;  // UDP_UPLOAD
+    UdpClock::time_point transferStart;
+    bool lingering = false;
+    UdpClock::time_point lingerUntil;
+    // Срок, на который в куче таймеров стоит актуальная запись
+    UdpClock::time_point scheduled = UdpClock::time_point::max();
+
+    ~UdpSession() {
+        if (fd != -1) close(fd);
+    }
+};
 
-struct UDPPacket {
-    uint32_t seq;
-    uint16_t length;
-    char data[BUFFER_SIZE];
+// Все UDP-передачи обслуживаются одним потоком на одном сокете: датаграммы
+// разбираются по адресу отправителя, повторы и простои - по куче таймеров
+struct UdpEngine {
+    SOCKET sock;
+    UdpTxBatch tx;
+    UdpRxBatch rx;
+    std::unordered_map<PeerKey, std::unique_ptr<UdpSession>, PeerKeyHash> sessions;
+    using Timer = std::pair<UdpClock::time_point, PeerKey>;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+    // Получатели, которым после разбора пачки нужно отправить ACK
+    std::vector<PeerKey> pendingAcks;
+    bool draining = false;
+
+    UdpEngine(SOCKET sock, bool offload) : sock(sock), tx(sock, offload), rx(sock, offload) {}
 };
 
-void sendUDPMessage(SOCKET sock, const sockaddr_in &addr, const std::string &msg) {
-    sendto(sock, msg.c_str(), msg.size(), 0,
-           (sockaddr *) &addr, sizeof(addr));
+static void sendUDPMessage(UdpEngine &engine, const NetAddress &addr, const std::string &msg) {
+    engine.tx.send(addr, msg.data(), msg.size());
 }
 
-void handleUDPDownload(SOCKET sock, const sockaddr_in &clientAddr, const std::string &filename) {
-    std::ifstream file("uploads/" + filename, std::ios::binary | std::ios::ate);
-    if (!file) {
-        sendUDPMessage(sock, clientAddr, "ERROR: File not found\n");
-        return;
+static PeerKey peerKey(const NetAddress &addr) {
+    unsigned char bytes[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    in_addr addr4;
+    if (addr.ipv4(addr4)) {
+        memcpy(bytes + 12, &addr4, sizeof(addr4));
+    } else {
+        memcpy(bytes, &addr.v6.sin6_addr, sizeof(bytes));
     }
+    PeerKey key;
+    memcpy(&key.high, bytes, sizeof(key.high));
+    memcpy(&key.low, bytes + 8, sizeof(key.low));
+    key.port = addr.port();
+    return key;
+}
 
-    uint32_t fileSize = file.tellg();
-    file.seekg(0);
-    sendUDPMessage(sock, clientAddr, "READY " + std::to_string(fileSize) + "\n");
-
-    char buffer[BUFFER_SIZE];
-    const int maxRetries = 5;
-    uint32_t expectedSeq = 0;
-
-    while (file.read(buffer, BUFFER_SIZE) || file.gcount() > 0) {
-        int chunkSize = file.gcount();
-        UDPPacket packet;
-        packet.seq = htonl(expectedSeq);
-        packet.length = htons(static_cast<uint16_t>(chunkSize));
-        memcpy(packet.data, buffer, chunkSize);
-
-        bool ackReceived = false;
-        for (int attempt = 0; attempt < maxRetries && !ackReceived; ++attempt) {
-            sendto(sock, (char *) &packet, sizeof(packet.seq) + sizeof(packet.length) + chunkSize,
-                   0, (sockaddr *) &clientAddr, sizeof(clientAddr));
-
-            fd_set readSet;
-            FD_ZERO(&readSet);
-            FD_SET(sock, &readSet);
-            timeval timeout{2, 0};
-
-            if (select(0, &readSet, nullptr, nullptr, &timeout) > 0) {
-                char ackBuffer[BUFFER_SIZE];
-                sockaddr_in ackAddr;
-                socklen_t addrLen = sizeof(ackAddr);
-                int bytes = recvfrom(sock, ackBuffer, BUFFER_SIZE, 0, (sockaddr *) &ackAddr, &addrLen);
-
-                if (bytes > 0 && ackAddr.sin_addr.s_addr == clientAddr.sin_addr.s_addr && ackAddr.sin_port == clientAddr.sin_port) {
-                    std::string ack(ackBuffer, bytes);
-                    ack = ack.substr(0, ack.find_last_not_of("\r\n") + 1);
-
-                    if (ack.substr(0, 4) == "ACK ") {
-                        try {
-                            uint32_t ackSeq = std::stoul(ack.substr(4));
-                            if (ackSeq == expectedSeq) {
-                                ackReceived = true;
-                                expectedSeq++;
-                            }
-                        } catch (...) {
-                            // Ошибка парсинга номера ACK
-                        }
-                    }
-                }
-            }
+// Отрезает необязательный последний аргумент "PAYLOAD=<n>" - предложение клиента
+// по размеру пакета. 0 - клиент не согласует размер.
+static uint32_t takePayloadHint(std::string &args) {
+    args.erase(args.find_last_not_of(" \n\r\t") + 1);
+    size_t space = args.rfind(' ');
+    if (space == std::string::npos || args.compare(space + 1, 8, "PAYLOAD=") != 0) return 0;
+    unsigned long hint = std::strtoul(args.c_str() + space + 9, nullptr, 10);
+    args.erase(space);
+    return static_cast<uint32_t>(std::min<unsigned long>(hint, UDP_MAX_PAYLOAD));
+}
+
+// Отрезает необязательный последний аргумент "LZ4" - просьбу сжимать пакеты
+static bool takeCompressFlag(std::string &args) {
+    args.erase(args.find_last_not_of(" \n\r\t") + 1);
+    size_t space = args.rfind(' ');
+    if (space == std::string::npos || args.compare(space + 1, std::string::npos, "LZ4") != 0) return false;
+    args.erase(space);
+    return true;
+}
+
+// Сколько данных помещается в пакет до клиента без фрагментации: MTU маршрута
+// с учётом кэша PMTU, который ядро ведёт по ICMP "fragmentation needed".
+// На loopback это почти 64 КБ, в Ethernet - около 1.4 КБ.
+static uint32_t pathPayload(const NetAddress &peer) {
+    // Клиент IPv4 на сокете dual-stack ходит по маршруту IPv4: его и спрашиваем
+    NetAddress target = peer;
+    in_addr addr4;
+    if (peer.ipv4(addr4)) {
+        target = NetAddress();
+        target.v4.sin_family = AF_INET;
+        target.v4.sin_addr = addr4;
+        target.v4.sin_port = htons(peer.port());
+    }
+    bool v6 = target.family() == AF_INET6;
+    int level = v6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    int mtu = 0;
+    SOCKET probe = socket(target.family(), SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (probe != INVALID_SOCKET) {
+        int mode = v6 ? IPV6_PMTUDISC_DO : IP_PMTUDISC_DO;
+        socklen_t length = sizeof(mtu);
+        if (setsockopt(probe, level, v6 ? IPV6_MTU_DISCOVER : IP_MTU_DISCOVER, &mode, sizeof(mode)) != 0 ||
+            connect(probe, &target.sa, target.length()) != 0 ||
+            getsockopt(probe, level, v6 ? IPV6_MTU : IP_MTU, &mtu, &length) != 0) {
+            mtu = 0;
         }
+        closesocket(probe);
+    }
+    if (mtu <= 0) return UDP_LEGACY_PAYLOAD;
+    int overhead = v6 ? UDP_IPV6_OVERHEAD : UDP_IPV4_OVERHEAD;
+    return static_cast<uint32_t>(std::clamp<int>(mtu - overhead - UDP_HEADER_SIZE, UDP_MIN_PAYLOAD, UDP_MAX_PAYLOAD));
+}
 
-        if (!ackReceived) {
-            std::cerr << "Max retries reached for packet " << expectedSeq << std::endl;
-            break;
+static uint32_t negotiatePayload(uint32_t hint, const NetAddress &peer) {
+    if (hint == 0) return UDP_LEGACY_PAYLOAD;
+    return std::max(UDP_MIN_PAYLOAD, std::min(hint, pathPayload(peer)));
+}
+
+static uint32_t senderWindow(uint32_t payload) {
+    auto window = static_cast<uint32_t>(std::max(1, g_config.udpWindow));
+    return std::clamp<uint32_t>(UDP_MAX_INFLIGHT / payload, 4, window);
+}
+
+static UdpClock::time_point sessionDeadline(const UdpSession &session) {
+    if (session.lingering) return session.lingerUntil;
+    return session.sender ? session.sender->nextDeadline() : session.receiver->nextDeadline();
+}
+
+// Ставит таймер, только если срок стал раньше уже стоящего: более поздний срок
+// подхватится, когда старая запись сработает. Так куча не растёт с каждым пакетом.
+static void schedule(UdpEngine &engine, const PeerKey &key, UdpSession &session) {
+    auto deadline = sessionDeadline(session);
+    if (deadline < session.scheduled) {
+        session.scheduled = deadline;
+        engine.timers.emplace(deadline, key);
+    }
+}
+
+static void logTransfer(const UdpSession &session, UdpClock::time_point now) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - session.transferStart).count();
+    double speed = ms > 0 ? (session.fileSize / 1024.0 / 1024.0) / (ms / 1000.0) : 0; // MB/s
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(now - session.transferStart).count();
+    recordTransfer(session.sender ? Transfer::UdpDownload : Transfer::UdpUpload, micros);
+    if (session.sender) {
+        LOG_INFO("udp", "download_complete", "file=%s bytes=%" PRIu64 " ms=%lld mb_per_sec=%.2f retransmits=%" PRIu64
+                 " rtt_ms=%.2f", session.filename.c_str(), session.fileSize, static_cast<long long>(ms), speed,
+                 session.sender->retransmits(), session.sender->rttMs());
+    } else {
+        LOG_INFO("udp", "upload_complete", "file=%s bytes=%" PRIu64 " ms=%lld mb_per_sec=%.2f",
+                 session.filename.c_str(), session.fileSize, static_cast<long long>(ms), speed);
+    }
+}
+
+// Недокачанный .part удаляется: UDP не докачивает
+static void discardSession(UdpEngine &engine, const PeerKey &key) {
+    auto it = engine.sessions.find(key);
+    if (it == engine.sessions.end()) return;
+    UdpSession &session = *it->second;
+    if (session.receiver && !session.receiver->finished()) {
+        LOG_WARN("udp", "upload_incomplete", "file=%s received=%" PRIu64 " bytes=%" PRIu64,
+                 session.filename.c_str(), session.receiver->bytesReceived(),
+                 session.fileSize);
+        close(session.fd);
+        session.fd = -1;
+        // Удаляется, пока загрузка ещё числится за сессией: другие к ней не присоединяются
+        std::error_code ec;
+        std::filesystem::remove(session.path, ec);
+        storage().abandonUpload(session.filename, 0, 0);
+    } else if (session.sender && !session.sender->finished()) {
+        LOG_WARN("udp", "download_failed", "file=%s", session.filename.c_str());
+    }
+    engine.sessions.erase(it);
+    gaugeMetric(Gauge::UdpSessions, -1);
+}
+
+// После каждого события сессии: завершённая уходит в ожидание, оборванная удаляется
+static void afterSessionEvent(UdpEngine &engine, const PeerKey &key, UdpSession &session,
+                              UdpClock::time_point now) {
+    if (!session.lingering) {
+        bool finished = session.sender ? session.sender->finished() : session.receiver->finished();
+        bool failed = session.sender ? session.sender->failed() : session.receiver->failed();
+        if (failed) {
+            discardSession(engine, key);
+            return;
+        }
+        if (finished) {
+            logTransfer(session, now);
+            // Принятый файл встаёт на место. Без fsync, как и раньше: он остановил бы все
+            // передачи потока; rename всё равно не покажет файл читателям недописанным
+            if (session.receiver && storage().uploadWritten(session.filename, 0, session.fileSize)) {
+                storage().commitUpload(session.filename, session.fd, true, 0, false);
+            }
+            if (session.fd != -1) close(session.fd);
+            session.fd = -1;
+            session.lingering = true;
+            session.lingerUntil = now + UDP_LINGER;
         }
     }
+    schedule(engine, key, session);
+}
 
-    // Отправка конечного пакета
-    UDPPacket endPacket;
-    endPacket.seq = htonl(UINT32_MAX);
-    endPacket.length = htons(0);
-    sendto(sock, (char *) &endPacket, sizeof(endPacket.seq) + sizeof(endPacket.length),
-           0, (sockaddr *) &clientAddr, sizeof(clientAddr));
+static UdpSession &createSession(UdpEngine &engine, const PeerKey &key, const NetAddress &clientAddr) {
+    auto &slot = engine.sessions[key];
+    if (!slot) gaugeMetric(Gauge::UdpSessions, 1);
+    slot = std::make_unique<UdpSession>();
+    slot->peer = UdpPeer{&engine.tx, clientAddr};
+    return *slot;
+}
 
-    file.close();
+static void handleUDPDownload(UdpEngine &engine, const NetAddress &clientAddr, const std::string &filename,
+                              uint32_t payloadHint, bool compress, UdpClock::time_point now) {
+    discardSession(engine, peerKey(clientAddr));
+    char path[PATH_MAX];
+    StoredFile stored;
+    if (!storage().filePath(filename, path) || !storage().lookup(filename, stored)) {
+        sendUDPMessage(engine, clientAddr, "ERROR: File not found\n");
+        return;
+    }
+    CachedFileRef cached = fileCache().find(path);
+    int fd = -1;
+    uint64_t fileSize;
+    if (cached) {
+        fileSize = cached->size;
+    } else {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st{};
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            if (fd != -1) close(fd);
+            sendUDPMessage(engine, clientAddr, "ERROR: File not found\n");
+            return;
+        }
+        fileSize = st.st_size;
+        fileCache().missed(path, st);
+    }
+
+    PeerKey key = peerKey(clientAddr);
+    UdpSession &session = createSession(engine, key, clientAddr);
+    session.filename = filename;
+    session.fd = fd;
+    session.fileSize = fileSize;
+    uint32_t payload = negotiatePayload(payloadHint, clientAddr);
+    uint32_t window = senderWindow(payload);
+    // Сжимаем, только если сжимается начало файла
+    if (compress) {
+        size_t sampleSize = std::min<uint64_t>(LZ4_FRAME_BLOCK, fileSize);
+        std::vector<char> sample;
+        if (!cached) {
+            sample.resize(sampleSize);
+            if (pread(fd, sample.data(), sampleSize, 0) != static_cast<ssize_t>(sampleSize)) sampleSize = 0;
+        }
+        compress = lz4Worthwhile(cached ? cached->data.get() : sample.data(), sampleSize);
+    }
+    session.sender = cached ? std::make_unique<UdpSender>(std::move(cached), payload, window)
+                            : std::make_unique<UdpSender>(fd, fileSize, payload, window);
+    if (compress) session.sender->enableCompression();
+    session.transferStart = now;
+
+    // Клиенту без согласования - прежний ответ без размера пакета
+    std::string ready = "READY " + std::to_string(session.fileSize);
+    if (payloadHint) ready += " " + std::to_string(payload);
+    if (compress) ready += " LZ4";
+    sendUDPMessage(engine, clientAddr, ready + "\n");
+    session.sender->pump(session.peer, now);
+    afterSessionEvent(engine, key, session, now);
 }
 
-void handleUDPTime(int sock, sockaddr_in addr) {
-    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    std::string timeStr = ctime(&now);
-    timeStr.pop_back();
+static void handleUDPTime(UdpEngine &engine, const NetAddress &addr) {
+    char buffer[32];
+    std::string timeStr(formatTime(buffer));
     timeStr += '\n';
-    sendUDPMessage(sock, addr, timeStr);
+    sendUDPMessage(engine, addr, timeStr);
 }
 
-void handleUDPUpload(SOCKET sock, const sockaddr_in &clientAddr, const std::string &filename, const std::string &sizeStr) {
-    uint32_t fileSize;
+static void handleUDPUpload(UdpEngine &engine, const NetAddress &clientAddr, const std::string &filename,
+                            const std::string &sizeStr, uint32_t payloadHint, UdpClock::time_point now) {
+    // Новая передача заменяет прежнюю сессию клиента; до открытия файла,
+    // чтобы удаление недокачанного не задело новый
+    discardSession(engine, peerKey(clientAddr));
+
+    uint64_t fileSize;
     try {
-        fileSize = std::stoul(sizeStr);
+        fileSize = std::stoull(sizeStr);
     } catch (...) {
-        sendUDPMessage(sock, clientAddr, "ERROR: Invalid file size\n");
+        sendUDPMessage(engine, clientAddr, "ERROR: Invalid file size\n");
         return;
     }
 
     // Проверяем доступное место
     std::error_code ec;
-    auto space = std::filesystem::space("uploads", ec);
+    auto space = std::filesystem::space(g_config.storageRoot, ec);
     if (ec || space.available < fileSize) {
-        sendUDPMessage(sock, clientAddr, "ERROR: Not enough disk space\n");
+        sendUDPMessage(engine, clientAddr, "ERROR: Not enough disk space\n");
         return;
     }
 
-    // Отправляем подтверждение
-    sendUDPMessage(sock, clientAddr, "READY\n");
-
-    // Открываем файл для записи
-    std::ofstream file("uploads/" + filename, std::ios::binary);
-    if (!file) {
-        sendUDPMessage(sock, clientAddr, "ERROR: Can't create file\n");
+    // Пишем в .part; готовый файл встанет на его место по окончании передачи
+    char path[PATH_MAX];
+    if (!storage().partPath(filename, path)) {
+        sendUDPMessage(engine, clientAddr, "ERROR: Invalid file name\n");
+        return;
+    }
+    // Файл передаётся целиком: .part обрезается, если его не пишет кто-то ещё
+    uint64_t resume;
+    int fd = storage().beginUpload(filename, fileSize, true, false, resume);
+    if (fd == -1) {
+        sendUDPMessage(engine, clientAddr, errno == EBUSY ? "ERROR: File is busy with another upload, try again\n"
+                                                          : "ERROR: Can't create file\n");
         return;
     }
 
-    uint32_t expectedSeq = 0;
-    uint32_t totalReceived = 0;
-    bool transferComplete = false;
-    auto transferStart = std::chrono::steady_clock::now();
-
-    while (!transferComplete && totalReceived < fileSize) {
-        char packetBuffer[BUFFER_SIZE];
-        sockaddr_in senderAddr;
-        socklen_t senderLen = sizeof(senderAddr);
-
-        // Получаем пакет с таймаутом
-        fd_set readSet;
-        FD_ZERO(&readSet);
-        FD_SET(sock, &readSet);
-        timeval timeout{10, 0};// 10 секунд таймаут
-
-        if (select(sock + 1, &readSet, nullptr, nullptr, &timeout) <= 0) {
-            std::cerr << "Timeout waiting for packet " << expectedSeq << std::endl;
-            break;
-        }
+    PeerKey key = peerKey(clientAddr);
+    UdpSession &session = createSession(engine, key, clientAddr);
+    session.filename = filename;
+    session.path = path;
+    session.fd = fd;
+    session.fileSize = fileSize;
+    uint32_t payload = negotiatePayload(payloadHint, clientAddr);
+    session.receiver = std::make_unique<UdpReceiver>(fd, fileSize, payload);
+    session.transferStart = now;
 
-        int bytes = recvfrom(sock, packetBuffer, sizeof(packetBuffer), 0,
-                             (sockaddr *) &senderAddr, &senderLen);
+    // Отправляем подтверждение
+    sendUDPMessage(engine, clientAddr, payloadHint ? "READY " + std::to_string(payload) + "\n" : "READY\n");
+    afterSessionEvent(engine, key, session, now);
+}
 
-        // Проверяем что пакет от нужного клиента
-        if (senderAddr.sin_addr.s_addr != clientAddr.sin_addr.s_addr ||
-            senderAddr.sin_port != clientAddr.sin_port) {
-            continue;
+static void handleUDPCommand(UdpEngine &engine, const NetAddress &clientAddr, const char *data, size_t size,
+                             UdpClock::time_point now) {
+    std::string command(data, size);
+    char peer[INET6_ADDRSTRLEN];
+    LOG_INFO("udp", "command", "peer=%s line=\"%.*s\"", clientAddr.host(peer),
+             static_cast<int>(std::min<size_t>(command.find_last_not_of(" \n\r\t") + 1, 128)), command.data());
+
+    // Без преемника новые передачи при остановке не начинаются. Сокет, отданный преемнику,
+    // читают оба процесса: команду, доставшуюся старому, он обслуживает сам - отказ сорвал бы её
+    bool refuse = g_draining && !listenersHandedOff();
+    if (refuse && (command.find("UDP_DOWNLOAD ") == 0 || command.find("UDP_UPLOAD ") == 0)) {
+        sendUDPMessage(engine, clientAddr, "ERROR: Server shutting down\n");
+    } else if (command.find("UDP_DOWNLOAD ") == 0) {
+        std::string filename = command.substr(13);
+        uint32_t payloadHint = takePayloadHint(filename);
+        bool compress = takeCompressFlag(filename);
+        filename.erase(filename.find_last_not_of(" \n\r\t") + 1);// Trim whitespace
+        handleUDPDownload(engine, clientAddr, filename, payloadHint, compress, now);
+    } else if (command.find("UDP_UPLOAD ") == 0) {
+        std::string args = command.substr(11);
+        uint32_t payloadHint = takePayloadHint(args);
+
+        size_t last_space = args.rfind(' ');
+        if (last_space == std::string::npos) {
+            sendUDPMessage(engine, clientAddr, "ERROR: Invalid format. Use: UDP_UPLOAD <filename> <size>\n");
+            return;
         }
 
-        // Проверяем минимальный размер пакета
-        if (bytes < 6) continue;
+        std::string filename = args.substr(0, last_space);
+        std::string sizeStr = args.substr(last_space + 1);
 
-        // Разбираем заголовок пакета
-        uint32_t packetSeq = ntohl(*reinterpret_cast<uint32_t *>(packetBuffer));
-        uint16_t chunkSize = ntohs(*reinterpret_cast<uint16_t *>(packetBuffer + 4));
+        filename.erase(filename.find_last_not_of(" \n\r\t") + 1);
+        sizeStr.erase(sizeStr.find_last_not_of(" \n\r\t") + 1);
 
-        // Проверяем пакет завершения
-        if (packetSeq == UINT32_MAX) {
-            transferComplete = true;
-            sendUDPMessage(sock, clientAddr, "ACK " + std::to_string(packetSeq) + "\n");
-            break;
-        }
+        handleUDPUpload(engine, clientAddr, filename, sizeStr, payloadHint, now);
+    } else if (command.find("UDP_TIME") == 0) {
+        handleUDPTime(engine, clientAddr);
+    } else {
+        sendUDPMessage(engine, clientAddr, "UNKNOWN COMMAND\n");
+    }
+}
 
-        // Проверяем порядковый номер
-        if (packetSeq == expectedSeq) {
-            // Проверяем корректность размера данных
-            if (bytes - 6 != chunkSize || totalReceived + chunkSize > fileSize) {
-                std::cerr << "Invalid chunk size: " << chunkSize << std::endl;
-                continue;
-            }
+// Команды начинаются с "UDP_"; всё остальное от клиента с открытой сессией - её трафик
+static void onDatagram(UdpEngine &engine, const NetAddress &from, const char *data, size_t size,
+                              UdpClock::time_point now) {
+    countMetric(Counter::UdpBytesIn, size);
+    PeerKey key = peerKey(from);
+    bool isCommand = size >= 4 && memcmp(data, "UDP_", 4) == 0;
+    auto it = engine.sessions.find(key);
+
+    if (isCommand || it == engine.sessions.end()) {
+        // Запоздавший ACK уже забытой передачи - не команда и ответа не требует
+        if (!isCommand && size >= 4 && memcmp(data, "ACK ", 4) == 0) return;
+        handleUDPCommand(engine, from, data, size, now);
+        return;
+    }
 
-            // Записываем данные в файл
-            file.write(packetBuffer + 6, chunkSize);
-            totalReceived += chunkSize;
-            expectedSeq++;
+    UdpSession &session = *it->second;
+    if (dropIncomingDatagram()) return;
+    if (session.sender) {
+        UdpAck ack;
+        if (!session.lingering && parseAck(data, size, ack)) session.sender->onAck(session.peer, ack, now);
+    } else {
+        bool queued = session.receiver->ackPending();
+        session.receiver->onPacket(session.peer, data, size, now);
+        if (!queued && session.receiver->ackPending()) engine.pendingAcks.push_back(key);
+    }
+    afterSessionEvent(engine, key, session, now);
+}
 
-            // Выводим прогресс
-            std::cout << "\rReceived: " << totalReceived << "/" << fileSize
-                      << " (" << (totalReceived * 100 / fileSize) << "%)" << std::flush;
+// Один ACK на получателя за пачку принятых пакетов
+static void flushAcks(UdpEngine &engine) {
+    for (const PeerKey &key : engine.pendingAcks) {
+        auto it = engine.sessions.find(key);
+        if (it != engine.sessions.end() && it->second->receiver) {
+            it->second->receiver->flushAck(it->second->peer);
         }
-
-        // Отправляем подтверждение (ACK)
-        sendUDPMessage(sock, clientAddr, "ACK " + std::to_string(packetSeq) + "\n");
     }
+    engine.pendingAcks.clear();
+}
 
-    file.close();
+static void runTimers(UdpEngine &engine, UdpClock::time_point now) {
+    while (!engine.timers.empty() && engine.timers.top().first <= now) {
+        auto [deadline, key] = engine.timers.top();
+        engine.timers.pop();
 
-    // Проверяем успешность завершения
-    if (transferComplete && totalReceived == fileSize) {
-        auto duration = std::chrono::steady_clock::now() - transferStart;
-        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-        double speed = (totalReceived / 1024.0 / 1024.0) / (ms / 1000.0);// MB/s
+        auto it = engine.sessions.find(key);
+        if (it == engine.sessions.end() || it->second->scheduled != deadline) continue;// устаревшая запись
+        UdpSession &session = *it->second;
+        session.scheduled = UdpClock::time_point::max();
 
-        std::cout << "\nUpload complete: " << filename
-                  << " (" << totalReceived << " bytes)"
-                  << " in " << ms << " ms (" << speed << " MB/s)" << std::endl;
-    } else {
-        std::cerr << "\nUpload failed or incomplete: " << totalReceived << "/" << fileSize << std::endl;
-        std::filesystem::remove("uploads/" + filename);
+        if (session.lingering) {
+            if (now >= session.lingerUntil) {
+                engine.sessions.erase(it);
+                gaugeMetric(Gauge::UdpSessions, -1);
+                continue;
+            }
+        } else if (session.sender) {
+            session.sender->pump(session.peer, now);
+        } else {
+            session.receiver->onTimer(now);
+        }
+        afterSessionEvent(engine, key, session, now);
     }
 }
 
-void handleUDPCommand(SOCKET sock) {
-    sockaddr_in clientAddr;
-    socklen_t addrLen = sizeof(clientAddr);
-    char buffer[BUFFER_SIZE];
-
-    while (true) {
-        int bytes = recvfrom(sock, buffer, BUFFER_SIZE, 0,
-                             (sockaddr *) &clientAddr, &addrLen);
-        if (bytes <= 0) continue;
-
-        std::string command(buffer, bytes);
-        std::cout << "[UDP]:" << command << std::endl;
-
-        if (command.find("UDP_DOWNLOAD ") == 0) {
-            std::string filename = command.substr(13);
-            filename.erase(filename.find_last_not_of(" \n\r\t") + 1);// Trim whitespace
-            handleUDPDownload(sock, clientAddr, filename);
-        } else if (command.find("UDP_UPLOAD ") == 0) {
-            std::string args = command.substr(11);
-
-            size_t last_space = args.rfind(' ');
-            if (last_space == std::string::npos) {
-                sendUDPMessage(sock, clientAddr, "ERROR: Invalid format. Use: UDP_UPLOAD <filename> <size>\n");
-                return;
-            }
-
-            std::string filename = args.substr(0, last_space);
-            std::string sizeStr = args.substr(last_space + 1);
-
-            filename.erase(filename.find_last_not_of(" \n\r\t") + 1);
-            sizeStr.erase(sizeStr.find_last_not_of(" \n\r\t") + 1);
+// Шаг мягкой остановки; true - сессий не осталось (и ожидающих END тоже) или вышел срок
+static bool udpDrained(UdpEngine &engine) {
+    if (!engine.draining) {
+        engine.draining = true;
+        LOG_INFO("udp", "drain_started", "sessions=%zu handoff=%d", engine.sessions.size(), listenersHandedOff());
+    }
+    if (engine.sessions.empty()) {
+        LOG_INFO("udp", "drain_complete", "handoff=%d", listenersHandedOff());
+        return true;
+    }
+    auto nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(UdpClock::now().time_since_epoch()).count();
+    if (static_cast<uint64_t>(nowMs) < drainDeadlineMs()) return false;
+    LOG_WARN("udp", "drain_timeout", "sessions=%zu", engine.sessions.size());
+    while (!engine.sessions.empty()) {
+        PeerKey key = engine.sessions.begin()->first;
+        discardSession(engine, key);
+    }
+    return true;
+}
 
-            handleUDPUpload(sock, clientAddr, filename, sizeStr);
-        } else if (command.find("UDP_TIME ") == 0) {
-            handleUDPTime(sock, clientAddr);
-        } else {
-            sendUDPMessage(sock, clientAddr, "UNKNOWN COMMAND\n");
+static void runUdpEngine(UdpEngine &engine) {
+    while (!g_shutdown) {
+        // Всё накопленное за итерацию уходит одним sendmmsg перед сном
+        engine.tx.flush();
+        if (g_draining && udpDrained(engine)) break;
+
+        int timeout = engine.draining ? 100 : 1000;
+        if (!engine.timers.empty()) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    engine.timers.top().first - UdpClock::now()).count() + 1;
+            timeout = static_cast<int>(std::clamp<long long>(wait, 0, timeout));
+        }
+        pollfd pfd{engine.sock, POLLIN, 0};
+        poll(&pfd, 1, timeout);
+
+        for (int round = 0; round < UDP_RX_ROUNDS && engine.rx.receive() > 0; ++round) {
+            auto now = UdpClock::now();
+            engine.rx.forEach([&engine, now](const NetAddress &from, const char *data, size_t size) {
+                onDatagram(engine, from, data, size, now);
+            });
+            flushAcks(engine);
         }
+        runTimers(engine, UdpClock::now());
     }
+    engine.tx.flush();
 }
 
-void handleUDPServer() {
-    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+// Сокет на --udp-port: свой или полученный от предшественника (уже настроенный и привязанный)
+static SOCKET openUdpSocket() {
+    if (inheritedListeners(ListenerKind::Udp) > 0) return inheritedListener(ListenerKind::Udp, 0);
+    NetAddress serverAddr;
+    NetAddress::parse(g_config.udpBind, static_cast<uint16_t>(g_config.udpPort), serverAddr);
+    SOCKET sock = socket(serverAddr.family(), SOCK_DGRAM | SOCK_CLOEXEC, 0);
     if (sock == INVALID_SOCKET) {
-        std::cerr << "Socket creation failed" << std::endl;
-        return;
+        LOG_ERROR("udp", "socket_failed", "error=\"%s\"", strerror(errno));
+        return INVALID_SOCKET;
     }
 
-    // Создаем папку uploads если ее нет
-    std::filesystem::create_directories("uploads");
-
-    sockaddr_in serverAddr{};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(UDP_PORT);
+    // Один сокет на всех клиентов: буферы побольше, чтобы переживать всплески
+    int receiveBuffer = g_config.udpRcvBufKB * 1024;
+    int sendBuffer = g_config.udpSndBufKB * 1024;
+    if (receiveBuffer > 0) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+    if (sendBuffer > 0) setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+    if (g_config.busyPollUs > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &g_config.busyPollUs, sizeof(g_config.busyPollUs)) == -1) {
+        LOG_WARN("udp", "busy_poll_failed", "us=%d error=\"%s\"", g_config.busyPollUs, strerror(errno));
+    }
+    // DF на всех датаграммах: пакет больше MTU пути не фрагментируется, а отклоняется,
+    // и ядро обновляет кэш PMTU, по которому согласуется размер следующих передач.
+    // Сокету dual-stack - для обоих протоколов: клиенты IPv4 идут через IP_MTU_DISCOVER.
+    int pmtuMode = IP_PMTUDISC_DO;
+    setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtuMode, sizeof(pmtuMode));
+    if (serverAddr.family() == AF_INET6) {
+        int v6only = 0;
+        int pmtuMode6 = IPV6_PMTUDISC_DO;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &pmtuMode6, sizeof(pmtuMode6));
+    }
 
-    if (bind(sock, (sockaddr *) &serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-        std::cerr << "Bind failed" << std::endl;
+    if (bind(sock, &serverAddr.sa, serverAddr.length()) == SOCKET_ERROR) {
+        LOG_ERROR("udp", "bind_failed", "address=%s port=%d error=\"%s\"", g_config.udpBind.c_str(), g_config.udpPort,
+                  strerror(errno));
         closesocket(sock);
-        return;
+        return INVALID_SOCKET;
     }
+    return sock;
+}
 
-    std::cout << "[UDP] Server started on port " << UDP_PORT << std::endl;
-    handleUDPCommand(sock);
+void handleUDPServer() {
+    SOCKET sock = openUdpSocket();
+    if (sock == INVALID_SOCKET) return;
+    publishListener(ListenerKind::Udp, sock);
+
+    UdpEngine engine(sock, g_config.udpOffload);
+    LOG_INFO("udp", "listening", "address=%s port=%d gso=%d gro=%d inherited=%zu", g_config.udpBind.c_str(),
+             g_config.udpPort, engine.tx.segmentOffload(), engine.rx.receiveOffload(),
+             inheritedListeners(ListenerKind::Udp));
+    runUdpEngine(engine);
+    engine.sessions.clear();
     closesocket(sock);
-}
\ No newline at end of file
+}
@@ -0,0 +1,155 @@
+#include "udp_io.h"
+#include "logger.h"
+#include <cerrno>
+#include <netinet/udp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+constexpr size_t UDP_TX_ARENA = 4 * 1024 * 1024;
+// Пределы одного GSO-сообщения: число сегментов и суммарный размер в датаграмме IPv4
+constexpr size_t UDP_MAX_SEGMENTS = 64;
+constexpr size_t UDP_MAX_GSO_BYTES = 65507;
+
+constexpr size_t controlWords(size_t bytes) {
+    return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+constexpr size_t TX_CONTROL_WORDS = controlWords(CMSG_SPACE(sizeof(uint16_t)));
+constexpr size_t RX_CONTROL_WORDS = controlWords(CMSG_SPACE(sizeof(int)));
+
+UdpTxBatch::UdpTxBatch(SOCKET sock, bool segmentOffload)
+    : sock(sock), gso(segmentOffload), arena(UDP_TX_ARENA), messages(UDP_TX_BATCH), iovecs(UDP_TX_BATCH),
+      control(UDP_TX_BATCH * TX_CONTROL_WORDS) {
+    entries.reserve(UDP_TX_BATCH);
+    if (gso) {
+        // Ядра без UDP_SEGMENT не знают эту опцию
+        int value = 0;
+        socklen_t length = sizeof(value);
+        gso = getsockopt(sock, SOL_UDP, UDP_SEGMENT, &value, &length) == 0;
+    }
+}
+
+char *UdpTxBatch::reserve(size_t maxSize) {
+    if (used + maxSize > arena.size() || entries.size() == UDP_TX_BATCH) flush();
+    return arena.data() + used;
+}
+
+void UdpTxBatch::commit(const NetAddress &addr, size_t size) {
+    entries.push_back(Entry{addr, used, size});
+    used += size;
+}
+
+void UdpTxBatch::send(const NetAddress &addr, const void *data, size_t size) {
+    memcpy(reserve(size), data, size);
+    commit(addr, size);
+}
+
+void UdpTxBatch::flush() {
+    if (entries.empty()) return;
+
+    // Группа для GSO: один адрес, все сегменты одного размера, кроме, может быть, последнего
+    size_t count = 0;
+    for (size_t i = 0; i < entries.size();) {
+        const Entry &first = entries[i];
+        size_t segment = first.size;
+        size_t total = first.size;
+        size_t j = i + 1;
+        while (gso && j < entries.size() && j - i < UDP_MAX_SEGMENTS &&
+               entries[j].addr == first.addr && entries[j - 1].size == segment &&
+               entries[j].size <= segment && total + entries[j].size <= UDP_MAX_GSO_BYTES) {
+            total += entries[j].size;
+            ++j;
+        }
+
+        mmsghdr &message = messages[count];
+        message = mmsghdr{};
+        iovecs[count] = iovec{arena.data() + first.offset, total};
+        message.msg_hdr.msg_name = const_cast<sockaddr *>(&first.addr.sa);
+        message.msg_hdr.msg_namelen = first.addr.length();
+        message.msg_hdr.msg_iov = &iovecs[count];
+        message.msg_hdr.msg_iovlen = 1;
+        if (j - i > 1) {
+            message.msg_hdr.msg_control = &control[count * TX_CONTROL_WORDS];
+            message.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&message.msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segmentSize = static_cast<uint16_t>(segment);
+            memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+        }
+        datagrams += j - i;
+        ++count;
+        i = j;
+    }
+
+    for (size_t sent = 0; sent < count;) {
+        int rc = sendmmsg(sock, &messages[sent], count - sent, 0);
+        ++calls;
+        if (rc > 0) {
+            sent += rc;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        // Сообщение, которое ядро не приняло, теряется - протокол перешлёт его сам.
+        // Если отказ на GSO (нет поддержки у устройства), дальше шлём без него.
+        if (messages[sent].msg_hdr.msg_controllen != 0 && (errno == EIO || errno == EINVAL)) {
+            LOG_WARN("udp", "gso_rejected", "error=\"%s\"", strerror(errno));
+            gso = false;
+        }
+        ++sent;
+    }
+
+    entries.clear();
+    used = 0;
+}
+
+UdpRxBatch::UdpRxBatch(SOCKET sock, bool receiveOffload)
+    : sock(sock), gro(receiveOffload), buffers(UDP_RX_BATCH * UDP_RX_BUFFER), messages(UDP_RX_BATCH),
+      iovecs(UDP_RX_BATCH), addresses(UDP_RX_BATCH), control(UDP_RX_BATCH * RX_CONTROL_WORDS),
+      segmentSizes(UDP_RX_BATCH) {
+    if (gro) {
+        int one = 1;
+        gro = setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+    }
+}
+
+size_t UdpRxBatch::receive() {
+    for (size_t i = 0; i < UDP_RX_BATCH; ++i) {
+        iovecs[i] = iovec{buffers.data() + i * UDP_RX_BUFFER, UDP_RX_BUFFER};
+        messages[i] = mmsghdr{};
+        messages[i].msg_hdr.msg_name = &addresses[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        if (gro) {
+            messages[i].msg_hdr.msg_control = &control[i * RX_CONTROL_WORDS];
+            messages[i].msg_hdr.msg_controllen = RX_CONTROL_WORDS * sizeof(uint64_t);
+        }
+    }
+
+    int rc;
+    do {
+        rc = recvmmsg(sock, messages.data(), UDP_RX_BATCH, MSG_DONTWAIT, nullptr);
+        ++calls;
+    } while (rc < 0 && errno == EINTR);
+    received = rc > 0 ? rc : 0;
+
+    for (size_t i = 0; i < received; ++i) {
+        segmentSizes[i] = 0;
+        if (!gro) continue;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&messages[i].msg_hdr); cmsg;
+             cmsg = CMSG_NXTHDR(&messages[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment;
+                memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                segmentSizes[i] = segment;
+            }
+        }
+    }
+    return received;
+}
@@ -0,0 +1,88 @@
+#ifndef TCP_SERVER_UDP_IO_H
+#define TCP_SERVER_UDP_IO_H
+
+#include "../libs.h"
+#include "net_address.h"
+#include <sys/uio.h>
+
+// Сколько датаграмм копится до одного sendmmsg и читается одним recvmmsg
+constexpr size_t UDP_TX_BATCH = 256;
+constexpr size_t UDP_RX_BATCH = 32;
+// Буфер приёма: склеенная GRO датаграмма занимает до 64 КБ
+constexpr size_t UDP_RX_BUFFER = 64 * 1024;
+
+// Исходящие датаграммы копятся в одном буфере и уходят одним sendmmsg.
+// Подряд идущие датаграммы одному адресу одного размера склеиваются
+// в одно сообщение с UDP_SEGMENT - ядро режет его на пакеты само (GSO).
+class UdpTxBatch {
+public:
+    UdpTxBatch(SOCKET sock, bool segmentOffload);
+
+    // Место под датаграмму до maxSize байт. Заполняется на месте и подтверждается
+    // commit; без commit датаграмма не отправляется.
+    char *reserve(size_t maxSize);
+    void commit(const NetAddress &addr, size_t size);
+    void send(const NetAddress &addr, const void *data, size_t size);
+    void flush();
+
+    bool segmentOffload() const { return gso; }
+    uint64_t datagramsSent() const { return datagrams; }
+    uint64_t syscalls() const { return calls; }
+
+private:
+    struct Entry {
+        NetAddress addr;
+        size_t offset;
+        size_t size;
+    };
+
+    SOCKET sock;
+    bool gso;
+    std::vector<char> arena;
+    size_t used = 0;
+    std::vector<Entry> entries;
+    std::vector<mmsghdr> messages;
+    std::vector<iovec> iovecs;
+    std::vector<uint64_t> control;   // выровненное место под cmsg с UDP_SEGMENT
+    uint64_t datagrams = 0;
+    uint64_t calls = 0;
+};
+
+// Приём пачкой через recvmmsg. С UDP_GRO ядро отдаёт несколько пакетов одного
+// отправителя одним буфером; forEach режет его обратно по размеру сегмента.
+class UdpRxBatch {
+public:
+    UdpRxBatch(SOCKET sock, bool receiveOffload);
+
+    // Один recvmmsg без ожидания; 0 - очередь сокета пуста
+    size_t receive();
+
+    template<class F>
+    void forEach(F &&f) const {
+        for (size_t i = 0; i < received; ++i) {
+            const char *data = buffers.data() + i * UDP_RX_BUFFER;
+            size_t length = messages[i].msg_len;
+            size_t segment = segmentSizes[i] ? segmentSizes[i] : length;
+            for (size_t offset = 0; offset < length; offset += segment) {
+                f(addresses[i], data + offset, std::min(segment, length - offset));
+            }
+        }
+    }
+
+    bool receiveOffload() const { return gro; }
+    uint64_t syscalls() const { return calls; }
+
+private:
+    SOCKET sock;
+    bool gro;
+    std::vector<char> buffers;
+    std::vector<mmsghdr> messages;
+    std::vector<iovec> iovecs;
+    std::vector<NetAddress> addresses;
+    std::vector<uint64_t> control;
+    std::vector<size_t> segmentSizes;
+    size_t received = 0;
+    uint64_t calls = 0;
+};
+
+#endif//TCP_SERVER_UDP_IO_H
@@ -0,0 +1,345 @@
+#include "udp_transfer.h"
+#include "logger.h"
+#include "lz4.h"
+#include "metrics.h"
+#include <cmath>
+#include <random>
+
+// Минимальное окно переупорядочивания для быстрой перепосылки, секунды
+constexpr double UDP_MIN_REORDER = 0.001;
+constexpr double UDP_INITIAL_RTO = 0.25;
+constexpr double UDP_MIN_RTO = 0.02;
+constexpr double UDP_MAX_RTO = 2.0;
+constexpr int UDP_MAX_END_ATTEMPTS = 5;
+constexpr auto UDP_IDLE_TIMEOUT = std::chrono::seconds(10);
+
+static bool lossRoll() {
+    if (g_config.udpLossPercent <= 0) return false;
+    static thread_local std::mt19937 rng(std::random_device{}());
+    return std::uniform_real_distribution<double>(0, 100)(rng) < g_config.udpLossPercent;
+}
+
+void sendDatagram(const UdpPeer &peer, const void *data, size_t size, bool lossy) {
+    if (lossy && lossRoll()) return;
+    peer.tx->send(peer.addr, data, size);
+}
+
+bool dropIncomingDatagram() {
+    return lossRoll();
+}
+
+size_t formatAck(const UdpAck &ack, char *out) {
+    uint32_t seq = htonl(UDP_ACK_SEQ);
+    uint16_t length = htons(static_cast<uint16_t>(4 + ack.rangeCount * 8));
+    memcpy(out, &seq, sizeof(seq));
+    memcpy(out + 4, &length, sizeof(length));
+    char *p = out + UDP_HEADER_SIZE;
+    auto put = [&p](uint32_t value) {
+        value = htonl(value);
+        memcpy(p, &value, sizeof(value));
+        p += sizeof(value);
+    };
+    put(ack.cumulative);
+    for (size_t i = 0; i < ack.rangeCount; ++i) {
+        put(ack.ranges[i][0]);
+        put(ack.ranges[i][1]);
+    }
+    return p - out;
+}
+
+bool parseAck(const char *data, size_t size, UdpAck &ack) {
+    if (size < UDP_HEADER_SIZE + 4) return false;
+    auto get = [data](size_t offset) {
+        uint32_t value;
+        memcpy(&value, data + offset, sizeof(value));
+        return ntohl(value);
+    };
+    if (get(0) != UDP_ACK_SEQ) return false;
+
+    ack.cumulative = get(UDP_HEADER_SIZE);
+    ack.rangeCount = std::min((size - UDP_HEADER_SIZE - 4) / 8, UDP_MAX_SACK_RANGES);
+    for (size_t i = 0; i < ack.rangeCount; ++i) {
+        ack.ranges[i][0] = get(UDP_HEADER_SIZE + 4 + i * 8);
+        ack.ranges[i][1] = get(UDP_HEADER_SIZE + 8 + i * 8);
+        if (ack.ranges[i][1] < ack.ranges[i][0]) {
+            ack.rangeCount = i;
+            break;
+        }
+    }
+    return true;
+}
+
+UdpSender::UdpSender(int fileFd, uint64_t fileSize, uint32_t payloadSize, uint32_t window)
+    : fileFd(fileFd), fileSize(fileSize), payloadSize(payloadSize), window(std::max(1u, window)),
+      totalPackets(static_cast<uint32_t>((fileSize + payloadSize - 1) / payloadSize)),
+      slots(this->window), rto(UDP_INITIAL_RTO) {
+    lastProgress = UdpClock::now();
+    nextCheck = UdpClock::time_point::max();
+}
+
+UdpSender::UdpSender(CachedFileRef file, uint32_t payloadSize, uint32_t window)
+    : UdpSender(-1, file->size, payloadSize, window) {
+    cached = std::move(file);
+}
+
+void UdpSender::enableCompression() {
+    compress = true;
+    if (!cached) block.resize(payloadSize);
+}
+
+void UdpSender::transmit(const UdpPeer &peer, uint32_t seq, UdpClock::time_point now) {
+    uint64_t offset = static_cast<uint64_t>(seq) * payloadSize;
+    size_t length = static_cast<size_t>(std::min<uint64_t>(payloadSize, fileSize - offset));
+    // Пакет собирается прямо в буфере пачки отправки, без промежуточной копии
+    char *packet = peer.tx->reserve(UDP_HEADER_SIZE + length);
+    char *target = compress && !cached ? block.data() : packet + UDP_HEADER_SIZE;
+    ssize_t bytesRead;
+    if (cached) {
+        if (!compress) memcpy(target, cached->data.get() + offset, length);
+        bytesRead = static_cast<ssize_t>(length);
+    } else {
+        bytesRead = pread(fileFd, target, length, offset);
+    }
+    if (bytesRead != static_cast<ssize_t>(length)) {
+        LOG_ERROR("udp", "read_failed", "packet=%u", seq);
+        aborted = true;
+        return;
+    }
+
+    size_t stored = length;
+    if (compress) {
+        const char *raw = cached ? cached->data.get() + offset : block.data();
+        stored = lz4Compress(raw, length, packet + UDP_HEADER_SIZE, length - 1);
+        if (stored == 0) {
+            memcpy(packet + UDP_HEADER_SIZE, raw, length);
+            stored = length;
+        }
+    }
+
+    uint32_t netSeq = htonl(seq);
+    uint16_t netLength = htons(static_cast<uint16_t>(stored));
+    memcpy(packet, &netSeq, sizeof(netSeq));
+    memcpy(packet + 4, &netLength, sizeof(netLength));
+    if (!lossRoll()) peer.tx->commit(peer.addr, UDP_HEADER_SIZE + stored);
+    countMetric(Counter::UdpBytesOut, UDP_HEADER_SIZE + stored);
+
+    Slot &slot = slots[seq % window];
+    slot.sentAt = now;
+    if (slot.transmissions < UINT8_MAX) ++slot.transmissions;
+    auto deadline = now + std::chrono::duration_cast<UdpClock::duration>(std::chrono::duration<double>(rto));
+    if (deadline < nextCheck) nextCheck = deadline;
+}
+
+void UdpSender::sampleRtt(double seconds) {
+    if (srtt == 0) {
+        srtt = seconds;
+        rttvar = seconds / 2;
+    } else {
+        rttvar = 0.75 * rttvar + 0.25 * std::fabs(srtt - seconds);
+        srtt = 0.875 * srtt + 0.125 * seconds;
+    }
+    rto = std::clamp(srtt + 4 * rttvar, UDP_MIN_RTO, UDP_MAX_RTO);
+}
+
+void UdpSender::pump(const UdpPeer &peer, UdpClock::time_point now) {
+    if (done || aborted) return;
+    if (now - lastProgress > UDP_IDLE_TIMEOUT) {
+        LOG_WARN("udp", "transfer_stalled", "packet=%u", base);
+        aborted = true;
+        return;
+    }
+
+    auto rtoDuration = std::chrono::duration_cast<UdpClock::duration>(std::chrono::duration<double>(rto));
+
+    // Перепосылка по таймауту
+    if (now >= nextCheck) {
+        nextCheck = UdpClock::time_point::max();
+        bool timedOut = false;
+        for (uint32_t seq = base; seq < nextSeq && !aborted; ++seq) {
+            Slot &slot = slots[seq % window];
+            if (slot.sacked) continue;
+            if (now - slot.sentAt >= rtoDuration) {
+                transmit(peer, seq, now);
+                ++retransmitted;
+                countMetric(Counter::UdpRetransmits);
+                timedOut = true;
+            } else if (slot.sentAt + rtoDuration < nextCheck) {
+                nextCheck = slot.sentAt + rtoDuration;
+            }
+        }
+        // Экспоненциальный откат до следующего корректного замера RTT
+        if (timedOut) rto = std::min(rto * 2, UDP_MAX_RTO);
+    }
+
+    // Новые пакеты в пределах окна
+    while (nextSeq < totalPackets && nextSeq < base + window && !aborted) {
+        slots[nextSeq % window] = Slot{};
+        transmit(peer, nextSeq, now);
+        ++nextSeq;
+    }
+
+    // Всё подтверждено - посылаем завершающий пакет, пока не придёт его ACK
+    if (base == totalPackets && (endAttempts == 0 || now - endSentAt >= rtoDuration)) {
+        if (endAttempts == UDP_MAX_END_ATTEMPTS) {
+            // Данные доставлены целиком, потерялся только ответ на END
+            done = true;
+            return;
+        }
+        char endPacket[UDP_HEADER_SIZE] = {};
+        uint32_t netSeq = htonl(UDP_END_SEQ);
+        memcpy(endPacket, &netSeq, sizeof(netSeq));
+        sendDatagram(peer, endPacket, sizeof(endPacket), false);
+        endSentAt = now;
+        ++endAttempts;
+    }
+}
+
+void UdpSender::onAck(const UdpPeer &peer, const UdpAck &ack, UdpClock::time_point now) {
+    if (done || aborted) return;
+    if (ack.cumulative == UDP_END_SEQ) {
+        if (base == totalPackets) done = true;
+        return;
+    }
+
+    // Замер RTT только по пакетам, отправленным один раз (алгоритм Карна)
+    double rttSample = -1;
+    bool delivered = false;
+    auto markDelivered = [&](const Slot &slot) {
+        if (slot.transmissions == 1) {
+            rttSample = std::chrono::duration<double>(now - slot.sentAt).count();
+        }
+        if (slot.sentAt > latestDeliveredSentAt) latestDeliveredSentAt = slot.sentAt;
+        delivered = true;
+    };
+
+    uint32_t cumulative = std::min(ack.cumulative, nextSeq);
+    for (uint32_t seq = base; seq < cumulative; ++seq) {
+        Slot &slot = slots[seq % window];
+        if (!slot.sacked) markDelivered(slot);
+    }
+    if (cumulative > base) base = cumulative;
+
+    for (size_t i = 0; i < ack.rangeCount; ++i) {
+        uint32_t first = std::max(ack.ranges[i][0], base);
+        uint32_t last = std::min(ack.ranges[i][1], nextSeq - 1);
+        for (uint32_t seq = first; seq <= last && seq < nextSeq; ++seq) {
+            Slot &slot = slots[seq % window];
+            if (!slot.sacked) {
+                slot.sacked = true;
+                markDelivered(slot);
+            }
+        }
+    }
+
+    if (!delivered) return;
+    lastProgress = now;
+    if (rttSample >= 0) sampleRtt(rttSample);
+
+    // Быстрая перепосылка (по времени, как RACK): пакет, отправленный раньше уже
+    // доставленного больше чем на окно переупорядочивания, считается потерянным.
+    // Так же ловятся и потерянные повторные отправки, которые ждали бы RTO.
+    auto reorderWindow = std::chrono::duration_cast<UdpClock::duration>(
+            std::chrono::duration<double>(std::max(srtt / 4, UDP_MIN_REORDER)));
+    for (uint32_t seq = base; seq < nextSeq && !aborted; ++seq) {
+        Slot &slot = slots[seq % window];
+        if (!slot.sacked && slot.sentAt + reorderWindow < latestDeliveredSentAt) {
+            transmit(peer, seq, now);
+            ++retransmitted;
+            countMetric(Counter::UdpRetransmits);
+        }
+    }
+
+    pump(peer, now);
+}
+
+UdpClock::time_point UdpSender::nextDeadline() const {
+    auto deadline = std::min(nextCheck, lastProgress + UDP_IDLE_TIMEOUT);
+    if (base == totalPackets) {
+        auto rtoDuration = std::chrono::duration_cast<UdpClock::duration>(std::chrono::duration<double>(rto));
+        deadline = std::min(deadline, endSentAt + rtoDuration);
+    }
+    return deadline;
+}
+
+UdpReceiver::UdpReceiver(int fileFd, uint64_t fileSize, uint32_t payloadSize)
+    : fileFd(fileFd), fileSize(fileSize), payloadSize(payloadSize),
+      totalPackets(static_cast<uint32_t>((fileSize + payloadSize - 1) / payloadSize)),
+      have(totalPackets, false) {
+    lastPacket = UdpClock::now();
+}
+
+void UdpReceiver::flushAck(const UdpPeer &peer) {
+    if (!pendingAck) return;
+    pendingAck = false;
+    UdpAck ack;
+    ack.cumulative = cumulative;
+    uint32_t seq = cumulative;
+    while (seq < highest && ack.rangeCount < UDP_MAX_SACK_RANGES) {
+        while (seq < highest && !have[seq]) ++seq;
+        if (seq >= highest) break;
+        uint32_t first = seq;
+        while (seq < highest && have[seq]) ++seq;
+        ack.ranges[ack.rangeCount][0] = first;
+        ack.ranges[ack.rangeCount][1] = seq - 1;
+        ++ack.rangeCount;
+    }
+    char msg[UDP_MAX_ACK_SIZE];
+    sendDatagram(peer, msg, formatAck(ack, msg), true);
+}
+
+void UdpReceiver::onPacket(const UdpPeer &peer, const char *data, size_t size, UdpClock::time_point now) {
+    if (aborted || size < UDP_HEADER_SIZE) return;
+    lastPacket = now;
+
+    uint32_t seq;
+    uint16_t length;
+    memcpy(&seq, data, sizeof(seq));
+    memcpy(&length, data + 4, sizeof(length));
+    seq = ntohl(seq);
+    length = ntohs(length);
+
+    // END подтверждается и после завершения: наш ответ на него мог потеряться
+    if (seq == UDP_END_SEQ) {
+        if (cumulative == totalPackets) {
+            done = true;
+            UdpAck ack;
+            ack.cumulative = UDP_END_SEQ;
+            char msg[UDP_MAX_ACK_SIZE];
+            sendDatagram(peer, msg, formatAck(ack, msg), false);
+        }
+        return;
+    }
+
+    if (done || seq >= totalPackets) return;
+    uint64_t offset = static_cast<uint64_t>(seq) * payloadSize;
+    size_t expected = static_cast<size_t>(std::min<uint64_t>(payloadSize, fileSize - offset));
+    if (length != expected || size - UDP_HEADER_SIZE != expected) {
+        LOG_WARN("udp", "invalid_chunk", "packet=%u length=%zu expected=%zu", seq, static_cast<size_t>(length),
+                 expected);
+        return;
+    }
+
+    if (!have[seq]) {
+        if (pwrite(fileFd, data + UDP_HEADER_SIZE, length, offset) != static_cast<ssize_t>(length)) {
+            LOG_ERROR("udp", "write_failed", "error=\"%s\"", strerror(errno));
+            aborted = true;
+            return;
+        }
+        have[seq] = true;
+        received += length;
+        if (seq + 1 > highest) highest = seq + 1;
+        while (cumulative < totalPackets && have[cumulative]) ++cumulative;
+    }
+    pendingAck = true;
+}
+
+void UdpReceiver::onTimer(UdpClock::time_point now) {
+    if (!done && now - lastPacket > UDP_IDLE_TIMEOUT) {
+        LOG_WARN("udp", "receive_timeout", "packet=%u", cumulative);
+        aborted = true;
+    }
+}
+
+UdpClock::time_point UdpReceiver::nextDeadline() const {
+    return lastPacket + UDP_IDLE_TIMEOUT;
+}
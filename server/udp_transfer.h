@@ -0,0 +1,144 @@
+#ifndef TCP_SERVER_UDP_TRANSFER_H
+#define TCP_SERVER_UDP_TRANSFER_H
+
+#include "../libs.h"
+#include "file_cache.h"
+#include "udp_io.h"
+
+// Пакет данных: [seq u32][length u16][payload], всё в сетевом порядке байт.
+// Пакет с seq == UDP_END_SEQ и нулевой длиной завершает передачу.
+// При сжатой отдаче (UDP_DOWNLOAD ... LZ4) payload - блок LZ4 своего куска файла;
+// length меньше размера куска означает сжатый пакет, равная - пакет как есть.
+constexpr size_t UDP_HEADER_SIZE = 6;
+constexpr uint32_t UDP_END_SEQ = UINT32_MAX;
+// ACK - тот же заголовок с seq == UDP_ACK_SEQ, затем [cumulative u32][first u32][last u32]...
+constexpr uint32_t UDP_ACK_SEQ = UINT32_MAX - 1;
+// Сколько диапазонов выборочного подтверждения помещается в один ACK
+constexpr size_t UDP_MAX_SACK_RANGES = 8;
+constexpr size_t UDP_MAX_ACK_SIZE = UDP_HEADER_SIZE + 4 + UDP_MAX_SACK_RANGES * 8;
+
+// Полезная нагрузка пакета: 1024 байта для клиентов без согласования (без PAYLOAD=
+// в команде), иначе меньшее из предложенного клиентом и того, что пропустит путь
+constexpr uint32_t UDP_LEGACY_PAYLOAD = 1024;
+constexpr uint32_t UDP_MIN_PAYLOAD = 512;
+constexpr uint32_t UDP_MAX_PAYLOAD = 65507 - UDP_HEADER_SIZE;
+
+using UdpClock = std::chrono::steady_clock;
+
+// Куда слать: датаграммы копятся в пачке движка и уходят при её сбросе
+struct UdpPeer {
+    UdpTxBatch *tx;
+    NetAddress addr;
+};
+
+// Постановка датаграммы в пачку. lossy - пакет передачи, к нему применяется имитация потерь
+void sendDatagram(const UdpPeer &peer, const void *data, size_t size, bool lossy);
+// Имитация потерь на приёме (--udp-loss), для проверки протокола на loopback
+bool dropIncomingDatagram();
+
+// Подтверждение: все пакеты < cumulative получены, плюс полученные диапазоны выше него
+struct UdpAck {
+    uint32_t cumulative = 0;
+    size_t rangeCount = 0;
+    uint32_t ranges[UDP_MAX_SACK_RANGES][2]{};   // включительно [first, last]
+};
+
+// Пишет ACK в out (не меньше UDP_MAX_ACK_SIZE байт), возвращает размер
+size_t formatAck(const UdpAck &ack, char *out);
+bool parseAck(const char *data, size_t size, UdpAck &ack);
+
+// Отправитель со скользящим окном: держит в полёте до window пакетов, снимает их по
+// кумулятивному и выборочным ACK, перепосылает по RTO (оценка RTT по RFC 6298)
+// и досрочно - пакеты, отправленные заметно раньше уже доставленных.
+class UdpSender {
+public:
+    UdpSender(int fileFd, uint64_t fileSize, uint32_t payloadSize, uint32_t window);
+    // Файл из кэша: пакеты собираются из памяти, без pread
+    UdpSender(CachedFileRef file, uint32_t payloadSize, uint32_t window);
+
+    // Каждый пакет сжимается отдельно (LZ4), чтобы потеря не мешала распаковке соседних
+    void enableCompression();
+
+    // Отправляет всё, что позволяет окно, и перепосылает пакеты с истёкшим RTO
+    void pump(const UdpPeer &peer, UdpClock::time_point now);
+    void onAck(const UdpPeer &peer, const UdpAck &ack, UdpClock::time_point now);
+
+    // Когда нужно снова вызвать pump, даже если ACK не придут
+    UdpClock::time_point nextDeadline() const;
+    bool finished() const { return done; }
+    bool failed() const { return aborted; }
+
+    uint64_t bytesSent() const { return fileSize; }
+    uint64_t retransmits() const { return retransmitted; }
+    double rttMs() const { return srtt * 1000.0; }
+
+private:
+    struct Slot {
+        UdpClock::time_point sentAt;
+        uint8_t transmissions = 0;
+        bool sacked = false;
+    };
+
+    void transmit(const UdpPeer &peer, uint32_t seq, UdpClock::time_point now);
+    void sampleRtt(double seconds);
+
+    int fileFd;
+    CachedFileRef cached;
+    bool compress = false;
+    std::vector<char> block;   // кусок файла с диска перед сжатием
+    uint64_t fileSize;
+    uint32_t payloadSize;
+    uint32_t window;
+    uint32_t totalPackets;
+    uint32_t base = 0;      // первый неподтверждённый
+    uint32_t nextSeq = 0;   // следующий новый
+    std::vector<Slot> slots;
+
+    double srtt = 0;
+    double rttvar = 0;
+    double rto;
+    UdpClock::time_point nextCheck;
+    UdpClock::time_point lastProgress;
+    UdpClock::time_point latestDeliveredSentAt;
+    UdpClock::time_point endSentAt;
+    int endAttempts = 0;
+    uint64_t retransmitted = 0;
+    bool done = false;
+    bool aborted = false;
+};
+
+// Получатель: пишет пакеты сразу по их смещению в файле (pwrite), порядок не важен.
+// ACK с кумулятивной границей и диапазонами полученного уходит один на пачку
+// принятых пакетов - по flushAck после разбора пачки.
+class UdpReceiver {
+public:
+    UdpReceiver(int fileFd, uint64_t fileSize, uint32_t payloadSize);
+
+    void onPacket(const UdpPeer &peer, const char *data, size_t size, UdpClock::time_point now);
+    // Отправляет ACK, если с прошлого были новые пакеты
+    void flushAck(const UdpPeer &peer);
+    bool ackPending() const { return pendingAck; }
+    // Проверка простоя: без пакетов дольше UDP_IDLE_TIMEOUT передача считается оборванной
+    void onTimer(UdpClock::time_point now);
+    UdpClock::time_point nextDeadline() const;
+
+    bool finished() const { return done; }
+    bool failed() const { return aborted; }
+    uint64_t bytesReceived() const { return received; }
+
+private:
+    int fileFd;
+    uint64_t fileSize;
+    uint32_t payloadSize;
+    uint32_t totalPackets;
+    uint32_t cumulative = 0;
+    uint32_t highest = 0;   // максимальный полученный seq + 1
+    std::vector<bool> have;
+    uint64_t received = 0;
+    UdpClock::time_point lastPacket;
+    bool pendingAck = false;
+    bool done = false;
+    bool aborted = false;
+};
+
+#endif//TCP_SERVER_UDP_TRANSFER_H
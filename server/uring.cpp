@@ -0,0 +1,851 @@
+#include "uring.h"
+#include "crc32c.h"
+#include "logger.h"
+#include "lz4.h"
+#include "metrics.h"
+#include "net_address.h"
+#include "reactor.h"
+#include "storage.h"
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+constexpr unsigned URING_ENTRIES = 1024;
+// Буферы передачи файлов, зарегистрированные в ядре: по два на идущую передачу
+constexpr unsigned URING_BUFFERS = 32;
+constexpr size_t URING_CHUNK = 128 * 1024;
+// Файл из кэша уходит в сокет кусками до этого размера прямо из памяти кэша
+constexpr size_t URING_CACHED_SEND = 1024 * 1024;
+// Сжатая отдача: столько кадров LZ4 собирается в outBuf на один send
+constexpr size_t URING_COMPRESSED_BATCH = 256 * 1024;
+// Таблица fixed files: сокеты соединений и файлы передач
+constexpr unsigned URING_FILES = 4096;
+
+// user_data: указатель на сессию и операция в младших битах (Session выровнена на 8).
+// Служебные значения меньше 8 - сессий по таким адресам не бывает.
+constexpr uint64_t OP_RECV = 1;
+constexpr uint64_t OP_SEND = 2;
+constexpr uint64_t OP_CHUNK = 3;   // 3 и 4 - операции над chunks[0] и chunks[1]
+constexpr uint64_t OP_FSYNC = 5;
+constexpr uint64_t OP_MASK = 7;
+constexpr uint64_t TAG_ACCEPT = 1;
+constexpr uint64_t TAG_TICK = 2;
+constexpr uint64_t TAG_MAILBOX = 3;
+constexpr uint64_t TAG_TIMERS = 4;
+constexpr uint64_t TAG_CANCEL = 5;
+
+static_assert(alignof(Session) >= 8, "user_data keeps the operation in the low bits of Session*");
+
+static int uringSetup(unsigned entries, io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+// Кольца io_uring на голых системных вызовах, без liburing: SQ и CQ отображены
+// в память процесса, SQE заполняются на месте и уходят одним io_uring_enter
+class Ring {
+public:
+    Ring() = default;
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+
+    ~Ring() {
+        if (sqes) munmap(sqes, sqesSize);
+        if (cqMap && cqMap != sqMap) munmap(cqMap, cqMapSize);
+        if (sqMap) munmap(sqMap, sqMapSize);
+        if (ringFd != -1) close(ringFd);
+    }
+
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        // Ядро отрабатывает completions только внутри io_uring_enter, без IPI;
+        // ошибка одного SQE не обрывает отправку остальных
+        params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+        ringFd = uringSetup(entries, &params);
+        if (ringFd == -1 && errno == EINVAL) {
+            params = io_uring_params{};
+            ringFd = uringSetup(entries, &params);
+        }
+        if (ringFd == -1) return false;
+
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+
+        sqMap = map(sqMapSize, IORING_OFF_SQ_RING);
+        cqMap = singleMap ? sqMap : map(cqMapSize, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(map(sqesSize, IORING_OFF_SQES));
+        if (!sqMap || !cqMap || !sqes) return false;
+
+        char *sq = static_cast<char *>(sqMap);
+        sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+
+        char *cq = static_cast<char *>(cqMap);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        localTail = *sqTail;
+        return true;
+    }
+
+    // Чистый SQE в хвосте очереди; ядро увидит его при следующем submit
+    io_uring_sqe *nextSqe() {
+        // SQ заполнена - отдаём накопленное ядру, не дожидаясь конца итерации
+        while (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            int rc = submit(0);
+            if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY) break;
+        }
+        unsigned index = localTail & sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        ++localTail;
+        return sqe;
+    }
+
+    // Отправляет накопленные SQE и ждёт хотя бы waitFor завершений; -errno при ошибке
+    int submit(unsigned waitFor) {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (toSubmit == 0 && waitFor == 0) return 0;
+        int rc = uringEnter(ringFd, toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0);
+        return rc == -1 ? -errno : rc;
+    }
+
+    // Разбирает готовые CQE; f может ставить новые SQE
+    template<class F>
+    void drain(F &&f) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & cqMask];
+            ++head;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            f(cqe);
+        }
+    }
+
+    int registerCall(unsigned opcode, const void *arg, unsigned count) {
+        int rc = (int) syscall(__NR_io_uring_register, ringFd, opcode, arg, count);
+        return rc == -1 ? -errno : rc;
+    }
+
+private:
+    void *map(size_t size, off_t offset) {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    int ringFd = -1;
+    void *sqMap = nullptr;
+    void *cqMap = nullptr;
+    size_t sqMapSize = 0;
+    size_t cqMapSize = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqesSize = 0;
+
+    unsigned *sqHead = nullptr;
+    unsigned *sqTail = nullptr;
+    unsigned *sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned localTail = 0;   // SQE заполнены до сюда, ядру опубликованы до *sqTail
+
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe *cqes = nullptr;
+};
+
+struct UringReactor {
+    // Буферы чанков, зарегистрированные в ядре (READ_FIXED/WRITE_FIXED без pin на каждую операцию)
+    std::unique_ptr<char[]> bufferMemory;
+    std::vector<int> freeBuffers;
+    bool fixedBuffers = false;
+
+    // Свободные слоты таблицы fixed files (без fget/fput на каждую операцию)
+    std::vector<int> freeSlots;
+    bool fixedFiles = false;
+
+    NetAddress acceptAddr;
+    socklen_t acceptLength = 0;
+    // Раз в секунду CQE таймера будит цикл проверить g_shutdown
+    __kernel_timespec tick{1, 0};
+    // Колесу таймеров нужен проход раньше тика: отдельный TIMEOUT, взведённый на timersAt (мс)
+    __kernel_timespec timersWait{};
+    uint64_t timersAt = UINT64_MAX;
+    // Счётчик eventfd: задачи от пула (HASH) ждут в mailbox реактора
+    uint64_t mailboxCounter = 0;
+
+    // Последним: разрушается первым, и незавершённые операции ядра не переживают
+    // буферы и поля, в которые они пишут
+    Ring ring;
+};
+
+static bool supportsOperations(Ring &ring) {
+    constexpr unsigned PROBE_OPS = 256;
+    std::vector<char> storage(sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op));
+    auto *probe = reinterpret_cast<io_uring_probe *>(storage.data());
+    if (ring.registerCall(IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0) return false;
+
+    for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_WRITE,
+                   IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_FSYNC, IORING_OP_TIMEOUT}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+    }
+    return true;
+}
+
+bool initUringReactor(Reactor &reactor) {
+    auto uring = std::make_unique<UringReactor>();
+    if (!uring->ring.init(URING_ENTRIES)) {
+        LOG_WARN("tcp", "uring_setup_failed", "error=\"%s\"", strerror(errno));
+        return false;
+    }
+    if (!supportsOperations(uring->ring)) {
+        LOG_WARN("tcp", "uring_setup_failed", "error=\"missing required operations\"");
+        return false;
+    }
+
+    // Регистрация может упереться в RLIMIT_MEMLOCK или старое ядро -
+    // тогда работаем с обычными буферами и fd
+    uring->bufferMemory.reset(new char[URING_BUFFERS * URING_CHUNK]);
+    std::vector<iovec> iovecs(URING_BUFFERS);
+    for (unsigned i = 0; i < URING_BUFFERS; ++i) {
+        iovecs[i] = iovec{uring->bufferMemory.get() + i * URING_CHUNK, URING_CHUNK};
+    }
+    uring->fixedBuffers = uring->ring.registerCall(IORING_REGISTER_BUFFERS, iovecs.data(), URING_BUFFERS) == 0;
+    if (uring->fixedBuffers) {
+        for (int i = URING_BUFFERS; i-- > 0;) uring->freeBuffers.push_back(i);
+    } else {
+        uring->bufferMemory.reset();
+    }
+
+    std::vector<int> slots(URING_FILES, -1);
+    uring->fixedFiles = uring->ring.registerCall(IORING_REGISTER_FILES, slots.data(), URING_FILES) == 0;
+    if (uring->fixedFiles) {
+        for (int i = URING_FILES; i-- > 0;) uring->freeSlots.push_back(i);
+    }
+
+    reactor.uring = uring.release();
+    return true;
+}
+
+void destroyUringReactor(Reactor &reactor) {
+    delete reactor.uring;
+    reactor.uring = nullptr;
+}
+
+const char *uringFeatures(const Reactor &reactor) {
+    bool buffers = reactor.uring->fixedBuffers;
+    bool files = reactor.uring->fixedFiles;
+    if (buffers && files) return "registered buffers, fixed files";
+    if (buffers) return "registered buffers";
+    if (files) return "fixed files";
+    return "no registrations";
+}
+
+// Кладёт fd в свободный слот таблицы fixed files; -1 - слотов нет, работаем по fd
+static int attachFile(UringReactor &uring, int fd) {
+    if (!uring.fixedFiles || uring.freeSlots.empty()) return -1;
+    int slot = uring.freeSlots.back();
+    io_uring_files_update update{};
+    update.offset = slot;
+    update.fds = reinterpret_cast<uintptr_t>(&fd);
+    if (uring.ring.registerCall(IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) return -1;
+    uring.freeSlots.pop_back();
+    return slot;
+}
+
+static void detachFile(UringReactor &uring, int &slot) {
+    if (slot == -1) return;
+    int none = -1;
+    io_uring_files_update update{};
+    update.offset = slot;
+    update.fds = reinterpret_cast<uintptr_t>(&none);
+    uring.ring.registerCall(IORING_REGISTER_FILES_UPDATE, &update, 1);
+    uring.freeSlots.push_back(slot);
+    slot = -1;
+}
+
+// Память под чанк: зарегистрированный буфер, если есть свободный, иначе своя
+static void attachBuffer(UringReactor &uring, TransferChunk &chunk) {
+    if (chunk.data) return;
+    if (!uring.freeBuffers.empty()) {
+        chunk.bufferIndex = uring.freeBuffers.back();
+        uring.freeBuffers.pop_back();
+        chunk.data = uring.bufferMemory.get() + chunk.bufferIndex * URING_CHUNK;
+        return;
+    }
+    if (!chunk.heap) chunk.heap.reset(new char[URING_CHUNK]);
+    chunk.data = chunk.heap.get();
+}
+
+// Передача закончена: буферы и слот файла возвращаются реактору
+static void releaseTransfer(UringReactor &uring, Session &conn) {
+    for (TransferChunk &chunk : conn.io.chunks) {
+        if (chunk.bufferIndex != -1) uring.freeBuffers.push_back(chunk.bufferIndex);
+        chunk = TransferChunk{};
+    }
+    detachFile(uring, conn.io.fileSlot);
+    conn.io.transferStarted = false;
+}
+
+static io_uring_sqe *prepare(UringReactor &uring, Session &conn, uint8_t opcode, uint64_t op) {
+    io_uring_sqe *sqe = uring.ring.nextSqe();
+    sqe->opcode = opcode;
+    sqe->user_data = reinterpret_cast<uintptr_t>(&conn) | op;
+    ++conn.io.inflight;
+    return sqe;
+}
+
+static void setTarget(io_uring_sqe *sqe, int fd, int slot) {
+    if (slot != -1) {
+        sqe->fd = slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+}
+
+static void armAccept(UringReactor &uring, Reactor &reactor) {
+    uring.acceptLength = sizeof(uring.acceptAddr);
+    io_uring_sqe *sqe = uring.ring.nextSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor.listenSocket;
+    sqe->addr = reinterpret_cast<uintptr_t>(&uring.acceptAddr);
+    sqe->addr2 = reinterpret_cast<uintptr_t>(&uring.acceptLength);
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+// Мягкая остановка: висящий ACCEPT снимается, чтобы не забрать клиента из общей с преемником очереди
+static void cancelAccept(UringReactor &uring) {
+    io_uring_sqe *sqe = uring.ring.nextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = TAG_ACCEPT;
+    sqe->user_data = TAG_CANCEL;
+}
+
+static void armTick(UringReactor &uring) {
+    io_uring_sqe *sqe = uring.ring.nextSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uintptr_t>(&uring.tick);
+    sqe->len = 1;
+    sqe->user_data = TAG_TICK;
+}
+
+static void armTimers(UringReactor &uring, Reactor &reactor) {
+    int wait = timerWaitMs(reactor, 1000);
+    uint64_t at = reactor.nowMs + wait;
+    if (wait >= 1000 || uring.timersAt <= at) return;
+    uring.timersWait.tv_sec = 0;
+    uring.timersWait.tv_nsec = wait * 1000000L;
+    io_uring_sqe *sqe = uring.ring.nextSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uintptr_t>(&uring.timersWait);
+    sqe->len = 1;
+    sqe->user_data = TAG_TIMERS;
+    uring.timersAt = at;
+}
+
+static void armMailbox(UringReactor &uring, Reactor &reactor) {
+    io_uring_sqe *sqe = uring.ring.nextSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reactor.eventFd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&uring.mailboxCounter);
+    sqe->len = sizeof(uring.mailboxCounter);
+    sqe->user_data = TAG_MAILBOX;
+}
+
+// Порция ответов из io.sending; READY перед файлом уходит с MSG_MORE
+static void submitSend(UringReactor &uring, Session &conn) {
+    UringIo &io = conn.io;
+    bool more = conn.state == ConnState::Download && conn.downloadRemaining > 0;
+    io_uring_sqe *sqe = prepare(uring, conn, IORING_OP_SEND, OP_SEND);
+    setTarget(sqe, conn.fd, io.socketSlot);
+    sqe->addr = reinterpret_cast<uintptr_t>(io.sending.data() + io.sendOffset);
+    sqe->len = io.sending.size() - io.sendOffset;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    io.sendPending = true;
+}
+
+// В полёте один send на соединение; ответы, набранные за это время, ждут в outBuf
+static void flushOutput(UringReactor &uring, Session &conn) {
+    UringIo &io = conn.io;
+    if (io.sendPending || conn.outBuf.empty()) return;
+    std::swap(io.sending, conn.outBuf);
+    io.sendOffset = 0;
+    submitSend(uring, conn);
+}
+
+// Чтение файла в чанк или запись чанка в файл, с места, где остановилась прошлая операция
+static void submitFileIo(UringReactor &uring, Session &conn, int index, bool write) {
+    TransferChunk &chunk = conn.io.chunks[index];
+    bool fixed = chunk.bufferIndex != -1;
+    uint8_t opcode = write ? (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE)
+                           : (fixed ? IORING_OP_READ_FIXED : IORING_OP_READ);
+    io_uring_sqe *sqe = prepare(uring, conn, opcode, OP_CHUNK + index);
+    setTarget(sqe, write ? conn.uploadFd : conn.downloadFd, conn.io.fileSlot);
+    sqe->addr = reinterpret_cast<uintptr_t>(chunk.data + chunk.done);
+    sqe->len = chunk.length - chunk.done;
+    sqe->off = chunk.offset + chunk.done;
+    if (fixed) sqe->buf_index = chunk.bufferIndex;
+}
+
+// Остаток чанка в сокет, сколько пропустит ограничитель полосы; не пропустил - чанк
+// остаётся готовым, отправку продолжит таймер
+static void submitChunkSend(UringReactor &uring, Session &conn, int index) {
+    TransferChunk &chunk = conn.io.chunks[index];
+    size_t left = bandwidthFor(conn, chunk.length - chunk.done);
+    if (left == 0) {
+        chunk.state = ChunkState::Ready;
+        return;
+    }
+    io_uring_sqe *sqe = prepare(uring, conn, IORING_OP_SEND, OP_CHUNK + index);
+    setTarget(sqe, conn.fd, conn.io.socketSlot);
+    sqe->addr = reinterpret_cast<uintptr_t>(chunk.data + chunk.done);
+    sqe->len = left;
+    sqe->msg_flags = MSG_NOSIGNAL | (conn.downloadRemaining > (long) left ? MSG_MORE : 0);
+    chunk.state = ChunkState::Sending;
+    conn.io.sendPending = true;
+}
+
+static int freeChunk(const UringIo &io) {
+    for (int i = 0; i < 2; ++i) {
+        if (io.chunks[i].state == ChunkState::Free) return i;
+    }
+    return -1;
+}
+
+static bool chunksIdle(const UringIo &io) {
+    return io.chunks[0].state == ChunkState::Free && io.chunks[1].state == ChunkState::Free;
+}
+
+static void startTransfer(UringReactor &uring, Session &conn, int fileFd) {
+    if (conn.io.transferStarted) return;
+    conn.io.transferStarted = true;
+    if (fileFd != -1) conn.io.fileSlot = attachFile(uring, fileFd);
+}
+
+// Один recv на соединение: команды (и сжатое тело файла) читаются прямо в inBuf,
+// обычное тело файла - в свободный чанк
+static void armRecv(UringReactor &uring, Session &conn) {
+    UringIo &io = conn.io;
+    if (io.recvPending || conn.closing) return;
+
+    io_uring_sqe *sqe;
+    if (conn.state == ConnState::Command || (conn.state == ConnState::Upload && conn.uploadCompressed)) {
+        // Очередь ответов выше high-water: команды ждут в сокете
+        if (conn.readPaused) return;
+        if (conn.inBuf.size() >= SESSION_INPUT_LIMIT) {
+            sendMessage(conn, "ERROR: Line too long\n");
+            conn.closing = true;
+            flushOutput(uring, conn);
+            return;
+        }
+        char *space;
+        size_t room = conn.inBuf.prepare(SESSION_INPUT_LIMIT, space);
+        if (conn.state == ConnState::Upload && (room = bandwidthFor(conn, room)) == 0) return;
+        sqe = prepare(uring, conn, IORING_OP_RECV, OP_RECV);
+        sqe->addr = reinterpret_cast<uintptr_t>(space);
+        sqe->len = room;
+    } else if (conn.state == ConnState::Upload) {
+        // Пока один чанк пишется на диск, следующий принимается из сети
+        int index = freeChunk(io);
+        if (conn.uploadRemaining == 0 || index == -1) return;
+        size_t want = bandwidthFor(conn, std::min<long>(URING_CHUNK, conn.uploadRemaining));
+        if (want == 0) return;
+        startTransfer(uring, conn, conn.uploadFd);
+        TransferChunk &chunk = io.chunks[index];
+        attachBuffer(uring, chunk);
+        chunk.state = ChunkState::Receiving;
+        sqe = prepare(uring, conn, IORING_OP_RECV, OP_CHUNK + index);
+        sqe->addr = reinterpret_cast<uintptr_t>(chunk.data);
+        sqe->len = want;
+    } else {
+        // Во время DOWNLOAD и fsync следующие команды ждут в сокете
+        return;
+    }
+    setTarget(sqe, conn.fd, io.socketSlot);
+    io.recvPending = true;
+}
+
+void uringFinishUpload(Session &conn) {
+    UringReactor &uring = *conn.reactor->uring;
+    conn.state = ConnState::Syncing;
+    conn.io.syncFd = conn.uploadFd;
+    conn.uploadFd = -1;
+    io_uring_sqe *sqe = prepare(uring, conn, IORING_OP_FSYNC, OP_FSYNC);
+    setTarget(sqe, conn.io.syncFd, conn.io.fileSlot);
+}
+
+// Отдача файла: чтение с диска идёт на чанк впереди отправки, в сокет чанки уходят по порядку
+static void pumpDownload(UringReactor &uring, Session &conn) {
+    UringIo &io = conn.io;
+    if (conn.downloadCompressed) {
+        // Сжатие - работа процессора, не диска: блоки читаются и сжимаются в потоке реактора
+        // и уходят обычным send, следующая порция собирается, пока летит предыдущая
+        if (conn.closing) return;
+        while (conn.downloadRemaining > 0 && conn.outBuf.size() < URING_COMPRESSED_BATCH &&
+               bandwidthFor(conn, std::min<long>(LZ4_FRAME_BLOCK, conn.downloadRemaining)) > 0) {
+            if (!appendDownloadFrame(conn)) {
+                conn.closing = true;
+                return;
+            }
+        }
+        flushOutput(uring, conn);
+        if (conn.downloadRemaining == 0 && conn.outBuf.empty() && !io.sendPending) {
+            finishDownload(conn);
+            processInput(conn);
+            if (conn.state == ConnState::Download) pumpDownload(uring, conn);
+        }
+        return;
+    }
+    if (!io.transferStarted) {
+        startTransfer(uring, conn, conn.downloadFd);
+        io.readOffset = conn.downloadOffset;
+        io.readRemaining = conn.downloadRemaining;
+    }
+    flushOutput(uring, conn);
+
+    int index;
+    while (io.readRemaining > 0 && (index = freeChunk(io)) != -1) {
+        TransferChunk &chunk = io.chunks[index];
+        chunk.done = 0;
+        chunk.offset = io.readOffset;
+        chunk.order = io.nextOrder++;
+        if (conn.downloadFile) {
+            // Файл из кэша: читать нечего, чанк указывает прямо в его память
+            chunk.state = ChunkState::Ready;
+            chunk.data = conn.downloadFile->data.get() + io.readOffset;
+            chunk.length = std::min<long>(URING_CACHED_SEND, io.readRemaining);
+        } else {
+            attachBuffer(uring, chunk);
+            chunk.state = ChunkState::Reading;
+            chunk.length = std::min<long>(URING_CHUNK, io.readRemaining);
+            submitFileIo(uring, conn, index, false);
+        }
+        io.readOffset += chunk.length;
+        io.readRemaining -= chunk.length;
+    }
+
+    if (io.sendPending) return;
+    for (int i = 0; i < 2; ++i) {
+        if (io.chunks[i].state == ChunkState::Ready && io.chunks[i].order == io.sendOrder) {
+            submitChunkSend(uring, conn, i);
+            return;
+        }
+    }
+    if (conn.downloadRemaining == 0 && conn.outBuf.empty()) {
+        releaseTransfer(uring, conn);
+        finishDownload(conn);
+        processInput(conn);
+        // Следующая команда в конвейере могла снова оказаться DOWNLOAD
+        if (conn.state == ConnState::Download) pumpDownload(uring, conn);
+    }
+}
+
+// Докуда кусок UPLOAD лежит в файле подряд: чанки в записи ещё не дописаны
+static off_t uploadWrittenEnd(const Session &conn) {
+    off_t end = conn.uploadOffset;
+    for (const TransferChunk &chunk : conn.io.chunks) {
+        if (chunk.state == ChunkState::Writing) end = std::min<off_t>(end, chunk.offset + chunk.done);
+    }
+    return end;
+}
+
+// Закрывает соединение. SQE в полёте ссылаются на сессию и её буферы,
+// поэтому слот возвращается в пул только после последнего CQE.
+static void closeSession(UringReactor &uring, Session &conn) {
+    UringIo &io = conn.io;
+    if (!io.aborting) {
+        io.aborting = true;
+        conn.closing = true;
+        conn.reactor->timers.cancel(conn.timer);
+        // Висящие recv/send на сокете сразу завершатся
+        if (io.inflight > 0) shutdown(conn.fd, SHUT_RDWR);
+    }
+    if (io.inflight > 0) return;
+
+    abandonUpload(conn, uploadWrittenEnd(conn));
+    releaseTransfer(uring, conn);
+    detachFile(uring, io.socketSlot);
+    close(conn.fd);
+    conn.reactor->sessions.release(&conn);
+    releaseConnection();
+}
+
+void uringClose(Session &conn) {
+    closeSession(*conn.reactor->uring, conn);
+}
+
+// Продвигает соединение после любого события: ответы, передача файла, следующий recv
+static void advance(UringReactor &uring, Session &conn) {
+    if (conn.state == ConnState::Download) pumpDownload(uring, conn);
+    // Очередь ответов ушла ниже половины high-water - разбираем отложенные команды
+    if (conn.readPaused && conn.state == ConnState::Command && pendingOutput(conn) < outputHighWater() / 2) {
+        conn.readPaused = false;
+        processInput(conn);
+    }
+    flushOutput(uring, conn);
+    armRecv(uring, conn);
+    // QUIT закрывает соединение, как только ответы отправлены
+    if (conn.closing && !conn.io.sendPending && conn.outBuf.empty()) {
+        closeSession(uring, conn);
+    }
+}
+
+void uringResume(Session &conn) {
+    if (conn.io.aborting) return;
+    conn.lastActivity = conn.reactor->nowMs;
+    processInput(conn);
+    advance(*conn.reactor->uring, conn);
+}
+
+static bool onReceived(Session &conn, int res) {
+    conn.io.recvPending = false;
+    if (res <= 0) return false;
+    countMetric(Counter::TcpBytesIn, res);
+    if (conn.state == ConnState::Upload) chargeBandwidth(conn, res);
+    conn.inBuf.commit(res);
+    processInput(conn);
+    return true;
+}
+
+static bool onSent(Session &conn, int res) {
+    UringIo &io = conn.io;
+    io.sendPending = false;
+    if (res < 0) return false;
+    countMetric(Counter::TcpBytesOut, res);
+    io.sendOffset += res;
+    if (io.sendOffset < io.sending.size()) {
+        submitSend(*conn.reactor->uring, conn);
+    } else {
+        io.sending.clear();
+        io.sendOffset = 0;
+    }
+    return true;
+}
+
+// Итог fsync. Собравшее файл соединение ставит его на место, даже если клиент уже
+// отключился, - иначе файл так и остался бы .part
+static bool storeSynced(Session &conn, int res) {
+    bool ok = res == 0;
+    if (conn.uploadCommit) {
+        ok = storage().commitUpload(conn.uploadName, conn.io.syncFd, ok, conn.uploadCrc, conn.uploadWholeCrc);
+        conn.uploadCommit = false;
+    }
+    close(conn.io.syncFd);
+    conn.io.syncFd = -1;
+    return ok;
+}
+
+static void onSynced(UringReactor &uring, Session &conn, int res) {
+    releaseTransfer(uring, conn);
+    bool ok = storeSynced(conn, res);
+    conn.state = ConnState::Command;
+    sendUploadResult(conn, ok);
+    processInput(conn);
+}
+
+static bool onChunk(UringReactor &uring, Session &conn, int index, int res) {
+    UringIo &io = conn.io;
+    TransferChunk &chunk = io.chunks[index];
+    switch (chunk.state) {
+        case ChunkState::Receiving:
+            io.recvPending = false;
+            if (res <= 0) return false;
+            countMetric(Counter::TcpBytesIn, res);
+            chargeBandwidth(conn, res);
+            chunk.state = ChunkState::Writing;
+            chunk.length = res;
+            chunk.done = 0;
+            chunk.offset = conn.uploadOffset;
+            // Чанки принимаются строго по порядку, так что CRC считается потоком
+            conn.uploadCrc = crc32c(conn.uploadCrc, chunk.data, res);
+            conn.uploadOffset += res;
+            conn.uploadRemaining -= res;
+            submitFileIo(uring, conn, index, true);
+            return true;
+
+        case ChunkState::Writing:
+            if (res <= 0) {
+                LOG_ERROR("tcp", "upload_write_failed", "error=\"%s\"", strerror(-res));
+                sendMessage(conn, "ERROR: Could not write file\n");
+                conn.closing = true;
+                return true;
+            }
+            chunk.done += res;
+            if (chunk.done < chunk.length) {
+                submitFileIo(uring, conn, index, true);
+                return true;
+            }
+            chunk.state = ChunkState::Free;
+            if (conn.uploadRemaining == 0 && !io.recvPending && chunksIdle(io)) finishUpload(conn);
+            return true;
+
+        case ChunkState::Reading:
+            if (res <= 0) {
+                // res == 0: файл укоротился во время передачи - соединение уже не согласовано
+                LOG_ERROR("tcp", "read_failed", "error=\"%s\"", res == 0 ? "unexpected EOF" : strerror(-res));
+                return false;
+            }
+            chunk.done += res;
+            if (chunk.done < chunk.length) {
+                submitFileIo(uring, conn, index, false);
+                return true;
+            }
+            chunk.state = ChunkState::Ready;
+            chunk.done = 0;
+            return true;
+
+        case ChunkState::Sending:
+            io.sendPending = false;
+            if (res < 0) return false;
+            countMetric(Counter::TcpBytesOut, res);
+            chargeBandwidth(conn, res);
+            chunk.done += res;
+            conn.downloadOffset += res;
+            conn.downloadRemaining -= res;
+            conn.downloadSent += res;
+            if (chunk.done < chunk.length) {
+                submitChunkSend(uring, conn, index);
+                return true;
+            }
+            chunk.state = ChunkState::Free;
+            ++io.sendOrder;
+            return true;
+
+        default:
+            return true;
+    }
+}
+
+static void onAccept(Reactor &reactor, int res) {
+    UringReactor &uring = *reactor.uring;
+    NetAddress clientAddr = uring.acceptAddr;
+    if (!reactor.draining) armAccept(uring, reactor);
+    if (res < 0) {
+        // Снятый при drain ACCEPT завершается ECANCELED, а на закрытом сокете - EINVAL
+        if (res != -EINTR && res != -EAGAIN && !reactor.draining) {
+            LOG_WARN("tcp", "accept_failed", "error=\"%s\"", strerror(-res));
+        }
+        return;
+    }
+    countMetric(Counter::TcpAccepted);
+    if (!admitConnection(res)) {
+        close(res);
+        return;
+    }
+
+    Session *conn = reactor.sessions.acquire();
+    conn->fd = res;
+    conn->reactor = &reactor;
+    conn->io.socketSlot = attachFile(uring, res);
+    startSessionTimers(*conn);
+    char peer[INET6_ADDRSTRLEN];
+    LOG_INFO("tcp", "client_connected", "peer=%s reactor=%d engine=io_uring", clientAddr.host(peer), reactor.id);
+    armRecv(uring, *conn);
+}
+
+static void onCompletion(Reactor &reactor, const io_uring_cqe &cqe) {
+    UringReactor &uring = *reactor.uring;
+    if (cqe.user_data == TAG_ACCEPT) {
+        onAccept(reactor, cqe.res);
+        return;
+    }
+    if (cqe.user_data == TAG_TICK) {
+        armTick(uring);
+        return;
+    }
+    if (cqe.user_data == TAG_MAILBOX) {
+        armMailbox(uring, reactor);
+        runMailboxTasks(reactor);
+        return;
+    }
+    if (cqe.user_data == TAG_TIMERS) {
+        uring.timersAt = UINT64_MAX;
+        return;
+    }
+    if (cqe.user_data == TAG_CANCEL) return;
+
+    Session &conn = *reinterpret_cast<Session *>(cqe.user_data & ~OP_MASK);
+    uint64_t op = cqe.user_data & OP_MASK;
+    --conn.io.inflight;
+    conn.lastActivity = reactor.nowMs;
+    if (conn.io.aborting) {
+        if (op == OP_FSYNC) storeSynced(conn, cqe.res);
+        closeSession(uring, conn);
+        return;
+    }
+
+    bool alive = true;
+    if (op == OP_RECV) {
+        alive = onReceived(conn, cqe.res);
+    } else if (op == OP_SEND) {
+        alive = onSent(conn, cqe.res);
+    } else if (op == OP_FSYNC) {
+        onSynced(uring, conn, cqe.res);
+    } else {
+        alive = onChunk(uring, conn, int(op - OP_CHUNK), cqe.res);
+    }
+
+    if (!alive) {
+        closeSession(uring, conn);
+    } else {
+        advance(uring, conn);
+    }
+}
+
+void runUringReactor(Reactor &reactor) {
+    if (g_config.pinReactors) {
+        pinCurrentThread(reactorCpu(reactor.id));
+    }
+    UringReactor &uring = *reactor.uring;
+    updateReactorClock(reactor);
+    armAccept(uring, reactor);
+    armTick(uring);
+    armMailbox(uring, reactor);
+
+    while (!g_shutdown) {
+        if (g_draining) {
+            if (!reactor.draining) {
+                cancelAccept(uring);
+                beginDrain(reactor);
+            }
+            if (!drainReactor(reactor, [](Reactor &, Session &conn) { uringClose(conn); })) break;
+        }
+        armTimers(uring, reactor);
+        // Всё, что набрано за прошлую пачку CQE, уходит тем же вызовом, что ждёт следующую
+        int rc = uring.ring.submit(1);
+        if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY) {
+            LOG_ERROR("tcp", "uring_enter_failed", "error=\"%s\"", strerror(-rc));
+            break;
+        }
+        updateReactorClock(reactor);
+        uring.ring.drain([&reactor](const io_uring_cqe &cqe) { onCompletion(reactor, cqe); });
+        runTimers(reactor);
+    }
+
+    reactor.sessions.forEachLive([&reactor](Session &conn) {
+        reactor.timers.cancel(conn.timer);
+        close(conn.fd);
+        reactor.sessions.release(&conn);
+        releaseConnection();
+    });
+}
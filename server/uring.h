@@ -0,0 +1,24 @@
+#ifndef TCP_SERVER_URING_H
+#define TCP_SERVER_URING_H
+
+struct Reactor;
+struct Session;
+
+// Движок реактора на io_uring (--io-uring): accept, recv, send, чтение и запись
+// файлов и fsync уходят пачками SQE одним io_uring_enter на итерацию.
+// false - ядро не умеет нужного, реактор остаётся на epoll.
+bool initUringReactor(Reactor &reactor);
+void destroyUringReactor(Reactor &reactor);
+void runUringReactor(Reactor &reactor);
+
+// Строка состояния для журнала запуска: какие регистрации удались
+const char *uringFeatures(const Reactor &reactor);
+
+// Принятый файл целиком на диске у движка - fsync отдельным SQE вместо пула
+void uringFinishUpload(Session &conn);
+// Задача из пула для соединения выполнена: дослать ответ и продолжить разбор
+void uringResume(Session &conn);
+// Закрытие по таймауту: SQE в полёте отменяются, слот освобождается после последнего CQE
+void uringClose(Session &conn);
+
+#endif//TCP_SERVER_URING_H